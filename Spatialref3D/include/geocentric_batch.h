@@ -0,0 +1,68 @@
+/******************************************************************************
+ *
+ * Project:  OGR SpatialRef3D
+ * Purpose:  batch conversion between geodetic and geocentric coordinates
+ * Authors:  Peb Ruswono Aryan, Gottfried Mandlburger, Johannes Otepka
+ *
+ ******************************************************************************
+ * Copyright (c) 2012-2014,  I.P.F., TU Vienna.
+  *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ ****************************************************************************/
+#ifndef GEOCENTRIC_BATCH_H
+#define GEOCENTRIC_BATCH_H
+
+//! number of points converted together by the vectorized kernels
+#define GEOCENTRIC_BATCH_BLOCK 64
+
+//! levels of vectorization of the batch conversions, see geocentricBatchSIMD()
+#define GEOCENTRIC_SIMD_NONE 0
+#define GEOCENTRIC_SIMD_SSE2 1
+#define GEOCENTRIC_SIMD_AVX  2
+
+//! geodetic (x = longitude, y = latitude in radians, z = height) to geocentric coordinates
+/*!
+	Drop-in replacement of pj_geodetic_to_geocentric() with the same arguments,
+	return values and handling of HUGE_VAL and out of range points. Uses the
+	widest kernel the CPU runs up to the level nSIMD (see geocentricBatchKernel()),
+	the results differ from PROJ.4 only by the rounding of the sine and cosine
+	(well below 1e-6 m).
+*/
+int geodeticToGeocentricBatch(double a, double es, long point_count, int point_offset,
+							  double *x, double *y, double *z, int nSIMD);
+
+//! geocentric to geodetic coordinates (x = longitude, y = latitude in radians, z = height)
+/*!
+	Drop-in replacement of pj_geocentric_to_geodetic(). The latitude is iterated
+	like PROJ.4 does, every point stops after the same number of iterations as
+	it would there, so the results differ only by the rounding of the arc tangents.
+*/
+int geocentricToGeodeticBatch(double a, double es, long point_count, int point_offset,
+							  double *x, double *y, double *z, int nSIMD);
+
+//! function to parse a SPATIALREF3D_GEOCENTRIC_SIMD value (AUTO, AVX, SSE2 or NO) into a level
+int geocentricBatchSIMD(const char *pszSIMD);
+
+//! name of the kernel run by the batch conversions at level nSIMD: "AVX", "SSE2" or "NO" for PROJ.4
+/*!
+	The widest kernel up to nSIMD which is compiled in and which the CPU supports.
+*/
+const char *geocentricBatchKernel(int nSIMD);
+
+#endif
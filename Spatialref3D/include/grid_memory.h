@@ -0,0 +1,135 @@
+/******************************************************************************
+ *
+ * Project: OGR SpatialRef3D
+ * Purpose: process wide memory budget for grid data (vertical raster tiles,
+ *          horizontal grid shift tables), dropping the least recently used
+ *          data once the budget is exceeded
+ * Author: Peb Ruswono Aryan, Gottfried Mandlburger, Johannes Otepka
+ *
+ ******************************************************************************
+ * Copyright (c) 2012-2014,  I.P.F., TU Vienna.
+  *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ ******************************************************************************/
+#ifndef __GRID_MEMORY_H__
+#define __GRID_MEMORY_H__
+
+#include "cpl_port.h"
+
+//! default process wide memory budget (in bytes) of grid data
+#define GRID_MEMORY_MAX (1024*1024*1024)
+
+class GridMemoryClient;
+
+/**
+ * Memory accounted for one evictable block of grid data (e.g. a raster
+ * tile or a grid shift table), owned and embedded by the GridMemoryClient
+ * holding the data.
+ */
+struct GridMemoryEntry
+{
+	GridMemoryClient *poClient;	/**< owner of the data, called on eviction */
+	void *pData;			/**< block of data, for use by the owner */
+	GIntBig nBytes;			/**< bytes accounted while listed */
+	int nPinCount;			/**< number of users preventing eviction */
+	bool bListed;			/**< data is resident and accounted */
+
+	GridMemoryEntry *poPrev;	/**< more recently used entry in the list of the manager */
+	GridMemoryEntry *poNext;	/**< less recently used entry in the list of the manager */
+};
+
+/**
+ * Owner of grid data accounted by GridMemoryManager. Eviction runs in two
+ * steps so that owners with their own locks can take them without
+ * holding the lock of the manager.
+ */
+class GridMemoryClient
+{
+public:
+	virtual ~GridMemoryClient() {}
+
+	//! method called with the manager lock held once an unpinned entry is chosen for eviction
+	/*!
+		The entry is no longer listed. The owner either frees the data right
+		away or keeps it alive until EvictEntry() is called.
+	*/
+	virtual void DetachEntry(GridMemoryEntry *psEntry) = 0;
+
+	//! method called without the manager lock held to free the data of a detached entry
+	virtual void EvictEntry(GridMemoryEntry *psEntry) = 0;
+};
+
+/**
+ * Process wide memory budget shared by all vertical and horizontal grids.
+ * Owners list their resident data with Add() and touch it on access,
+ * once the sum exceeds the budget Enforce() drops the least recently used
+ * entries which are not pinned.
+ * The initial budget is taken from the SPATIALREF3D_GRID_MEMORY_MAX 
+ * configuration option (in megabytes) or GRID_MEMORY_MAX.
+ */
+class GridMemoryManager
+{
+public:
+	//! method to initialize an entry before its first use
+	static void InitEntry(GridMemoryEntry *psEntry, GridMemoryClient *poClient, void *pData);
+
+	//! method to list data which became resident
+	static void Add(GridMemoryEntry *psEntry, GIntBig nBytes);
+
+	//! method to unlist data freed by its owner, does nothing if the entry is not listed
+	static void Remove(GridMemoryEntry *psEntry);
+
+	//! method to mark an entry as the most recently used one
+	static void Touch(GridMemoryEntry *psEntry);
+
+	//! method to prevent eviction of an entry (resident or not) while it is used
+	/*!
+		\return true if the entry is listed, i.e. its data was added before
+		and is visible to the calling thread
+	*/
+	static bool Pin(GridMemoryEntry *psEntry);
+
+	//! method to drop a pin set by Pin()
+	static void Unpin(GridMemoryEntry *psEntry);
+
+	//! method to evict least recently used entries until the budget is kept
+	/*!
+		Must not be called while holding a lock taken by DetachEntry() or
+		EvictEntry() of any owner.
+	*/
+	static void Enforce();
+
+	//! method to wait until no eviction is running
+	/*!
+		Owners call this after removing their entries and before destroying
+		the state used by EvictEntry().
+	*/
+	static void WaitForEvictions();
+
+	//! method to set the memory budget, evicting data if needed
+	static void SetMemoryMax(GIntBig nBytes);
+
+	//! function to retrieve the memory budget
+	static GIntBig GetMemoryMax();
+
+	//! function to retrieve the number of bytes of listed data
+	static GIntBig GetMemoryUsed();
+};
+
+#endif
@@ -31,4 +31,46 @@
 //! function to do bilinear interpolation from 2x2 neighborhood
 double bilinearInterpolation(double p[4], double dx, double dy, double dNoDataValue);
 
+//! function to do bilinear interpolation of many points on one cell array
+/*!
+	Point i uses the 2x2 neighborhood starting at padData[panOffset[i]], its right
+	neighbor is panColStep[i] cells and its bottom neighbor panRowStep[i] cells away.
+	Uses SSE2, AVX or AVX2, whichever is the widest the CPU supports, results
+	are identical to calling bilinearInterpolation() for every point.
+*/
+void bilinearInterpolationBatch(int nCount, const double *padData, const int *panOffset,
+								const int *panColStep, const int *panRowStep,
+								const double *padDX, const double *padDY,
+								double dNoDataValue, double *padOut);
+
+//! float32 cell version of bilinearInterpolationBatch(), interpolation is done in double
+void bilinearInterpolationBatch(int nCount, const float *pafData, const int *panOffset,
+								const int *panColStep, const int *panRowStep,
+								const double *padDX, const double *padDY,
+								double dNoDataValue, double *padOut);
+
+//! function to do bilinear interpolation of many points on an array of float32 value pairs
+/*!
+	Point i uses the 2x2 neighborhood of pairs starting at pair panOffset[i], its
+	bottom neighbor is nRowStep pairs away. The first values of the pairs are
+	interpolated into padOut0, the second ones into padOut1. There is no nodata
+	handling. Uses SSE2, AVX or AVX2, whichever is the widest the CPU supports,
+	with the same results as the plain C path.
+*/
+void bilinearPairBatch(int nCount, const float *pafPairs, const int *panOffset, int nRowStep,
+						const double *padDX, const double *padDY,
+						double *padOut0, double *padOut1);
+
+//! bilinearPairBatch() also computing the derivatives of the interpolated surfaces
+/*!
+	padGrad0 and padGrad1 receive 3*nCount values each for the first and second
+	values of the pairs: the derivatives along padDX at [0, nCount), along padDY at
+	[nCount, 2*nCount) and the mixed second derivative, which is constant within a
+	cell, at [2*nCount, 3*nCount). Derivatives are per cell, not per unit.
+*/
+void bilinearPairGradientBatch(int nCount, const float *pafPairs, const int *panOffset, int nRowStep,
+								const double *padDX, const double *padDY,
+								double *padOut0, double *padOut1,
+								double *padGrad0, double *padGrad1);
+
 #endif
@@ -0,0 +1,74 @@
+/******************************************************************************
+ *
+ * Project: OGR SpatialRef3D
+ * Purpose: helper class for read-only memory mapping of grid files, so the
+ *          operating system page cache can share grid data between
+ *          processes without a private copy
+ * Author: Peb Ruswono Aryan, Gottfried Mandlburger, Johannes Otepka
+ *
+ ******************************************************************************
+ * Copyright (c) 2012-2014,  I.P.F., TU Vienna.
+  *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ ******************************************************************************/
+#ifndef __MAPPED_FILE_H__
+#define __MAPPED_FILE_H__
+
+#include "cpl_port.h"
+
+class MappedFile
+{
+	const GByte *pabyData;	/**< pointer to the first byte of the mapped file */
+	size_t nSize;			/**< size of the mapped file in bytes */
+
+	void *hFile;			/**< native file handle (WIN32 only) */
+	void *hMapping;			/**< native file mapping handle (WIN32 only) */
+public:
+	MappedFile();
+	virtual ~MappedFile();
+
+	//! method to map a whole file read-only into memory
+	/*!
+		\param pszFilename a string value indicating filename to be mapped
+		\param bOwnerOnly refuse files not owned by the current user (not checked on WIN32)
+		\return true if the file could be mapped
+		\sa Close()
+	*/
+	bool Open(const char *pszFilename, bool bOwnerOnly = false);
+
+	//! method to release the mapping
+	void Close();
+
+	//! function to retrieve the mapped file content
+	const GByte *GetData() { return pabyData; }
+
+	//! function to retrieve the size of the mapped file in bytes
+	size_t GetSize() { return nSize; }
+
+	//! function to create a new file readable and writable by the current user only
+	/*!
+		The file is created exclusively, an existing file or link of the
+		same name is never opened.
+		\param pszFilename a string value indicating filename to be created
+		\return a file opened for binary writing or NULL if it could not be created
+	*/
+	static FILE *CreatePrivate(const char *pszFilename);
+};
+
+#endif
@@ -36,6 +36,29 @@
 
 CPL_C_START
 
+/**
+ * Reusable buffers for the vertical correction of a batch of points, kept
+ * by the caller (e.g. one per coordinate transformation) so that repeated
+ * batches do not allocate. The buffers grow to the largest batch seen.
+ */
+class CPL_DLL VerticalScratch
+{
+public:
+	int nSize;				/**< number of points the buffers can hold */
+	double *padfCorr;		/**< correction of every point */
+	double *padfTemp;		/**< raster values of every point */
+	double *padfOutX;		/**< first coordinate of points outside the combined raster */
+	double *padfOutY;		/**< second coordinate of points outside the combined raster */
+	double *padfOutCorr;	/**< correction of points outside the combined raster */
+	int *panOutside;		/**< indices of points outside the combined raster */
+
+	VerticalScratch();
+	~VerticalScratch();
+
+	//! method to grow the buffers to hold at least nCount points
+	void Reserve(int nCount);
+};
+
 /************************************************************************/
 /*                         OGRSpatialReference3D                        */
 /************************************************************************/
@@ -63,6 +86,7 @@ class CPL_DLL OGRSpatialReference3D:public OGRSpatialReference
 {
 	bool bHasGeoid;		/**< flag to indicate the spatial reference has external geoid undulation model */
 	bool bHasVCorr;		/**< flag to indicate the spatial reference has external height correction model */
+	int nVerticalGeneration;	/**< number of times a geoid or height correction model was set */
 
 	double dfVOffset_;	/**< constant shift value as additional height correction */
 	double dfVScale_;	/**< constant scaling value as additional height correction (not used as of now) */
@@ -73,6 +97,11 @@ class CPL_DLL OGRSpatialReference3D:public OGRSpatialReference
 
 	RasterResampler  *poGeoid;	/**< pointer handle to RasterResampler object responsible for lookup from geoid undulation raster */
 	RasterResampler  *poVCorr;	/**< pointer handle to RasterResampler object responsible for lookup from height correction model raster */
+
+	bool bFuseModels;	/**< flag to indicate geoid, height correction and shift should be combined into one raster */
+	RasterResampler  *poFused;	/**< pointer handle to RasterResampler object on the combined raster, NULL if not in use */
+	volatile int nFusedBuilt;	/**< 1 if poFused is up to date with the models and the shift; set with a barrier after poFused */
+	void *hFusedMutex;	/**< mutex guarding the build and the reset of poFused */
 public:
 	OGRSpatialReference3D();
 	virtual    ~OGRSpatialReference3D();
@@ -140,6 +169,26 @@ public:
     */
 	bool HasVerticalModel();
 
+	//! function to get a counter of the changes of the external vertical models
+    /*!
+      Incremented every time a geoid or height correction model is set, the
+	  coordinate transformations compare it to rebuild what they derived from
+	  HasVerticalModel() when they were created.
+      \return number of times a vertical model was set
+	  \sa HasVerticalModel()
+    */
+	int GetVerticalGeneration();
+
+	//! function to check that the external vertical models can be read
+    /*!
+      Height models are opened on their first lookup, this opens them now.
+	  A model which cannot be read is reported through CPLError, and the
+	  vertical corrections (and so the coordinate transformations) using it fail.
+      \return OGRERR_NONE if every model which is set can be read
+	  \sa HasVerticalModel()
+    */
+	OGRErr ValidateVerticalModels();
+
 	//! used internally by implementation of OGRCoordinateTransformation3D
 	/*!
       \param is_inverse a boolean value indicating the direction of coordinate transformation.
@@ -147,10 +196,36 @@ public:
 	  \param x pointer to double or array of double for values of first coordinate axis
 	  \param y pointer to double or array of double for values of second coordinate axis
 	  \param z pointer to double or array of double for values of third coordinate axis
-	  \return OGRERR_NONE if transformation succesful
+	  \return OGRERR_NONE if transformation succesful, OGRERR_FAILURE with z unchanged
+	  if a model or a part of it needed by the points cannot be read (see ValidateVerticalModels())
     */
 	OGRErr ApplyVerticalCorrection(int is_inverse, unsigned int point_count, double *x, double *y, double *z);
 
+	//! used internally by implementation of OGRCoordinateTransformation3D, without allocating
+	/*!
+	  Same as ApplyVerticalCorrection() above but uses the buffers of psScratch, which
+	  the caller keeps for the next batch.
+	  \param psScratch buffers, grown to point_count if smaller
+	  \param point_offset distance between consecutive values of x, y and z in doubles,
+	  e.g. 3 for interleaved XYZ records
+    */
+	OGRErr ApplyVerticalCorrection(int is_inverse, unsigned int point_count, double *x, double *y, double *z, 
+								VerticalScratch *psScratch, int point_offset = 1);
+
+	//! used internally by implementation of OGRCoordinateTransformation3D when only the heights differ
+	/*!
+	  Same as ApplyVerticalCorrection() forward with this spatial reference followed by
+	  ApplyVerticalCorrection() inverse with poTarget, for points whose horizontal coordinates
+	  are the same in both. The two corrections are summed into one signed lookup:
+	  rasters used by both sides cancel out and are not read, and the vertical shifts are 
+	  combined into one constant. Debug mode and combined rasters apply both sides separately.
+	  \param poTarget spatial reference the heights are transformed to
+	  \param psScratch buffers, grown to point_count if smaller
+	  \param point_offset distance between consecutive values of x, y and z in doubles
+    */
+	OGRErr ApplyVerticalDifference(OGRSpatialReference3D *poTarget, unsigned int point_count, double *x, double *y, double *z, 
+								VerticalScratch *psScratch, int point_offset = 1);
+
 	//! method to set debug mode (retrieve raster values of the points in transformation)
     /*!
       \param debug_mode a boolean value indicating the status of debugging mode.
@@ -158,6 +233,9 @@ public:
     */
 	void SetDebug(bool debug_mode);
 
+	//! function to check whether debug mode is active
+	bool IsDebug();
+
 	//! method to supply data buffer used in debug mode.
     /*!
       \param geoid_undulation a pointer of double or array of double having the same number of points in transformation
@@ -166,6 +244,35 @@ public:
     */
 	void SetDebugData(double *geoid_undulation, double *vert_correction);
 
+	//! method to combine geoid, height correction and vertical shift into one raster
+    /*!
+      When set and both models are present, their sum plus the vertical shift is sampled
+	  once on the lattice of the finer model so every point needs a single lookup.
+	  Points outside the common area, points next to nodata cells of the finer model
+	  and debug mode use the separate models.
+	  The initial value is taken from the SPATIALREF3D_FUSE_VERTICAL configuration option.
+      \param fused_mode a boolean value indicating whether the models should be combined.
+	  \sa HasFusedModel()
+    */
+	void SetFusedModel(bool fused_mode);
+
+	//! function to check whether a combined raster is in use
+	bool HasFusedModel();
+
+	//! method to retrieve lookup, cache and I/O counters of the height model rasters
+    /*!
+      Counters belong to the raster file and include the lookups of every object 
+	  using the same file. Counters of models which are not set are zero.
+      \param psGeoid receives the counters of the geoid model raster, may be NULL.
+      \param psVCorr receives the counters of the height correction model raster, may be NULL.
+      \param psFused receives the counters of the combined raster (see SetFusedModel()), may be NULL.
+	  \sa ResetGridStats()
+    */
+	void GetGridStats(RasterGridStats *psGeoid, RasterGridStats *psVCorr, RasterGridStats *psFused);
+
+	//! method to set the counters of all height model rasters to zero
+	void ResetGridStats();
+
 protected:
 	//! function to check whether or not the spatial reference has additional geoid undulation model.
 	/*!
@@ -181,16 +288,113 @@ protected:
     */
 	bool HasVCorrModel();
 
+	//! method to drop the combined raster after a model or the shift changed
+	void UpdateFusedModel();
+
+	//! function to get the combined raster, building it on first use
+	RasterResampler *GetFusedModel();
+
+	//! method to look up the correction of every point in the combined raster into psScratch->padfCorr
+	OGRErr ComputeFusedCorrection(unsigned int point_count, double *x, double *y, int point_offset, VerticalScratch *psScratch);
+
+	//! method to look up the correction of every point in the separate models into dZCorr, dZTemp is scratch space
+	OGRErr ComputeSeparateCorrection(unsigned int point_count, double *x, double *y, int point_offset, double *dZCorr, double *dZTemp);
+
 	//deprecated
 	//double GetValueAt(GDALDataset* hDataset, double x, double y);
 };
 
+//! maximum number of iterations of an inverse horizontal grid shift
+#define GRIDSHIFT_MAX_ITERATIONS 10
+
+/**
+ * Counters of the inverse horizontal grid shifts (NTv1, NTv2, ctable) of a
+ * coordinate transformation, which solve for the source position of every
+ * point by Newton iteration.
+ */
+struct GridShiftStats
+{
+	GUIntBig nInversePoints;	/**< number of points shifted inversely, including failed ones */
+	GUIntBig nIterations;		/**< number of iterations (grid evaluations) of all these points */
+	GUIntBig anIterationCount[GRIDSHIFT_MAX_ITERATIONS];	/**< number of converged points which took i+1 iterations */
+	GUIntBig nEdgeFallbacks;	/**< number of points whose iteration left the grid, they get the first order approximation */
+	GUIntBig nNotConverged;		/**< number of points which did not converge, they are left unshifted */
+};
+
 class CPL_DLL OGRCoordinateTransformation3D:public OGRCoordinateTransformation
 {
 public:
 	OGRCoordinateTransformation3D();
+
+	//! method to transform interleaved point records in place
+	/*!
+	  Same as TransformEx() but the coordinates of consecutive points are nStrideBytes
+	  apart, e.g. for records {x, y, z, ...} pass &rec[0].x, &rec[0].y, &rec[0].z and
+	  sizeof(rec[0]). All stages, including the vertical correction, work on the 
+	  records directly without copying them into separate arrays.
+	  \param nCount number of points
+	  \param x pointer to the first coordinate of the first point
+	  \param y pointer to the second coordinate of the first point
+	  \param z pointer to the third coordinate of the first point, or NULL
+	  \param nStrideBytes distance between consecutive points in bytes, a multiple of sizeof(double)
+	  \param panSuccess optional array of nCount ints (contiguous) receiving the status of every point
+	  \return TRUE if the transformation could be run
+	*/
+	virtual int TransformStrided(int nCount, double *x, double *y, double *z, 
+								int nStrideBytes, int *panSuccess = NULL) = 0;
+
+	//! method to transform points from source arrays into separate output arrays
+	/*!
+	  Same as TransformEx() but the input arrays are left untouched, the first stage
+	  (longitude wrapping and degree to radian conversion) reads them and writes the 
+	  output arrays, so no copy pass is needed. The input may be read-only memory.
+	  An output array may be the same as its input array.
+	  \param nCount number of points
+	  \param xIn, yIn, zIn source coordinates, zIn may be NULL
+	  \param xOut, yOut, zOut arrays of nCount values receiving the result, zOut must be NULL if zIn is
+	  \param panSuccess optional array of nCount ints receiving the status of every point
+	  \return TRUE if the transformation could be run
+	*/
+	virtual int TransformTo(int nCount, const double *xIn, const double *yIn, const double *zIn,
+							double *xOut, double *yOut, double *zOut, int *panSuccess = NULL) = 0;
+
+	//! method to set the number of threads a batch is split over
+	/*!
+	  Batches of at least twice TRANSFORM_MIN_CHUNK points are split into contiguous
+	  chunks run on a process wide pool of threads, every chunk with its own PROJ.4 
+	  context and scratch buffers. The result does not depend on the thread count.
+	  Batches stay on the calling thread while the source or target is in debug mode.
+	  The initial count is taken from the SPATIALREF3D_TRANSFORM_THREADS configuration
+	  option (a number or ALL_CPUS), default 1.
+	  \param nThreadCount number of threads, 1 to disable
+	  \sa GetThreadCount()
+	*/
+	virtual void SetThreadCount(int nThreadCount) = 0;
+
+	//! function to retrieve the number of threads a batch is split over
+	virtual int GetThreadCount() = 0;
+
+	//! method to retrieve the counters of the inverse grid shifts done by this transformation
+	/*!
+	  Counts the points of all batches (and threads) since the transformation was
+	  created or ResetGridShiftStats() was called. Must not be called while a batch 
+	  is being transformed.
+	  \param psStats receives the counters
+	*/
+	virtual void GetGridShiftStats(GridShiftStats *psStats) = 0;
+
+	//! method to set the counters of the inverse grid shifts to zero
+	virtual void ResetGridShiftStats() = 0;
 };
 
+//! function to create a transformation between two 3D spatial references
+/*!
+  The steps of the transformation are chosen here, including whether the geoid
+  and height correction models of poSource and poTarget are applied. They are
+  chosen again by the next transformation call if a model is set on poSource or
+  poTarget afterwards (see OGRSpatialReference3D::GetVerticalGeneration()). The
+  steps are reported with CPLDebug() under OGRCT3D.
+*/
 CPL_DLL OGRCoordinateTransformation3D *
 OGRCreateCoordinateTransformation3D( OGRSpatialReference3D *poSource,
                                    OGRSpatialReference3D *poTarget );
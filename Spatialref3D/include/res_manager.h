@@ -30,29 +30,56 @@
 #ifndef __RES_MANAGER_H__
 #define __RES_MANAGER_H__
 
-#include "gdal_priv.h"
-#include "ogr_core.h"
-#include "cpl_string.h"
+#include "vertical_grid.h"
 
-class RasterResampler
+//! maximum number of cells of a composite grid made by RasterResampler::CreateComposite()
+#define RESAMPLER_COMPOSITE_MAX_CELLS (16*1024*1024)
+
+/**
+ * Sort key of one point of a batch lookup, points are grouped by the
+ * Morton code of the tile they fall into.
+ */
+struct RasterPointKey
 {
-	CPLString sFilename;	/**< string value containing filename of raster */
+	GUIntBig nKey;			/**< Morton code of the tile, ~0 if outside the raster */
+	int nIndex;				/**< position of the point in the batch */
+
+	bool operator<(const RasterPointKey &other) const { return nKey < other.nKey; }
+};
 
-	GDALDataset *poData;	
-	int nRasterWidth;		
-	int nRasterHeight;		
-	bool bIsSmall;			/**< is raster small enough to be kept in memory (decided when prepare) */
+/**
+ * Scratch buffers of one batch lookup, kept on a free list of the
+ * RasterResampler so that repeated batches do not allocate.
+ */
+struct RasterScratch
+{
+	int nSize;				/**< number of points the buffers can hold */
+	double *padPixel;		/**< pixel positions */
+	double *padLine;		/**< line positions */
+	RasterPointKey *pasKeys;	/**< sort keys */
+	RasterPointKey *pasSortKeys;	/**< merge buffer of the sort keys */
+	int *panIndex;			/**< point indices in tile order */
+
+	RasterScratch *poNext;	/**< next free scratch set */
+};
 
-	//double dGeotrans[6];	// do we need to keep this here or local variable is enough ?
-	double dNoDataValue;
-	double dInvGeotrans[6];	/**< Inverse geotransform used for MapToRaster coordinate transform */
+/**
+ * Lookup cursor on a shared VerticalGrid. Every user (e.g. geoid and
+ * vertical correction model of an OGRSpatialReference3D) owns its own
+ * RasterResampler, rasters opened by several of them are loaded only once.
+ * The lookup methods may be called from several threads at once.
+ */
+class RasterResampler
+{
+	CPLString sFilename;	/**< string value containing filename of raster */
+	VerticalGrid *poGrid;	/**< shared grid data, NULL if not opened (yet) */
+	volatile int nOpenTried;	/**< 1 once poGrid has been acquired, or failed to; set with a barrier after poGrid */
+	void *hOpenMutex;		/**< mutex guarding the first acquisition of poGrid */
+	GIntBig nPendingCacheMax;	/**< budget set before the grid was opened, -1 if none */
 
-	double *padWindow;		/**< pointer to cached raster block of nWndWidth x nWndHeight size */
+	void *hScratchMutex;	/**< mutex guarding poFreeScratch */
+	RasterScratch *poFreeScratch;	/**< scratch buffer sets not in use by a batch */
 
-	int nWndXOffset;		/**< left position of cached raster block window */
-	int nWndYOffset;		/**< top position of cached raster block window */
-	int nWndWidth;			/**< width of cached raster block window */
-	int nWndHeight;			/**< height of cahced raster block window */
 public:
 	RasterResampler();
 	virtual ~RasterResampler();
@@ -61,16 +88,57 @@ public:
 	double GetValueAt(double x, double y);
 
 	//! function to retrieve raster value at given array of points (x, y) and store in z
-	void GetValueAt(int point_count, double *x, double *y, double *z);
+	/*!
+		Points are grouped by the cache tile they fall into, so every tile
+		is fetched at most once per call regardless of the point order.
+		\param point_offset distance between consecutive x (and y) values in
+		doubles, e.g. 3 for interleaved XYZ records; z is always contiguous
+		\return OGRERR_FAILURE if the raster, or the part of it needed by
+		the points, cannot be read; z is set to 0 for the points affected
+	*/
+	OGRErr GetValueAt(int point_count, double *x, double *y, double *z, int point_offset = 1);
+
+	//! function to retrieve raster value at points which can be interpolated without leaving the raster
+	/*!
+		Points outside the hull of the cell centers, or next to a nodata cell,
+		keep their z value.
+		\param panOutside receives the indices of points outside, in input order
+		\param point_offset distance between consecutive x (and y) values in doubles
+		\return number of points outside, -1 if a part of the raster could not be read
+	*/
+	int GetValueInside(int point_count, double *x, double *y, double *z, int *panOutside, int point_offset = 1);
+
+	//! function to create a lookup on the sum of two rasters and a constant
+	/*!
+		The sum is sampled once on the lattice of the finer raster where both
+		rasters overlap and kept in memory (see VerticalGrid::CreateComposite()).
+		\return a new RasterResampler or NULL if no composite can be made
+	*/
+	static RasterResampler *CreateComposite(RasterResampler *poFirst, RasterResampler *poSecond, double dfOffset);
 
 	//! method to load GDAL compatible raster
 	/*!
+		Only the existence of the file is checked here, the raster is opened
+		on the first lookup. It is shared with all other RasterResampler 
+		objects which opened the same file.
+		Raw float32 grids (EHdr .flt/.bil with a .hdr header, NOAA .gtx)
+		are memory mapped and read in place unless the SPATIALREF3D_GRID_MMAP
+		configuration option is set to NO, all other rasters are read through GDAL.
 		\param pszFilename a string value indicating filename of raster
-		\return OGRERR_NONE if loading successful or OGRERR_FAILURE otherwise
-		\sa GetFilename()
+		\return OGRERR_NONE if the file exists or OGRERR_FAILURE otherwise
+		\sa GetFilename(), IsValid()
 	*/
 	OGRErr Open(const char *pszFilename);
 
+	//! function to check that the raster can be read
+	/*!
+		Opens the raster if it has not been opened yet. A raster which exists
+		but cannot be read fails here (and reports a CPLError once) instead
+		of in Open().
+		\return false if no raster is loaded
+	*/
+	bool IsValid();
+
 	//! function to retrieve raster filename
 	/*!
 		\return a string indicating filename of loaded raster
@@ -78,21 +146,53 @@ public:
 	*/
 	const char* GetFilename();
 
+	//! method to set the memory budget of the tile cache
+	/*!
+		\param nBytes maximum number of bytes held by cached tiles.
+		The budget belongs to the shared grid and applies to all of its users.
+		The initial budget is taken from the SPATIALREF3D_GRID_CACHE_MAX
+		configuration option (in megabytes) or RESAMPLER_CACHE_MAX.
+		\sa GetCacheMax()
+	*/
+	void SetCacheMax(GIntBig nBytes);
+
+	//! function to retrieve the memory budget of the tile cache
+	GIntBig GetCacheMax();
+
+	//! method to retrieve lookup, cache and I/O counters of the raster
+	/*!
+		The counters belong to the shared grid and include the lookups of
+		all of its users. All counters are zero if no raster is loaded.
+		\param psStats receives the counters
+		\sa ResetStats()
+	*/
+	void GetStats(RasterGridStats *psStats);
+
+	//! method to set the counters of the raster to zero
+	void ResetStats();
+
 protected:
-	//! function to lookup raster value from given point in map space
-	double GetValueResampled(double x, double y);
+	//! function to get the grid, opening the raster on first use
+	VerticalGrid *GetGrid();
+
+	//! function to run a batch lookup, see GetValueAt() and GetValueInside()
+	int LookupBatch(int point_count, double *x, double *y, double *z, int *panOutside, int point_offset);
 
-	//! caching utilities
-	void Prepare();
+	//! function to compute the Morton (Z-order) code of a tile position
+	static GUIntBig MortonCode(int nTileX, int nTileY);
 
-	//! method to allocate and move raster block from file to memory
-	void Request(int left, int top, int width, int height);
+	//! function to sort keys by tile, keeping the input order within a tile
+	/*!
+		Merge sort using pasTemp (nCount keys) as second buffer, nothing is allocated.
+		\return pasKeys or pasTemp, whichever holds the sorted keys
+	*/
+	static RasterPointKey *SortKeys(RasterPointKey *pasKeys, RasterPointKey *pasTemp, int nCount);
 
-	//! method to release allocated buffer for storing cached raster block
-	void Cleanup();
+	//! function to get scratch buffers for a batch of nCount points
+	RasterScratch *AcquireScratch(int nCount);
 
-	//! function to convert coordinate from map space (lon, lat) to raster space (pixel, line)
-	void MapToRaster(double *x, double *y);
+	//! method to return scratch buffers obtained by AcquireScratch()
+	void ReleaseScratch(RasterScratch *psScratch);
 };
 
 
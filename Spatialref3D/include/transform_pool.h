@@ -0,0 +1,66 @@
+/******************************************************************************
+ *
+ * Project: OGR SpatialRef3D
+ * Purpose: persistent pool of worker threads running the chunks of a
+ *          coordinate transformation batch
+ * Author: Peb Ruswono Aryan, Gottfried Mandlburger, Johannes Otepka
+ *
+ ******************************************************************************
+ * Copyright (c) 2012-2014,  I.P.F., TU Vienna.
+  *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ ******************************************************************************/
+#ifndef __TRANSFORM_POOL_H__
+#define __TRANSFORM_POOL_H__
+
+#include "cpl_port.h"
+
+//! smallest number of points handed to one worker
+#define TRANSFORM_MIN_CHUNK 4096
+
+//! function run by the pool for every task of a batch
+typedef void (*TransformTaskFunc)(void *pArg);
+
+/**
+ * Process wide pool of worker threads. Threads are started on demand and
+ * kept for the lifetime of the process, so repeated batches do not pay
+ * for thread creation. Several batches (e.g. of different coordinate
+ * transformations) may run at once, their tasks are taken in arrival order.
+ */
+class TransformWorkerPool
+{
+public:
+	//! method to run tasks on the pool and wait until all of them are done
+	/*!
+		The calling thread runs tasks of its own batch as well, so at most
+		nTasks-1 pool threads are used.
+		\param nTasks number of tasks
+		\param pfnTask function called once for every task
+		\param papArgs argument of every task
+	*/
+	static void Run(int nTasks, TransformTaskFunc pfnTask, void **papArgs);
+
+	//! function to parse a thread count (a number or ALL_CPUS)
+	/*!
+		\return the number of threads, at least 1
+	*/
+	static int ParseThreadCount(const char *pszValue);
+};
+
+#endif
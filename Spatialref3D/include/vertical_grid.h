@@ -0,0 +1,315 @@
+/******************************************************************************
+ *
+ * Project: OGR SpatialRef3D
+ * Purpose: grid data of a lookup raster (Geoid, vertical correction) shared by
+ *          all RasterResampler objects which use the same file, with a tile
+ *          cache holding portions of the raster in memory
+ * Author: Peb Ruswono Aryan, Gottfried Mandlburger, Johannes Otepka
+ *
+ ******************************************************************************
+ * Copyright (c) 2012-2014,  I.P.F., TU Vienna.
+  *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ ******************************************************************************/
+#ifndef __VERTICAL_GRID_H__
+#define __VERTICAL_GRID_H__
+
+#include "gdal_priv.h"
+#include "ogr_core.h"
+#include "cpl_string.h"
+#include "mapped_file.h"
+#include "grid_memory.h"
+
+//! size (in pixels) of one square block kept in the tile cache
+#define RESAMPLER_TILE_SIZE 256
+
+//! default memory budget (in bytes) of the tile cache of one raster
+#define RESAMPLER_CACHE_MAX (64*1024*1024)
+
+//! int16 value marking nodata cells of scaled tiles
+#define RESAMPLER_INT16_NODATA (-32768)
+
+//! number of independently locked parts of the tile cache of one raster
+#define RESAMPLER_CACHE_SHARDS 16
+
+//! number of points of one tile interpolated together in a batch lookup
+#define RESAMPLER_BATCH_SIZE 64
+
+/**
+ * A block of raster cells held in the tile cache of VerticalGrid.
+ * Every tile covers RESAMPLER_TILE_SIZE x RESAMPLER_TILE_SIZE cells plus
+ * a halo of one cell on its right and bottom edge, so the 2x2 neighborhood
+ * of any cell inside the tile never crosses a tile boundary.
+ * Cells are kept as float32, or as int16 steps of dScale around dOffset
+ * when SPATIALREF3D_GRID_INT16_ERROR is set and the tile value range fits.
+ * Cell values are never changed once the tile is loaded; readers pin the
+ * tile while interpolating so eviction cannot free it under them.
+ * Loaded tiles are also accounted in the process wide GridMemoryManager.
+ */
+struct RasterTile
+{
+	int nTileX;				/**< column index of the tile */
+	int nTileY;				/**< row index of the tile */
+	int nXOffset;			/**< left position of the tile in the raster */
+	int nYOffset;			/**< top position of the tile in the raster */
+	int nWidth;				/**< width of the tile including halo */
+	int nHeight;			/**< height of the tile including halo */
+	float *pafData;			/**< cell values, nWidth x nHeight, NULL if scaled */
+	GInt16 *panData;		/**< scaled cell values (dOffset + dScale*value), NULL if float32 */
+	double dOffset;			/**< offset of scaled cell values */
+	double dScale;			/**< scale of scaled cell values */
+	int nBytes;				/**< memory held by the cell values */
+	volatile int nRefCount;	/**< one reference held by the cache plus one per pinning reader */
+	GridMemoryEntry sMemory;	/**< accounting in the process wide memory budget */
+
+	RasterTile *poPrev;		/**< more recently used tile in LRU list */
+	RasterTile *poNext;		/**< less recently used tile in LRU list */
+};
+
+/**
+ * Counters of the lookups and tile cache activity of one VerticalGrid.
+ * Hits and misses count tile requests, a batch lookup requests every tile
+ * once, a single point lookup once per point.
+ */
+struct RasterGridStats
+{
+	GUIntBig nLookups;		/**< number of points looked up */
+	GUIntBig nOutside;		/**< number of looked up points outside the coverage of the raster */
+	GUIntBig nCacheHits;	/**< number of tile requests served from the cache */
+	GUIntBig nCacheMisses;	/**< number of tile requests which had to load the tile */
+	GUIntBig nTilesLoaded;	/**< number of tiles read from the raster */
+	GUIntBig nTilesEvicted;	/**< number of tiles dropped from the cache */
+	GUIntBig nBytesRead;	/**< number of cell bytes read from the raster */
+	double dIOSeconds;		/**< wall clock time spent reading from the raster */
+};
+
+/**
+ * Part of the tile cache of a VerticalGrid holding every tile whose index
+ * modulo RESAMPLER_CACHE_SHARDS equals the shard number, with its own lock,
+ * LRU list and share of the memory budget.
+ */
+struct RasterCacheShard
+{
+	void *hMutex;			/**< mutex guarding the shard */
+	RasterTile *poMRU;		/**< most recently used tile (head of LRU list) */
+	RasterTile *poLRU;		/**< least recently used tile (tail of LRU list) */
+	GIntBig nCacheUsed;		/**< number of bytes held by tiles of the shard */
+	RasterGridStats sStats;	/**< tile and I/O counters of the shard */
+};
+
+/**
+ * Read-only data of one lookup raster. Grids are shared process wide:
+ * Acquire() returns the grid already opened for the same file (compared by
+ * canonical path) or opens it, Release() drops the reference and closes the
+ * grid once it is no longer used. All lookup methods may be called from
+ * several threads at once: the tile cache is split into shards with their
+ * own lock, which is only held to find or load a tile, and memory mapped
+ * grids are read without locking.
+ * Tiles are dropped when the grid exceeds its own budget (SetCacheMax()) or
+ * when all grids together exceed the GridMemoryManager budget.
+ */
+class VerticalGrid : public GridMemoryClient
+{
+	CPLString sFilename;	/**< string value containing filename of raster */
+	CPLString sKey;			/**< canonical path used as registry key */
+	int nRefCount;			/**< number of RasterResampler objects using this grid */
+	void *hIOMutex;			/**< mutex serializing reads from poData */
+	volatile int nReadFailures;	/**< number of tiles which could not be read from poData */
+
+	GDALDataset *poData;	
+	int nRasterWidth;		
+	int nRasterHeight;		
+
+	double dNoDataValue;
+	double dCellNoData;		/**< nodata value as stored in float32 cells */
+	bool bNoDataCells;		/**< false if the grid is known to have no nodata cell */
+	double dInt16MaxError;	/**< maximum error of scaled int16 tiles, 0 to keep float32 */
+	double dGeotrans[6];	/**< geotransform of the raster (in degrees) */
+	double dInvGeotrans[6];	/**< Inverse geotransform used for MapToRaster coordinate transform */
+
+	int nTilesPerRow;		/**< number of tile columns covering the raster */
+	int nTilesPerColumn;	/**< number of tile rows covering the raster */
+	RasterTile **papoTiles;	/**< tile index (nTilesPerRow x nTilesPerColumn), NULL if not cached */
+
+	RasterCacheShard asShards[RESAMPLER_CACHE_SHARDS];	/**< independently locked parts of the tile cache */
+	GIntBig nCacheMax;		/**< maximum number of bytes held by cached tiles */
+
+	void *hStatsMutex;		/**< mutex guarding sLookupStats */
+	RasterGridStats sLookupStats;	/**< lookup counters, tile counters are kept by the shards */
+
+	MappedFile *poMapped;	/**< mapped raw float32 raster (EHdr, GTX), NULL if read through GDAL */
+	float *pafResident;		/**< cells of a grid computed in memory (composite), NULL otherwise */
+	const GByte *pabyFirstLine;	/**< first cell of the top raster line of mapped or resident cells, NULL if cached in tiles */
+	int nLineOffset;		/**< bytes from one raster line to the next (negative for bottom-up files) */
+	bool bSwapCells;		/**< mapped cells are not in native byte order */
+
+	VerticalGrid();
+	~VerticalGrid();
+
+public:
+	//! function to get the shared grid of a raster file, opening it on first use
+	/*!
+		\param pszFilename a string value indicating filename of raster
+		\return the grid or NULL if the raster cannot be opened
+		\sa Release()
+	*/
+	static VerticalGrid *Acquire(const char *pszFilename);
+
+	//! method to drop a reference obtained by Acquire(), the last one closes the grid
+	static void Release(VerticalGrid *poGrid);
+
+	//! method to register the GDAL drivers used for reading rasters, once per process
+	/*!
+		All drivers are registered unless the SPATIALREF3D_GDAL_DRIVERS
+		configuration option is set to GRID, which only registers the
+		drivers of common height model formats (EHdr, GTiff, GTX).
+		Called by Acquire() before the first raster is opened through GDAL.
+	*/
+	static void RegisterDrivers();
+
+	//! function to sample the sum of two grids and an offset on the lattice of the finer grid
+	/*!
+		The composite covers the cell centers of the finer grid lying inside
+		the cell centers of the coarser grid, cells are kept in memory.
+		\param poFirst first grid to add
+		\param poSecond second grid to add
+		\param dfOffset constant added to every cell
+		\param nMaxCells maximum number of cells of the composite
+		\return a grid with one reference owned by the caller (see Release())
+		or NULL if the grids do not overlap, are rotated or the lattice is too large
+	*/
+	static VerticalGrid *CreateComposite(VerticalGrid *poFirst, VerticalGrid *poSecond, 
+										double dfOffset, GIntBig nMaxCells);
+
+	//! function to retrieve raster filename
+	const char* GetFilename();
+
+	//! function to retrieve raster width in pixels
+	int GetWidth() { return nRasterWidth; }
+
+	//! function to retrieve raster height in pixels
+	int GetHeight() { return nRasterHeight; }
+
+	//! function to convert coordinate from map space (lon, lat) to raster space (pixel, line)
+	void MapToRaster(double *x, double *y);
+
+	//! function to lookup raster value from given point in raster space
+	double GetValue(double x, double y);
+
+	//! function to check whether one of the cells interpolated at a point in raster space is nodata
+	/*!
+		The point must lie inside the hull of the cell centers.
+	*/
+	bool TouchesNoData(double x, double y);
+
+	//! method to lookup raster values of points panIndex[0..nCount-1] falling into one tile
+	/*!
+		\return false (and the values set to 0) if the tile could not be read
+	*/
+	bool GetValues(int nCount, const int *panIndex, 
+					const double *padPixel, const double *padLine, double *padZ);
+
+	//! method to set the memory budget of the tile cache
+	void SetCacheMax(GIntBig nBytes);
+
+	//! function to retrieve the memory budget of the tile cache
+	GIntBig GetCacheMax();
+
+	//! method to count lookups made by a user of the grid
+	/*!
+		Counted once per call by RasterResampler, so that the lock is taken
+		once per batch rather than once per point.
+		\param nCount number of points looked up
+		\param nOutside number of those points outside the coverage of the grid
+	*/
+	void AddLookups(int nCount, int nOutside);
+
+	//! method to retrieve the counters of all users of the grid since opening or the last ResetStats()
+	void GetStats(RasterGridStats *psStats);
+
+	//! method to set all counters to zero
+	void ResetStats();
+
+protected:
+	//! method to load GDAL compatible raster
+	OGRErr Open(const char *pszFilename);
+
+	//! function to lookup raster value from given point in raster space using a cached tile
+	double GetValueResampled(RasterTile *poTile, double x, double y);
+
+	//! method to lookup raster values of several points falling into one cached tile
+	void GetValuesResampled(RasterTile *poTile, int nCount, const int *panIndex, 
+							const double *padPixel, const double *padLine, double *padZ);
+
+	//! function to lookup raster value from given point in raster space using the mapped file
+	double GetValueMapped(double x, double y);
+
+	//! function to read one cell of the raster
+	double GetCell(int px, int py);
+
+	//! function to read one cell of a cached tile
+	double GetTileCell(RasterTile *poTile, int nOffset);
+
+	//! method to convert a loaded tile to scaled int16 cells if its value range allows
+	void ScaleTile(RasterTile *poTile);
+
+	//! function to read one cell of the mapped file
+	double GetMappedCell(int px, int py);
+
+	//! method to map a raw float32 grid, returns false if the file is not such a grid
+	bool OpenMapped(const char *pszFilename);
+
+	//! function to read the layout of an EHdr raster from its .hdr file
+	bool ReadEHdrHeader(const char *pszFilename, double *padfGeoTransform, GIntBig *pnDataOffset, bool *pbMSB);
+
+	//! function to read the layout of a NOAA .gtx raster from its header
+	bool ReadGTXHeader(double *padfGeoTransform, GIntBig *pnDataOffset);
+
+	//! caching utilities
+	void Prepare();
+
+	//! function to retrieve and pin the cached tile containing the given cell, loading it if needed
+	/*!
+		\return the tile or NULL if the cell is outside the raster or the tile could not be read
+	*/
+	RasterTile *GetTile(int px, int py);
+
+	//! method to unpin a tile returned by GetTile()
+	void ReleaseTile(RasterTile *poTile);
+
+	//! method to allocate and move one raster block from file to memory, NULL if it cannot be read
+	RasterTile *LoadTile(RasterCacheShard *psShard, int nTileX, int nTileY);
+
+	//! method to drop least recently used tiles until the shard fits its share of nCacheMax
+	void EvictTiles(RasterCacheShard *psShard, GIntBig nBytesNeeded);
+
+	//! method to unlink a tile from the cache of its shard and drop the cache reference, called with the shard mutex held
+	void UnlinkTile(RasterCacheShard *psShard, RasterTile *poTile);
+
+	//! method to release all cached tiles
+	void Cleanup();
+
+	//! method to keep a tile chosen for eviction by GridMemoryManager alive
+	virtual void DetachEntry(GridMemoryEntry *psEntry);
+
+	//! method to drop a tile chosen for eviction by GridMemoryManager
+	virtual void EvictEntry(GridMemoryEntry *psEntry);
+};
+
+#endif
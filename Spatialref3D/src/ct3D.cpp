@@ -34,7 +34,18 @@
 #include "cpl_conv.h"
 #include "cpl_string.h"
 #include "cpl_multiproc.h"
-
+#include "cpl_atomic_ops.h"
+#include "cpl_hash_set.h"
+#include "geocentric_batch.h"
+#include "grid_memory.h"
+#include "interpolation.h"
+#include "mapped_file.h"
+#include "transform_pool.h"
+
+#include <algorithm>
+#include <map>
+#include <time.h>
+#include <vector>
 
 #include "..\..\proj-4.8.0\src\projects.h"
 #include "..\..\proj-4.8.0\src\geocent.h"
@@ -79,6 +90,177 @@ static const int transient_error[50] = {
  * 
 /************************************************************************/
 
+/************************************************************************/
+/*                              CT3DStage                               */
+/*                                                                      */
+/*      Steps of ct3D_pj_transform(). The steps needed by a pair of     */
+/*      PROJ.4 definitions are chosen by BuildPipeline() when the       */
+/*      transformation is created or the height models change, so a     */
+/*      batch runs them one after another without testing the          */
+/*      definitions again.                                              */
+/************************************************************************/
+
+enum CT3DStage
+{
+    CT3D_STAGE_SRC_AXIS,
+    CT3D_STAGE_SRC_Z_TO_METER,
+    CT3D_STAGE_SRC_GEOCENT_NO_Z,
+    CT3D_STAGE_SRC_GEOCENT_TO_METER,
+    CT3D_STAGE_SRC_GEOCENT_TO_GEODETIC,
+    CT3D_STAGE_SRC_INV_PROJECT,
+    CT3D_STAGE_SRC_PRIME_MERIDIAN,
+    CT3D_STAGE_SRC_GRIDSHIFT,
+    CT3D_STAGE_SRC_VERTICAL,
+    CT3D_STAGE_DATUM_SCRATCH_Z,
+    CT3D_STAGE_DATUM_TO_GEOCENTRIC,
+    CT3D_STAGE_DATUM_TO_WGS84,
+    CT3D_STAGE_DATUM_FROM_WGS84,
+    CT3D_STAGE_DATUM_HELMERT,
+    CT3D_STAGE_DATUM_TO_GEODETIC,
+    CT3D_STAGE_VERTICAL_DIFFERENCE,
+    CT3D_STAGE_DST_VERTICAL,
+    CT3D_STAGE_DST_GRIDSHIFT,
+    CT3D_STAGE_DST_PRIME_MERIDIAN,
+    CT3D_STAGE_DST_GEOCENT_NO_Z,
+    CT3D_STAGE_DST_GEODETIC_TO_GEOCENT,
+    CT3D_STAGE_DST_GEOCENT_FROM_METER,
+    CT3D_STAGE_DST_PROJECT,
+    CT3D_STAGE_DST_LONG_WRAP,
+    CT3D_STAGE_DST_Z_FROM_METER,
+    CT3D_STAGE_DST_AXIS,
+    CT3D_STAGE_COUNT
+};
+
+static const char * const apszCT3DStageNames[CT3D_STAGE_COUNT] =
+{
+    "src_axis",
+    "src_z_to_meter",
+    "src_geocent_no_z",
+    "src_geocent_to_meter",
+    "src_geocent_to_geodetic",
+    "src_inv_project",
+    "src_prime_meridian",
+    "src_gridshift",
+    "src_vertical",
+    "datum_scratch_z",
+    "datum_to_geocentric",
+    "datum_to_wgs84",
+    "datum_from_wgs84",
+    "datum_helmert",
+    "datum_to_geodetic",
+    "vertical_difference",
+    "dst_vertical",
+    "dst_gridshift",
+    "dst_prime_meridian",
+    "dst_geocent_no_z",
+    "dst_geodetic_to_geocent",
+    "dst_geocent_from_meter",
+    "dst_project",
+    "dst_long_wrap",
+    "dst_z_from_meter",
+    "dst_axis"
+};
+
+/* stages run by one direction of a transformation, with or without z */
+struct CT3DPipeline
+{
+    int         nStages;
+    int         anStages[CT3D_STAGE_COUNT];
+
+    /* ellipsoids of the geocentric datum shift */
+    double      dfSrcA;
+    double      dfSrcEs;
+    double      dfDstA;
+    double      dfDstEs;
+
+    /* prime meridians applied by the projection loops, 0 if none */
+    double      dfSrcGreenwich;
+    double      dfDstGreenwich;
+
+    /* source geocentric to target geocentric of datum_helmert, row    */
+    /* major 3x3 matrix followed by the translation                    */
+    double      adfHelmert[12];
+};
+
+/* default number of points all stages are run on before the next tile */
+#define CT3D_DEFAULT_TILE_SIZE  2048
+#define CT3D_MIN_TILE_SIZE      64
+
+/* error of a batch whose height models cannot be read, not a PROJ.4 error */
+#define CT3D_ERR_VERTICAL_MODEL (-1000)
+
+class CT3DGridIndex;
+static void ct3D_gridindex_free( CT3DGridIndex *poIndex );
+
+/************************************************************************/
+/*                            CT3DWorkerState                           */
+/*                                                                      */
+/*      PROJ.4 handles and scratch buffers used by one chunk of a       */
+/*      batch at a time. Chunks running on the worker pool get a        */
+/*      state with a context and handles of their own.                  */
+/************************************************************************/
+
+struct CT3DWorkerState
+{
+    projCtx     pjctx;
+    projPJ      psPJSource;
+    projPJ      psPJTarget;
+    int         bOwnsPJ;        /* handles were created for this state */
+
+    int         nMaxCount;
+    double     *padfOriX;
+    double     *padfOriY;
+    double     *padfOriZ;
+    double     *padfTargetX;
+    double     *padfTargetY;
+    double     *padfTargetZ;
+
+    /* scratch buffers reused by every call, grown to the largest chunk */
+    int         nScratchCount;
+    double     *padfScratchZ;
+    VerticalScratch oVerticalScratch;
+
+    /* radians of the points looked up in the height models, if only */
+    /* the heights are transformed                                     */
+    int         nLookupCount;
+    double     *padfLookupX;
+    double     *padfLookupY;
+
+    /* counters of the inverse grid shifts done with this state */
+    GridShiftStats sGridShiftStats;
+
+    /* indexes of the grid lists of psPJSource and psPJTarget, built */
+    /* together with the lists by the first grid shift                 */
+    CT3DGridIndex *poSourceGridIndex;
+    CT3DGridIndex *poTargetGridIndex;
+
+    CT3DWorkerState();
+    ~CT3DWorkerState();
+
+    void        ReserveScratch( int nCount );
+    void        ReserveLookup( int nCount );
+    CT3DGridIndex **GetGridIndex( PJ *defn );
+};
+
+class OGRProj4CT3D;
+
+/* arguments of one chunk run by the worker pool */
+struct CT3DChunk
+{
+    OGRProj4CT3D *poCT;
+    CT3DWorkerState *psState;
+    int         nCount;
+    int         nOffset;
+    const double *xIn;
+    const double *yIn;
+    const double *zIn;
+    double     *x;
+    double     *y;
+    double     *z;
+    int        *pabSuccess;
+    int         nErr;
+};
+
 class CPL_DLL OGRProj4CT3D : public OGRCoordinateTransformation3D
 {
 	
@@ -107,33 +289,99 @@ class CPL_DLL OGRProj4CT3D : public OGRCoordinateTransformation3D
 
 	int         InitializeNoLock( OGRSpatialReference3D *poSource, 
                                   OGRSpatialReference3D *poTarget );
-  
-    int         nMaxCount;
-    double     *padfOriX;
-    double     *padfOriY;
-    double     *padfOriZ;
-    double     *padfTargetX;
-    double     *padfTargetY;
-    double     *padfTargetZ;
+
+    /* state of single threaded calls and of the first chunk */
+    CT3DWorkerState oMainState;
+
+    /* success flags of Transform(), grown to the largest batch */
+    int         nScratchCount;
+    int        *panScratchSuccess;
+
+    void        ReserveScratch( int nCount );
+
+    /* steps of ct3D_pj_transform(), indexed by [inverse][has z] */
+    CT3DPipeline asPipelines[2][2];
+
+    /* points per tile of a chunk, 0 to run every stage on the whole chunk */
+    int         nTileSize;
+
+    /* source and target only differ in their heights */
+    int         bVerticalOnly;
+
+    /* apply both 3/7 parameter datum shifts as one matrix */
+    int         bComposeHelmert;
+
+    /* GEOCENTRIC_SIMD_xxx level of the geodetic <-> geocentric conversions */
+    int         nGeocentricSIMD;
+
+    /* GetVerticalGeneration() of the source and target the steps were chosen for */
+    int         nSourceVerticalGeneration;
+    int         nTargetVerticalGeneration;
+
+    void        BuildPipelines();
+    void        BuildPipeline( PJ *srcdefn, PJ *dstdefn, int bHasZ,
+                               CT3DPipeline *psPipeline );
+    void        DumpPipeline( const char *pszName, const CT3DPipeline *psPipeline );
+
+    /* parallel mode, see SetThreadCount() */
+    int         nThreads;
+    char       *pszSourceProj4;
+    char       *pszTargetProj4;
+    int         nWorkers;
+    CT3DWorkerState **papsWorkers;
+    CT3DChunk  *pasChunks;
+    void      **papChunkArgs;
+
+    int         GetChunkCount( int nCount );
+    int         ReserveWorkers( int nChunks );
+    CT3DWorkerState *CreateWorkerState();
+    static void RunChunk( void *pArg );
 public:
 	OGRProj4CT3D();
+	virtual ~OGRProj4CT3D();
 	virtual OGRSpatialReference3D *GetSourceCS();
     virtual OGRSpatialReference3D *GetTargetCS();
 	int         Initialize( OGRSpatialReference3D *poSource, 
                             OGRSpatialReference3D *poTarget );
 
 	int ct3D_pj_transform(PJ *srcdefn, PJ *dstdefn, long point_count, int point_offset,
-                  double *x, double *y, double *z);
+                  double *x, double *y, double *z, CT3DWorkerState *psState,
+                  int bInverse = FALSE);
 
-	int ct3D_pj_datum_transform( PJ *srcdefn, PJ *dstdefn, 
-                        long point_count, int point_offset,
-                        double *x, double *y, double *z );
-	
     virtual int Transform( int nCount, 
                            double *x, double *y, double *z = NULL );
     virtual int TransformEx( int nCount, 
                              double *x, double *y, double *z = NULL,
                              int *panSuccess = NULL );
+    virtual int TransformStrided( int nCount, 
+                                  double *x, double *y, double *z,
+                                  int nStrideBytes, int *panSuccess = NULL );
+    virtual int TransformTo( int nCount, 
+                             const double *xIn, const double *yIn, const double *zIn,
+                             double *xOut, double *yOut, double *zOut,
+                             int *panSuccess = NULL );
+    virtual void SetThreadCount( int nThreadCount );
+    virtual int GetThreadCount();
+    virtual void GetGridShiftStats( GridShiftStats *psStats );
+    virtual void ResetGridShiftStats();
+
+protected:
+    int         TransformOffset( int nCount, int nOffset,
+                                 const double *xIn, const double *yIn, const double *zIn,
+                                 double *x, double *y, double *z,
+                                 int *panSuccess );
+    int         TransformChunk( CT3DWorkerState *psState, int nCount, int nOffset,
+                                const double *xIn, const double *yIn, const double *zIn,
+                                double *x, double *y, double *z,
+                                int *panSuccess );
+    int         TransformTile( CT3DWorkerState *psState, int nCount, int nOffset,
+                               const double *xIn, const double *yIn, const double *zIn,
+                               double *x, double *y, double *z,
+                               int *panSuccess );
+    int         TransformHeights( CT3DWorkerState *psState, int nCount, int nOffset,
+                                  const double *xIn, const double *yIn, const double *zIn,
+                                  double *x, double *y, double *z,
+                                  int *panSuccess );
 };
 
 
@@ -173,6 +421,74 @@ OGRProj4CT3D::OGRProj4CT3D()
 	bCheckWithInvertProj = FALSE;
     dfThreshold = 0;
 
+    nScratchCount = 0;
+    panScratchSuccess = NULL;
+
+    memset( asPipelines, 0, sizeof(asPipelines) );
+    nTileSize = CT3D_DEFAULT_TILE_SIZE;
+    bVerticalOnly = FALSE;
+    bComposeHelmert = TRUE;
+    nGeocentricSIMD = GEOCENTRIC_SIMD_AVX;
+    nSourceVerticalGeneration = 0;
+    nTargetVerticalGeneration = 0;
+
+    nThreads = 1;
+    pszSourceProj4 = NULL;
+    pszTargetProj4 = NULL;
+    nWorkers = 0;
+    papsWorkers = NULL;
+    pasChunks = NULL;
+    papChunkArgs = NULL;
+
+	pjctx=pj_ctx_alloc();
+	
+}
+
+OGRProj4CT3D::~OGRProj4CT3D()
+{
+    for( int i = 0; i < nWorkers; i++ )
+    {
+        if( papsWorkers[i] != &oMainState )
+            delete papsWorkers[i];
+    }
+    CPLFree( papsWorkers );
+    CPLFree( pasChunks );
+    CPLFree( papChunkArgs );
+
+    /* oMainState only borrows these */
+    if( psPJSource != NULL )
+        pj_free( psPJSource );
+    if( psPJTarget != NULL )
+        pj_free( psPJTarget );
+    if( pjctx != NULL )
+        pj_ctx_free( pjctx );
+
+    CPLFree( pszSourceProj4 );
+    CPLFree( pszTargetProj4 );
+
+    CPLFree( panScratchSuccess );
+}
+
+void OGRProj4CT3D::ReserveScratch( int nCount )
+{
+    if( nCount <= nScratchCount )
+        return;
+
+    panScratchSuccess = (int *) CPLRealloc( panScratchSuccess, sizeof(int) * nCount );
+    nScratchCount = nCount;
+}
+
+/************************************************************************/
+/*                            CT3DWorkerState                           */
+/************************************************************************/
+
+CT3DWorkerState::CT3DWorkerState()
+{
+    pjctx = NULL;
+    psPJSource = NULL;
+    psPJTarget = NULL;
+    bOwnsPJ = FALSE;
+
     nMaxCount = 0;
     padfOriX = NULL;
     padfOriY = NULL;
@@ -181,19 +497,180 @@ OGRProj4CT3D::OGRProj4CT3D()
     padfTargetY = NULL;
     padfTargetZ = NULL;
 
-	pjctx=pj_ctx_alloc();
-	
+    nScratchCount = 0;
+    padfScratchZ = NULL;
+
+    nLookupCount = 0;
+    padfLookupX = NULL;
+    padfLookupY = NULL;
+
+    memset( &sGridShiftStats, 0, sizeof(sGridShiftStats) );
+
+    poSourceGridIndex = NULL;
+    poTargetGridIndex = NULL;
+}
+
+CT3DWorkerState::~CT3DWorkerState()
+{
+    ct3D_gridindex_free( poSourceGridIndex );
+    ct3D_gridindex_free( poTargetGridIndex );
+
+    if( bOwnsPJ )
+    {
+        if( psPJSource != NULL )
+            pj_free( psPJSource );
+        if( psPJTarget != NULL )
+            pj_free( psPJTarget );
+        if( pjctx != NULL )
+            pj_ctx_free( pjctx );
+    }
+
+    CPLFree( padfOriX );
+    CPLFree( padfOriY );
+    CPLFree( padfOriZ );
+    CPLFree( padfTargetX );
+    CPLFree( padfTargetY );
+    CPLFree( padfTargetZ );
+
+    CPLFree( padfScratchZ );
+    CPLFree( padfLookupX );
+    CPLFree( padfLookupY );
+}
+
+void CT3DWorkerState::ReserveScratch( int nCount )
+{
+    if( nCount <= nScratchCount )
+        return;
+
+    padfScratchZ = (double *) CPLRealloc( padfScratchZ, sizeof(double) * nCount );
+    nScratchCount = nCount;
+}
+
+void CT3DWorkerState::ReserveLookup( int nCount )
+{
+    if( nCount <= nLookupCount )
+        return;
+
+    padfLookupX = (double *) CPLRealloc( padfLookupX, sizeof(double) * nCount );
+    padfLookupY = (double *) CPLRealloc( padfLookupY, sizeof(double) * nCount );
+    nLookupCount = nCount;
+}
+
+/* index of the grid list of one of the handles of the state */
+CT3DGridIndex **CT3DWorkerState::GetGridIndex( PJ *defn )
+{
+    return defn == psPJSource ? &poSourceGridIndex : &poTargetGridIndex;
+}
+
+void OGRProj4CT3D::SetThreadCount( int nThreadCount )
+{
+    nThreads = (nThreadCount < 1) ? 1 : nThreadCount;
+}
+
+int OGRProj4CT3D::GetThreadCount()
+{
+    return nThreads;
+}
+
+void OGRProj4CT3D::GetGridShiftStats( GridShiftStats *psStats )
+{
+    *psStats = oMainState.sGridShiftStats;
+
+    for( int i = 0; i < nWorkers; i++ )
+    {
+        if( papsWorkers[i] == &oMainState )
+            continue;
+
+        const GridShiftStats &sWorker = papsWorkers[i]->sGridShiftStats;
+        psStats->nInversePoints += sWorker.nInversePoints;
+        psStats->nIterations += sWorker.nIterations;
+        for( int j = 0; j < GRIDSHIFT_MAX_ITERATIONS; j++ )
+            psStats->anIterationCount[j] += sWorker.anIterationCount[j];
+        psStats->nEdgeFallbacks += sWorker.nEdgeFallbacks;
+        psStats->nNotConverged += sWorker.nNotConverged;
+    }
+}
+
+void OGRProj4CT3D::ResetGridShiftStats()
+{
+    memset( &oMainState.sGridShiftStats, 0, sizeof(GridShiftStats) );
+
+    for( int i = 0; i < nWorkers; i++ )
+        memset( &papsWorkers[i]->sGridShiftStats, 0, sizeof(GridShiftStats) );
+}
+
+int OGRProj4CT3D::GetChunkCount( int nCount )
+{
+    if( nThreads <= 1 || nCount < 2 * TRANSFORM_MIN_CHUNK )
+        return 1;
+
+    // debug buffers are indexed by the position in the whole batch
+    if( poSRSSource->IsDebug() || poSRSTarget->IsDebug() )
+        return 1;
+
+    return ReserveWorkers( MIN(nThreads, nCount / TRANSFORM_MIN_CHUNK) );
+}
+
+int OGRProj4CT3D::ReserveWorkers( int nChunks )
+/*
+ * returns the number of worker states available, at most nChunks
+ */
+{
+    if( nChunks > nWorkers )
+    {
+        papsWorkers = (CT3DWorkerState **) 
+            CPLRealloc( papsWorkers, sizeof(CT3DWorkerState *) * nChunks );
+        pasChunks = (CT3DChunk *) CPLRealloc( pasChunks, sizeof(CT3DChunk) * nChunks );
+        papChunkArgs = (void **) CPLRealloc( papChunkArgs, sizeof(void *) * nChunks );
+
+        while( nWorkers < nChunks )
+        {
+            CT3DWorkerState *psState = 
+                (nWorkers == 0) ? &oMainState : CreateWorkerState();
+            if( psState == NULL )
+                break;
+            papsWorkers[nWorkers++] = psState;
+        }
+    }
+
+    return MIN(nChunks, nWorkers);
+}
+
+CT3DWorkerState *OGRProj4CT3D::CreateWorkerState()
+{
+    CT3DWorkerState *psState = new CT3DWorkerState();
+
+    psState->bOwnsPJ = TRUE;
+    psState->pjctx = pj_ctx_alloc();
+    if( psState->pjctx != NULL )
+    {
+        psState->psPJSource = pj_init_plus_ctx( psState->pjctx, pszSourceProj4 );
+        psState->psPJTarget = pj_init_plus_ctx( psState->pjctx, pszTargetProj4 );
+    }
+
+    if( psState->psPJSource == NULL || psState->psPJTarget == NULL )
+    {
+        CPLDebug( "OGRCT", "Failed to create PROJ.4 handles of a worker, "
+                  "batches use fewer threads." );
+        delete psState;
+        return NULL;
+    }
+
+    return psState;
 }
 
 int OGRProj4CT3D::Initialize(OGRSpatialReference3D * poSourceIn, 
                             OGRSpatialReference3D * poTargetIn )
 {
-	if(pjctx!=NULL)
+    /* every transformation uses a context of its own, there is no 
+       fallback on the default context shared by all threads */
+	if(pjctx==NULL)
 	{
-        return InitializeNoLock(poSourceIn, poTargetIn);
+        CPLError( CE_Failure, CPLE_OutOfMemory, 
+                  "Failed to allocate a PROJ.4 context." );
+        return FALSE;
     }
 
-    CPLMutexHolderD( &hPROJMutex );
     return InitializeNoLock(poSourceIn, poTargetIn);
 }
 
@@ -287,6 +764,23 @@ if( bSourceLatLong )
     }
     
     bCheckWithInvertProj = CSLTestBoolean(CPLGetConfigOption( "CHECK_WITH_INVERT_PROJ", "NO" ));
+
+    nThreads = TransformWorkerPool::ParseThreadCount( 
+        CPLGetConfigOption( "SPATIALREF3D_TRANSFORM_THREADS", "1" ) );
+
+    nTileSize = atoi( CPLGetConfigOption( "SPATIALREF3D_TRANSFORM_TILE", 
+                                          CPLSPrintf( "%d", CT3D_DEFAULT_TILE_SIZE ) ) );
+    if( nTileSize < 0 )
+        nTileSize = 0;
+    else if( nTileSize > 0 && nTileSize < CT3D_MIN_TILE_SIZE )
+        nTileSize = CT3D_MIN_TILE_SIZE;
+
+    bComposeHelmert = CSLTestBoolean(CPLGetConfigOption( "SPATIALREF3D_COMPOSE_HELMERT", "YES" ));
+
+    nGeocentricSIMD = geocentricBatchSIMD( 
+        CPLGetConfigOption( "SPATIALREF3D_GEOCENTRIC_SIMD", "AUTO" ) );
+    CPLDebug( "OGRCT3D", "Geocentric conversion kernel: %s", 
+              geocentricBatchKernel( nGeocentricSIMD ) );
     
     /* The threshold is rather experimental... Works well with the cases of ticket #2305 */
     if (bSourceLatLong)
@@ -322,44 +816,25 @@ if( bSourceLatLong )
     }
 
 
-	 if (pjctx)
-		 psPJSource=pj_init_plus_ctx(pjctx,pszProj4Defn);
-	  else
-        psPJSource = pj_init_plus( pszProj4Defn );
+	 psPJSource=pj_init_plus_ctx(pjctx,pszProj4Defn);
 
 	  if( psPJSource == NULL )
     {
-        if( pjctx != NULL)
-        {
-            int pj_errno = pj_ctx_get_errno(pjctx);
-
-            /* pfn_pj_strerrno not yet thread-safe in PROJ 4.8.0 */
-            CPLMutexHolderD(&hPROJMutex);
-            CPLError( CE_Failure, CPLE_NotSupported, 
-                      "Failed to initialize PROJ.4 with `%s'.\n%s", 
-                      pszProj4Defn, pj_strerrno(pj_errno) );
-        }
-        else if( pj_get_errno_ref != NULL
-            && pj_strerrno != NULL )
-        {
-            int *p_pj_errno = pj_get_errno_ref();
+        int pj_errno = pj_ctx_get_errno(pjctx);
 
-            CPLError( CE_Failure, CPLE_NotSupported, 
-                      "Failed to initialize PROJ.4 with `%s'.\n%s", 
-                      pszProj4Defn, pj_strerrno(*p_pj_errno) );
-        }
-        else
-        {
-            CPLError( CE_Failure, CPLE_NotSupported, 
-                      "Failed to initialize PROJ.4 with `%s'.\n", 
-                      pszProj4Defn );
-        }
+        /* pfn_pj_strerrno not yet thread-safe in PROJ 4.8.0 */
+        CPLMutexHolderD(&hPROJMutex);
+        CPLError( CE_Failure, CPLE_NotSupported, 
+                  "Failed to initialize PROJ.4 with `%s'.\n%s", 
+                  pszProj4Defn, pj_strerrno(pj_errno) );
     }
 
    if( nDebugReportCount < 10 )
         CPLDebug( "OGRCT", "Source: %s", pszProj4Defn );
     
-    CPLFree( pszProj4Defn );
+    /* kept to create the handles of pool workers */
+    CPLFree( pszSourceProj4 );
+    pszSourceProj4 = pszProj4Defn;
 
     if( psPJSource == NULL )
         return FALSE;
@@ -383,10 +858,7 @@ if( bSourceLatLong )
         return FALSE;
     }
 
-	if (pjctx)
-        psPJTarget = pj_init_plus_ctx( pjctx, pszProj4Defn );
-    else
-        psPJTarget = pj_init_plus( pszProj4Defn );
+    psPJTarget = pj_init_plus_ctx( pjctx, pszProj4Defn );
 
     if( psPJTarget == NULL )
         CPLError( CE_Failure, CPLE_NotSupported, 
@@ -399,142 +871,458 @@ if( bSourceLatLong )
         nDebugReportCount++;
     }
 	
-	CPLFree( pszProj4Defn );
+    CPLFree( pszTargetProj4 );
+    pszTargetProj4 = pszProj4Defn;
     
     if( psPJTarget == NULL )
         return FALSE;
 
+    oMainState.pjctx = pjctx;
+    oMainState.psPJSource = psPJSource;
+    oMainState.psPJTarget = psPJTarget;
+
+    BuildPipelines();
+
     return TRUE;
 }
 
-OGRSpatialReference3D* OGRProj4CT3D::GetSourceCS()
-{
-    return poSRSSource;
-}
+/************************************************************************/
+/*                           BuildPipelines()                           */
+/*                                                                      */
+/*      Choose the steps of each direction. The handles of the          */
+/*      workers are made from the same definitions, so these steps      */
+/*      apply to them as well. Called again by TransformOffset() when   */
+/*      a height model of the source or target was set since.           */
+/************************************************************************/
+
+void OGRProj4CT3D::BuildPipelines()
 
-OGRSpatialReference3D* OGRProj4CT3D::GetTargetCS()
 {
-	return poSRSTarget;
+    nSourceVerticalGeneration = poSRSSource->GetVerticalGeneration();
+    nTargetVerticalGeneration = poSRSTarget->GetVerticalGeneration();
+
+    BuildPipeline( psPJSource, psPJTarget, TRUE, &asPipelines[0][1] );
+    BuildPipeline( psPJSource, psPJTarget, FALSE, &asPipelines[0][0] );
+    BuildPipeline( psPJTarget, psPJSource, TRUE, &asPipelines[1][1] );
+    BuildPipeline( psPJTarget, psPJSource, FALSE, &asPipelines[1][0] );
+
+/* -------------------------------------------------------------------- */
+/*      If the horizontal part is an identity, only the heights are     */
+/*      transformed and the points do not go through PROJ.4 at all.     */
+/* -------------------------------------------------------------------- */
+    bVerticalOnly = bSourceLatLong && bTargetLatLong 
+        && !bSourceWrap && !bTargetWrap
+        && dfSourceToRadians == dfTargetToRadians
+        && !bCheckWithInvertProj
+        && asPipelines[0][0].nStages == 0;
+
+    for( int i = 0; bVerticalOnly && i < asPipelines[0][1].nStages; i++ )
+    {
+        int nStage = asPipelines[0][1].anStages[i];
+        if( nStage != CT3D_STAGE_SRC_VERTICAL 
+            && nStage != CT3D_STAGE_VERTICAL_DIFFERENCE
+            && nStage != CT3D_STAGE_DST_VERTICAL )
+            bVerticalOnly = FALSE;
+    }
+
+    DumpPipeline( "xyz", &asPipelines[0][1] );
+    DumpPipeline( "xy", &asPipelines[0][0] );
+    if( bVerticalOnly )
+        CPLDebug( "OGRCT3D", "Horizontal part is an identity, only heights are transformed." );
+    if( bCheckWithInvertProj )
+    {
+        DumpPipeline( "inverse xyz", &asPipelines[1][1] );
+        DumpPipeline( "inverse xy", &asPipelines[1][0] );
+    }
 }
-int OGRProj4CT3D::Transform( int nCount, double *x, double *y, double *z )
+
+/************************************************************************/
+/*                        ct3D_compose_helmert()                        */
+/*                                                                      */
+/*      Product of pj_geocentric_to_wgs84() with srcdefn and            */
+/*      pj_geocentric_from_wgs84() with dstdefn, both 3 or 7            */
+/*      parameter datums, as one matrix and translation. The matrices   */
+/*      are multiplied out in full, the second order terms of the       */
+/*      rotations are kept.                                             */
+/************************************************************************/
+
+static void ct3D_compose_helmert( PJ *srcdefn, PJ *dstdefn, double *padfHelmert )
+
 {
-    int *pabSuccess = (int *) CPLMalloc(sizeof(int) * nCount );
-    int bOverallSuccess, i;
+    double      adfSrc[9], adfDst[9], adfSrcT[3], adfDstT[3];
+    PJ         *defn;
+    int         i, j, k;
+
+    /* to WGS84: M * R * p + T */
+    defn = srcdefn;
+    adfSrcT[0] = Dx_BF;
+    adfSrcT[1] = Dy_BF;
+    adfSrcT[2] = Dz_BF;
+    if( defn->datum_type == PJD_7PARAM )
+    {
+        adfSrc[0] = M_BF;        adfSrc[1] = -M_BF*Rz_BF; adfSrc[2] = M_BF*Ry_BF;
+        adfSrc[3] = M_BF*Rz_BF;  adfSrc[4] = M_BF;        adfSrc[5] = -M_BF*Rx_BF;
+        adfSrc[6] = -M_BF*Ry_BF; adfSrc[7] = M_BF*Rx_BF;  adfSrc[8] = M_BF;
+    }
+    else
+    {
+        adfSrc[0] = 1.0; adfSrc[1] = 0.0; adfSrc[2] = 0.0;
+        adfSrc[3] = 0.0; adfSrc[4] = 1.0; adfSrc[5] = 0.0;
+        adfSrc[6] = 0.0; adfSrc[7] = 0.0; adfSrc[8] = 1.0;
+    }
 
-    bOverallSuccess = TransformEx( nCount, x, y, z, pabSuccess );
+    /* from WGS84: transpose(R) * (q - T) / M */
+    defn = dstdefn;
+    adfDstT[0] = Dx_BF;
+    adfDstT[1] = Dy_BF;
+    adfDstT[2] = Dz_BF;
+    if( defn->datum_type == PJD_7PARAM )
+    {
+        adfDst[0] = 1.0 / M_BF;    adfDst[1] = Rz_BF / M_BF;  adfDst[2] = -Ry_BF / M_BF;
+        adfDst[3] = -Rz_BF / M_BF; adfDst[4] = 1.0 / M_BF;    adfDst[5] = Rx_BF / M_BF;
+        adfDst[6] = Ry_BF / M_BF;  adfDst[7] = -Rx_BF / M_BF; adfDst[8] = 1.0 / M_BF;
+    }
+    else
+    {
+        adfDst[0] = 1.0; adfDst[1] = 0.0; adfDst[2] = 0.0;
+        adfDst[3] = 0.0; adfDst[4] = 1.0; adfDst[5] = 0.0;
+        adfDst[6] = 0.0; adfDst[7] = 0.0; adfDst[8] = 1.0;
+    }
 
-	 for( i = 0; i < nCount; i++ )
+    for( i = 0; i < 3; i++ )
     {
-        if( !pabSuccess[i] )
+        double dfSum;
+
+        for( j = 0; j < 3; j++ )
         {
-            bOverallSuccess = FALSE;
-            break;
+            dfSum = 0.0;
+            for( k = 0; k < 3; k++ )
+                dfSum += adfDst[i*3+k] * adfSrc[k*3+j];
+            padfHelmert[i*3+j] = dfSum;
         }
-    }
 
-    CPLFree( pabSuccess );
+        dfSum = 0.0;
+        for( k = 0; k < 3; k++ )
+            dfSum += adfDst[i*3+k] * (adfSrcT[k] - adfDstT[k]);
+        padfHelmert[9+i] = dfSum;
+    }
+}
 
-    return bOverallSuccess;
+/************************************************************************/
+/*                           BuildPipeline()                            */
+/*                                                                      */
+/*      Choose the steps ct3D_pj_transform() runs to go from srcdefn    */
+/*      to dstdefn, in the order of pj_transform(). The height models   */
+/*      of the source and target are looked at here.                    */
+/************************************************************************/
 
-}
+void OGRProj4CT3D::BuildPipeline( PJ *srcdefn, PJ *dstdefn, int bHasZ,
+                                  CT3DPipeline *psPipeline )
 
-int OGRProj4CT3D::TransformEx( int nCount, double *x, double *y, double *z,int *pabSuccess )
 {
-    
-int   err, i;
+    int        *panStages = psPipeline->anStages;
+    int         nStages = 0;
+
+    psPipeline->dfSrcA = srcdefn->a_orig;
+    psPipeline->dfSrcEs = srcdefn->es_orig;
+    psPipeline->dfDstA = dstdefn->a_orig;
+    psPipeline->dfDstEs = dstdefn->es_orig;
+    psPipeline->dfSrcGreenwich = 0.0;
+    psPipeline->dfDstGreenwich = 0.0;
 
 /* -------------------------------------------------------------------- */
-/*      Potentially transform to radians.                               */
+/*      Source to geodetic coordinates.                                 */
 /* -------------------------------------------------------------------- */
-    if( bSourceLatLong )
+    if( strcmp(srcdefn->axis,"enu") != 0 )
+        panStages[nStages++] = CT3D_STAGE_SRC_AXIS;
+
+    if( srcdefn->vto_meter != 1.0 && bHasZ )
+        panStages[nStages++] = CT3D_STAGE_SRC_Z_TO_METER;
+
+    if( srcdefn->is_geocent )
     {
-        if( bSourceWrap )
+        if( !bHasZ )
         {
-            for( i = 0; i < nCount; i++ )
-            {
-                if( x[i] != HUGE_VAL && y[i] != HUGE_VAL )
-                {
-                    if( x[i] < dfSourceWrapLong - 180.0 )
-                        x[i] += 360.0;
-                    else if( x[i] > dfSourceWrapLong + 180 )
-                        x[i] -= 360.0;
-                }
-            }
+            panStages[nStages++] = CT3D_STAGE_SRC_GEOCENT_NO_Z;
+            psPipeline->nStages = nStages;
+            return;
         }
 
-        for( i = 0; i < nCount; i++ )
-        {
-            if( x[i] != HUGE_VAL )
-            {
-                x[i] *= dfSourceToRadians;
-                y[i] *= dfSourceToRadians;
-            }
-        }
+        if( srcdefn->to_meter != 1.0 )
+            panStages[nStages++] = CT3D_STAGE_SRC_GEOCENT_TO_METER;
+        panStages[nStages++] = CT3D_STAGE_SRC_GEOCENT_TO_GEODETIC;
+    }
+    else if( !srcdefn->is_latlong )
+        panStages[nStages++] = CT3D_STAGE_SRC_INV_PROJECT;
+
+    /* applied by the inverse projection loop if there is one */
+    if( srcdefn->from_greenwich != 0.0 )
+    {
+        if( nStages > 0 && panStages[nStages-1] == CT3D_STAGE_SRC_INV_PROJECT )
+            psPipeline->dfSrcGreenwich = srcdefn->from_greenwich;
+        else
+            panStages[nStages++] = CT3D_STAGE_SRC_PRIME_MERIDIAN;
     }
 
+    if( srcdefn->datum_type == PJD_GRIDSHIFT )
+        panStages[nStages++] = CT3D_STAGE_SRC_GRIDSHIFT;
+
+    if( bHasZ && poSRSSource->HasVerticalModel() )
+        panStages[nStages++] = CT3D_STAGE_SRC_VERTICAL;
+
 /* -------------------------------------------------------------------- */
-/*      Do the transformation using PROJ.4.                             */
+/*      Datum shift through geocentric coordinates, if the datums are   */
+/*      known and differ. Grid shifted datums are on WGS84 once the     */
+/*      horizontal grids are applied.                                   */
 /* -------------------------------------------------------------------- */
-    if (pjctx == NULL)
+    if( srcdefn->datum_type != PJD_UNKNOWN
+        && dstdefn->datum_type != PJD_UNKNOWN
+        && !pj_compare_datums( srcdefn, dstdefn ) )
     {
-        /* The mutex has already been created */
-        CPLAssert(hPROJMutex != NULL);
-        CPLAcquireMutex(hPROJMutex, 1000.0);
-    } if (bCheckWithInvertProj)
-    {
-        /* For some projections, we cannot detect if we are trying to reproject */
-        /* coordinates outside the validity area of the projection. So let's do */
-        /* the reverse reprojection and compare with the source coordinates */
-        if (nCount > nMaxCount)
-        {
-            nMaxCount = nCount;
-            padfOriX = (double*) CPLRealloc(padfOriX, sizeof(double)*nCount);
-            padfOriY = (double*) CPLRealloc(padfOriY, sizeof(double)*nCount);
-            padfOriZ = (double*) CPLRealloc(padfOriZ, sizeof(double)*nCount);
-            padfTargetX = (double*) CPLRealloc(padfTargetX, sizeof(double)*nCount);
-            padfTargetY = (double*) CPLRealloc(padfTargetY, sizeof(double)*nCount);
-            padfTargetZ = (double*) CPLRealloc(padfTargetZ, sizeof(double)*nCount);
+        if( srcdefn->datum_type == PJD_GRIDSHIFT )
+        {
+            psPipeline->dfSrcA = SRS_WGS84_SEMIMAJOR;
+            psPipeline->dfSrcEs = SRS_WGS84_ESQUARED;
         }
-        memcpy(padfOriX, x, sizeof(double)*nCount);
-        memcpy(padfOriY, y, sizeof(double)*nCount);
-        if (z)
+
+        if( dstdefn->datum_type == PJD_GRIDSHIFT )
         {
-            memcpy(padfOriZ, z, sizeof(double)*nCount);
+            psPipeline->dfDstA = SRS_WGS84_SEMIMAJOR;
+            psPipeline->dfDstEs = SRS_WGS84_ESQUARED;
         }
-        err = ct3D_pj_transform( psPJSource, psPJTarget, nCount, 1, x, y, z );
-        if (err == 0)
+
+        int bSrcParams = srcdefn->datum_type == PJD_3PARAM
+                      || srcdefn->datum_type == PJD_7PARAM;
+        int bDstParams = dstdefn->datum_type == PJD_3PARAM
+                      || dstdefn->datum_type == PJD_7PARAM;
+
+        if( psPipeline->dfSrcEs != psPipeline->dfDstEs
+            || psPipeline->dfSrcA != psPipeline->dfDstA
+            || bSrcParams || bDstParams )
         {
-            memcpy(padfTargetX, x, sizeof(double)*nCount);
-            memcpy(padfTargetY, y, sizeof(double)*nCount);
-            if (z)
+            if( !bHasZ )
+                panStages[nStages++] = CT3D_STAGE_DATUM_SCRATCH_Z;
+            panStages[nStages++] = CT3D_STAGE_DATUM_TO_GEOCENTRIC;
+            if( bSrcParams && bDstParams && bComposeHelmert )
             {
-                memcpy(padfTargetZ, z, sizeof(double)*nCount);
+                ct3D_compose_helmert( srcdefn, dstdefn, psPipeline->adfHelmert );
+                panStages[nStages++] = CT3D_STAGE_DATUM_HELMERT;
             }
-            
-            err = ct3D_pj_transform( psPJTarget, psPJSource , nCount, 1,
-                                    padfTargetX, padfTargetY, (z) ? padfTargetZ : NULL);
-            if (err == 0)
+            else
             {
-                for( i = 0; i < nCount; i++ )
-                {
-                    if ( x[i] != HUGE_VAL && y[i] != HUGE_VAL &&
-                        (fabs(padfTargetX[i] - padfOriX[i]) > dfThreshold ||
-                         fabs(padfTargetY[i] - padfOriY[i]) > dfThreshold) )
-                    {
-                        x[i] = HUGE_VAL;
-                        y[i] = HUGE_VAL;
-                    }
-                }
+                if( bSrcParams )
+                    panStages[nStages++] = CT3D_STAGE_DATUM_TO_WGS84;
+                if( bDstParams )
+                    panStages[nStages++] = CT3D_STAGE_DATUM_FROM_WGS84;
             }
+            panStages[nStages++] = CT3D_STAGE_DATUM_TO_GEODETIC;
         }
     }
 
-	 else
-     {
-        err = ct3D_pj_transform( psPJSource, psPJTarget, nCount, 1, x, y, z );
-     }
+/* -------------------------------------------------------------------- */
+/*      Geodetic coordinates to target.                                 */
+/* -------------------------------------------------------------------- */
+    if( bHasZ && poSRSTarget->HasVerticalModel() )
+    {
+        /* nothing moved the points since the source correction, so */
+        /* both corrections are done with one lookup per raster     */
+        if( nStages > 0 && panStages[nStages-1] == CT3D_STAGE_SRC_VERTICAL )
+            panStages[nStages-1] = CT3D_STAGE_VERTICAL_DIFFERENCE;
+        else
+            panStages[nStages++] = CT3D_STAGE_DST_VERTICAL;
+    }
+
+    if( dstdefn->datum_type == PJD_GRIDSHIFT )
+        panStages[nStages++] = CT3D_STAGE_DST_GRIDSHIFT;
+
+    /* applied by the forward projection loop if there is one */
+    if( dstdefn->from_greenwich != 0.0 )
+    {
+        if( !dstdefn->is_geocent && !dstdefn->is_latlong )
+            psPipeline->dfDstGreenwich = dstdefn->from_greenwich;
+        else
+            panStages[nStages++] = CT3D_STAGE_DST_PRIME_MERIDIAN;
+    }
+
+    if( dstdefn->is_geocent )
+    {
+        if( !bHasZ )
+        {
+            panStages[nStages++] = CT3D_STAGE_DST_GEOCENT_NO_Z;
+            psPipeline->nStages = nStages;
+            return;
+        }
+
+        panStages[nStages++] = CT3D_STAGE_DST_GEODETIC_TO_GEOCENT;
+        if( dstdefn->fr_meter != 1.0 )
+            panStages[nStages++] = CT3D_STAGE_DST_GEOCENT_FROM_METER;
+    }
+    else if( !dstdefn->is_latlong )
+        panStages[nStages++] = CT3D_STAGE_DST_PROJECT;
+    else if( dstdefn->is_long_wrap_set )
+        panStages[nStages++] = CT3D_STAGE_DST_LONG_WRAP;
+
+    if( dstdefn->vto_meter != 1.0 && bHasZ )
+        panStages[nStages++] = CT3D_STAGE_DST_Z_FROM_METER;
+
+    if( strcmp(dstdefn->axis,"enu") != 0 )
+        panStages[nStages++] = CT3D_STAGE_DST_AXIS;
+
+    CPLAssert( nStages <= CT3D_STAGE_COUNT );
+    psPipeline->nStages = nStages;
+}
+
+/************************************************************************/
+/*                            DumpPipeline()                            */
+/************************************************************************/
+
+void OGRProj4CT3D::DumpPipeline( const char *pszName, 
+                                 const CT3DPipeline *psPipeline )
+
+{
+    CPLString osStages;
+
+    for( int i = 0; i < psPipeline->nStages; i++ )
+    {
+        if( i > 0 )
+            osStages += " -> ";
+        osStages += apszCT3DStageNames[psPipeline->anStages[i]];
+
+        if( (psPipeline->anStages[i] == CT3D_STAGE_SRC_INV_PROJECT
+             && psPipeline->dfSrcGreenwich != 0.0)
+            || (psPipeline->anStages[i] == CT3D_STAGE_DST_PROJECT
+                && psPipeline->dfDstGreenwich != 0.0) )
+            osStages += "+prime_meridian";
+    }
+
+    if( psPipeline->nStages == 0 )
+        osStages = "(none)";
+
+    CPLDebug( "OGRCT3D", "Pipeline %s: %s", pszName, osStages.c_str() );
+}
+
+OGRSpatialReference3D* OGRProj4CT3D::GetSourceCS()
+{
+    return poSRSSource;
+}
+
+OGRSpatialReference3D* OGRProj4CT3D::GetTargetCS()
+{
+	return poSRSTarget;
+}
+int OGRProj4CT3D::Transform( int nCount, double *x, double *y, double *z )
+{
+    int *pabSuccess;
+    int bOverallSuccess, i;
+
+    ReserveScratch( nCount );
+    pabSuccess = panScratchSuccess;
+
+    bOverallSuccess = TransformEx( nCount, x, y, z, pabSuccess );
+
+	 for( i = 0; i < nCount; i++ )
+    {
+        if( !pabSuccess[i] )
+        {
+            bOverallSuccess = FALSE;
+            break;
+        }
+    }
+
+    return bOverallSuccess;
+
+}
+
+int OGRProj4CT3D::TransformEx( int nCount, double *x, double *y, double *z,int *pabSuccess )
+{
+    return TransformOffset( nCount, 1, x, y, z, x, y, z, pabSuccess );
+}
+
+int OGRProj4CT3D::TransformTo( int nCount, 
+                               const double *xIn, const double *yIn, const double *zIn,
+                               double *xOut, double *yOut, double *zOut,
+                               int *pabSuccess )
+{
+    if( (zIn == NULL) != (zOut == NULL) )
+    {
+        CPLError( CE_Failure, CPLE_IllegalArg,
+                  "TransformTo(): zIn and zOut must both be set or both be NULL." );
+        if( pabSuccess )
+            memset( pabSuccess, 0, sizeof(int) * nCount );
+        return FALSE;
+    }
+
+    return TransformOffset( nCount, 1, xIn, yIn, zIn, xOut, yOut, zOut, pabSuccess );
+}
+
+int OGRProj4CT3D::TransformStrided( int nCount, double *x, double *y, double *z,
+                                    int nStrideBytes, int *pabSuccess )
+{
+    if( nStrideBytes <= 0 || nStrideBytes % sizeof(double) != 0 )
+    {
+        CPLError( CE_Failure, CPLE_IllegalArg,
+                  "TransformStrided(): stride of %d bytes is not a multiple of sizeof(double).",
+                  nStrideBytes );
+        if( pabSuccess )
+            memset( pabSuccess, 0, sizeof(int) * nCount );
+        return FALSE;
+    }
+
+    return TransformOffset( nCount, nStrideBytes / (int) sizeof(double),
+                            x, y, z, x, y, z, pabSuccess );
+}
+
+int OGRProj4CT3D::TransformOffset( int nCount, int nOffset, 
+                                   const double *xIn, const double *yIn, const double *zIn,
+                                   double *x, double *y, double *z, int *pabSuccess )
+{
+    int   err = 0, iChunk;
+    int   nChunks = GetChunkCount( nCount );
+
+    /* a height model was set on the source or target after the */
+    /* steps were chosen                                          */
+    if( poSRSSource->GetVerticalGeneration() != nSourceVerticalGeneration
+        || poSRSTarget->GetVerticalGeneration() != nTargetVerticalGeneration )
+        BuildPipelines();
+
+    if( nChunks <= 1 )
+    {
+        err = TransformChunk( &oMainState, nCount, nOffset, xIn, yIn, zIn,
+                              x, y, z, pabSuccess );
+    }
+    else
+    {
+        /* contiguous ranges of equal size, the result does not depend */
+        /* on the number of threads or on the order they finish in     */
+        for( iChunk = 0; iChunk < nChunks; iChunk++ )
+        {
+            int nFirst = (int) (((GIntBig) nCount * iChunk) / nChunks);
+            int nEnd = (int) (((GIntBig) nCount * (iChunk + 1)) / nChunks);
+            long io = (long) nFirst * nOffset;
+            CT3DChunk *psChunk = pasChunks + iChunk;
+
+            psChunk->poCT = this;
+            psChunk->psState = papsWorkers[iChunk];
+            psChunk->nCount = nEnd - nFirst;
+            psChunk->nOffset = nOffset;
+            psChunk->xIn = xIn + io;
+            psChunk->yIn = yIn + io;
+            psChunk->zIn = (zIn != NULL) ? zIn + io : NULL;
+            psChunk->x = x + io;
+            psChunk->y = y + io;
+            psChunk->z = (z != NULL) ? z + io : NULL;
+            psChunk->pabSuccess = (pabSuccess != NULL) ? pabSuccess + nFirst : NULL;
+            psChunk->nErr = 0;
+            papChunkArgs[iChunk] = psChunk;
+        }
+
+        TransformWorkerPool::Run( nChunks, RunChunk, papChunkArgs );
+
+        for( iChunk = 0; iChunk < nChunks && err == 0; iChunk++ )
+            err = pasChunks[iChunk].nErr;
+    }
 
-	/* -------------------------------------------------------------------- */
+/* -------------------------------------------------------------------- */
 /*      Try to report an error through CPL.  Get proj.4 error string    */
 /*      if possible.  Try to avoid reporting thousands of error         */
 /*      ... supress further error reporting on this OGRProj4CT if we    */
@@ -547,12 +1335,13 @@ int   err, i;
 
         if( ++nErrorCount < 20 )
         {
-            if (pjctx != NULL)
-                /* pfn_pj_strerrno not yet thread-safe in PROJ 4.8.0 */
-                CPLAcquireMutex(hPROJMutex, 1000.0);
+            /* pfn_pj_strerrno not yet thread-safe in PROJ 4.8.0 */
+            CPLMutexHolderD( &hPROJMutex );
 
             const char *pszError = NULL;
-            if( pj_strerrno != NULL )
+            if( err == CT3D_ERR_VERTICAL_MODEL )
+                pszError = "Reprojection failed, a height model could not be read.";
+            else if( pj_strerrno != NULL )
                 pszError = pj_strerrno( err );
             
             if( pszError == NULL )
@@ -561,10 +1350,6 @@ int   err, i;
                           err );
             else
                 CPLError( CE_Failure, CPLE_AppDefined, "%s", pszError );
-
-            if (pjctx != NULL)
-                /* pfn_pj_strerrno not yet thread-safe in PROJ 4.8.0 */
-                CPLReleaseMutex(hPROJMutex);
         }
         else if( nErrorCount == 20 )
         {
@@ -573,58 +1358,328 @@ int   err, i;
                       err );
         }
 
-        if (pjctx == NULL)
-            CPLReleaseMutex(hPROJMutex);
         return FALSE;
     }
 
-    if (pjctx == NULL)
-        CPLReleaseMutex(hPROJMutex);
+    return TRUE;
+}
+
+void OGRProj4CT3D::RunChunk( void *pArg )
+{
+    CT3DChunk *psChunk = (CT3DChunk *) pArg;
+
+    psChunk->nErr = psChunk->poCT->TransformChunk( 
+        psChunk->psState, psChunk->nCount, psChunk->nOffset,
+        psChunk->xIn, psChunk->yIn, psChunk->zIn,
+        psChunk->x, psChunk->y, psChunk->z, psChunk->pabSuccess );
+}
+
+int OGRProj4CT3D::TransformChunk( CT3DWorkerState *psState, int nCount, int nOffset, 
+                                  const double *xIn, const double *yIn, const double *zIn,
+                                  double *x, double *y, double *z, int *pabSuccess )
+/*
+ * returns 0 or the PROJ.4 error code, errors are reported by the caller
+ */
+{
+/* -------------------------------------------------------------------- */
+/*      Run all the stages on a tile of a few thousand points before    */
+/*      going to the next one, so the coordinates and scratch buffers   */
+/*      stay in cache from one stage to the next.                       */
+/* -------------------------------------------------------------------- */
+    if( nTileSize == 0 || nCount <= nTileSize )
+        return TransformTile( psState, nCount, nOffset, xIn, yIn, zIn, 
+                              x, y, z, pabSuccess );
+
+    int nFirst = 0;
+    while( nFirst < nCount )
+    {
+        int nTile = MIN( nTileSize, nCount - nFirst );
+        long io = (long) nFirst * nOffset;
+
+        /* PROJ.4 fails a batch of a single point on any error, so the */
+        /* last point is never left alone in a tile                    */
+        if( nCount - nFirst - nTile == 1 )
+            nTile++;
+
+        int err = TransformTile( psState, nTile, nOffset, 
+                                 xIn + io, yIn + io, (zIn != NULL) ? zIn + io : NULL,
+                                 x + io, y + io, (z != NULL) ? z + io : NULL,
+                                 (pabSuccess != NULL) ? pabSuccess + nFirst : NULL );
+        if( err != 0 )
+            return err;
+
+        nFirst += nTile;
+    }
+
+    return 0;
+}
+
+int OGRProj4CT3D::TransformTile( CT3DWorkerState *psState, int nCount, int nOffset, 
+                                 const double *xIn, const double *yIn, const double *zIn,
+                                 double *x, double *y, double *z, int *pabSuccess )
+/*
+ * returns 0 or the PROJ.4 error code, errors are reported by the caller
+ */
+{
+    if( bVerticalOnly )
+        return TransformHeights( psState, nCount, nOffset, xIn, yIn, zIn, 
+                                 x, y, z, pabSuccess );
+
+    
+int   err, i, io;
 
 /* -------------------------------------------------------------------- */
-/*      Potentially transform back to degrees.                          */
+/*      Potentially transform to radians, in the same pass that moves   */
+/*      the source coordinates into the output arrays.                  */
 /* -------------------------------------------------------------------- */
-    if( bTargetLatLong )
+    if( bSourceLatLong )
     {
         for( i = 0; i < nCount; i++ )
         {
-            if( x[i] != HUGE_VAL && y[i] != HUGE_VAL )
+            io = i * nOffset;
+            double dfX = xIn[io];
+            double dfY = yIn[io];
+
+            if( bSourceWrap && dfX != HUGE_VAL && dfY != HUGE_VAL )
+            {
+                if( dfX < dfSourceWrapLong - 180.0 )
+                    dfX += 360.0;
+                else if( dfX > dfSourceWrapLong + 180 )
+                    dfX -= 360.0;
+            }
+
+            if( dfX != HUGE_VAL )
             {
-                x[i] *= dfTargetFromRadians;
-                y[i] *= dfTargetFromRadians;
+                dfX *= dfSourceToRadians;
+                dfY *= dfSourceToRadians;
             }
+
+            x[io] = dfX;
+            y[io] = dfY;
+        }
+    }
+    else if( x != xIn || y != yIn )
+    {
+        for( i = 0; i < nCount; i++ )
+        {
+            io = i * nOffset;
+            x[io] = xIn[io];
+            y[io] = yIn[io];
+        }
+    }
+
+    if( z != NULL && z != zIn )
+    {
+        for( i = 0; i < nCount; i++ )
+        {
+            io = i * nOffset;
+            z[io] = zIn[io];
         }
+    }
 
-        if( bTargetWrap )
+/* -------------------------------------------------------------------- */
+/*      Do the transformation using PROJ.4.                             */
+/* -------------------------------------------------------------------- */
+    if (bCheckWithInvertProj)
+    {
+        /* For some projections, we cannot detect if we are trying to reproject */
+        /* coordinates outside the validity area of the projection. So let's do */
+        /* the reverse reprojection and compare with the source coordinates */
+        if (nCount > psState->nMaxCount)
+        {
+            psState->nMaxCount = nCount;
+            psState->padfOriX = (double*) CPLRealloc(psState->padfOriX, sizeof(double)*nCount);
+            psState->padfOriY = (double*) CPLRealloc(psState->padfOriY, sizeof(double)*nCount);
+            psState->padfOriZ = (double*) CPLRealloc(psState->padfOriZ, sizeof(double)*nCount);
+            psState->padfTargetX = (double*) CPLRealloc(psState->padfTargetX, sizeof(double)*nCount);
+            psState->padfTargetY = (double*) CPLRealloc(psState->padfTargetY, sizeof(double)*nCount);
+            psState->padfTargetZ = (double*) CPLRealloc(psState->padfTargetZ, sizeof(double)*nCount);
+        }
+        double *padfOriX = psState->padfOriX;
+        double *padfOriY = psState->padfOriY;
+        double *padfOriZ = psState->padfOriZ;
+        double *padfTargetX = psState->padfTargetX;
+        double *padfTargetY = psState->padfTargetY;
+        double *padfTargetZ = psState->padfTargetZ;
+
+        /* the copies are contiguous whatever the stride of x, y and z */
+        for( i = 0; i < nCount; i++ )
+        {
+            io = i * nOffset;
+            padfOriX[i] = x[io];
+            padfOriY[i] = y[io];
+            if (z)
+                padfOriZ[i] = z[io];
+        }
+        err = ct3D_pj_transform( psState->psPJSource, psState->psPJTarget, nCount, nOffset, 
+                                 x, y, z, psState );
+        if (err == 0)
         {
             for( i = 0; i < nCount; i++ )
             {
-                if( x[i] != HUGE_VAL && y[i] != HUGE_VAL )
+                io = i * nOffset;
+                padfTargetX[i] = x[io];
+                padfTargetY[i] = y[io];
+                if (z)
+                    padfTargetZ[i] = z[io];
+            }
+            
+            err = ct3D_pj_transform( psState->psPJTarget, psState->psPJSource , nCount, 1,
+                                    padfTargetX, padfTargetY, (z) ? padfTargetZ : NULL, psState,
+                                    TRUE );
+            if (err == 0)
+            {
+                for( i = 0; i < nCount; i++ )
                 {
-                    if( x[i] < dfTargetWrapLong - 180.0 )
-                        x[i] += 360.0;
-                    else if( x[i] > dfTargetWrapLong + 180 )
-                        x[i] -= 360.0;
+                    io = i * nOffset;
+                    if ( x[io] != HUGE_VAL && y[io] != HUGE_VAL &&
+                        (fabs(padfTargetX[i] - padfOriX[i]) > dfThreshold ||
+                         fabs(padfTargetY[i] - padfOriY[i]) > dfThreshold) )
+                    {
+                        x[io] = HUGE_VAL;
+                        y[io] = HUGE_VAL;
+                    }
                 }
             }
         }
     }
 
+	 else
+     {
+        err = ct3D_pj_transform( psState->psPJSource, psState->psPJTarget, nCount, nOffset, 
+                                 x, y, z, psState );
+     }
+
+    if( err != 0 )
+        return err;
+
 /* -------------------------------------------------------------------- */
-/*      Establish error information if pabSuccess provided.             */
+/*      Potentially transform back to degrees, and establish error      */
+/*      information if pabSuccess provided, in a single pass.           */
 /* -------------------------------------------------------------------- */
+    if( bTargetLatLong || pabSuccess != NULL )
+    {
+        for( i = 0; i < nCount; i++ )
+        {
+            io = i * nOffset;
+            double dfX = x[io];
+            double dfY = y[io];
+
+            if( bTargetLatLong && dfX != HUGE_VAL && dfY != HUGE_VAL )
+            {
+                dfX *= dfTargetFromRadians;
+                dfY *= dfTargetFromRadians;
+
+                if( bTargetWrap && dfX != HUGE_VAL && dfY != HUGE_VAL )
+                {
+                    if( dfX < dfTargetWrapLong - 180.0 )
+                        dfX += 360.0;
+                    else if( dfX > dfTargetWrapLong + 180 )
+                        dfX -= 360.0;
+                }
+
+                x[io] = dfX;
+                y[io] = dfY;
+            }
+
+            if( pabSuccess )
+                pabSuccess[i] = (dfX == HUGE_VAL || dfY == HUGE_VAL) ? FALSE : TRUE;
+        }
+    }
+
+    return 0;
+}
+
+
+int OGRProj4CT3D::TransformHeights( CT3DWorkerState *psState, int nCount, int nOffset, 
+                                    const double *xIn, const double *yIn, const double *zIn,
+                                    double *x, double *y, double *z, int *pabSuccess )
+/*
+ * transforms a tile when the horizontal part is an identity (bVerticalOnly):
+ * the horizontal coordinates are copied unchanged and their radians are only
+ * used to look up the height models, returns 0 or CT3D_ERR_VERTICAL_MODEL
+ */
+{
+    const CT3DPipeline *psPipeline = &asPipelines[0][z != NULL ? 1 : 0];
+    int   i, io;
+
+    if( x != xIn || y != yIn )
+    {
+        for( i = 0; i < nCount; i++ )
+        {
+            io = i * nOffset;
+            x[io] = xIn[io];
+            y[io] = yIn[io];
+        }
+    }
+
+    if( z != NULL && z != zIn )
+    {
+        for( i = 0; i < nCount; i++ )
+        {
+            io = i * nOffset;
+            z[io] = zIn[io];
+        }
+    }
+
+    if( psPipeline->nStages > 0 )
+    {
+        /* same stride as z, the height models take one offset for all */
+        psState->ReserveLookup( nCount * nOffset );
+        double *padfLon = psState->padfLookupX;
+        double *padfLat = psState->padfLookupY;
+
+        for( i = 0; i < nCount; i++ )
+        {
+            io = i * nOffset;
+            double dfX = x[io];
+            double dfY = y[io];
+
+            if( dfX != HUGE_VAL )
+            {
+                dfX *= dfSourceToRadians;
+                dfY *= dfSourceToRadians;
+            }
+
+            padfLon[io] = dfX;
+            padfLat[io] = dfY;
+        }
+
+        for( int iStage = 0; iStage < psPipeline->nStages; iStage++ )
+        {
+            switch( psPipeline->anStages[iStage] )
+            {
+              case CT3D_STAGE_SRC_VERTICAL:
+                if( poSRSSource->ApplyVerticalCorrection(0, nCount, padfLon, padfLat, z, 
+                                                         &psState->oVerticalScratch, nOffset) != OGRERR_NONE )
+                    return CT3D_ERR_VERTICAL_MODEL;
+                break;
+
+              case CT3D_STAGE_VERTICAL_DIFFERENCE:
+                if( poSRSSource->ApplyVerticalDifference(poSRSTarget, nCount, padfLon, padfLat, z, 
+                                                         &psState->oVerticalScratch, nOffset) != OGRERR_NONE )
+                    return CT3D_ERR_VERTICAL_MODEL;
+                break;
+
+              case CT3D_STAGE_DST_VERTICAL:
+                if( poSRSTarget->ApplyVerticalCorrection(1, nCount, padfLon, padfLat, z, 
+                                                         &psState->oVerticalScratch, nOffset) != OGRERR_NONE )
+                    return CT3D_ERR_VERTICAL_MODEL;
+                break;
+            }
+        }
+    }
+
     if( pabSuccess )
     {
         for( i = 0; i < nCount; i++ )
         {
-            if( x[i] == HUGE_VAL || y[i] == HUGE_VAL )
-                pabSuccess[i] = FALSE;
-            else
-                pabSuccess[i] = TRUE;
+            io = i * nOffset;
+            pabSuccess[i] = (x[io] == HUGE_VAL || y[io] == HUGE_VAL) ? FALSE : TRUE;
         }
     }
 
-    return TRUE;
+    return 0;
 }
 
 
@@ -835,54 +1890,74 @@ static int pj_adjust_axis( projCtx ctx,
 //so it is copied here.
 
 # define assert(exp)	((void)0)
+
+/* guards insertions into grid_list, lookups do not lock */
+static void *hGridListMutex = NULL;
+
 void ct3D_pj_acquire_lock()
 {
+    CPLCreateOrAcquireMutex( &hGridListMutex, 1000.0 );
 }
 void ct3D_pj_release_lock()
 {
+    CPLReleaseMutex( hGridListMutex );
 }
 
-LP
-ct3D_nad_intr(LP t, struct CTABLE *ct) {
-	LP val, frct;
+/* 
+ * Find the cell of ct holding t (relative to the ll origin), points on the
+ * last row or column use the cell before. Returns 0 if t is off the grid.
+ */
+static int
+ct3D_nad_intr_cell(LP t, struct CTABLE *ct, long *pindex, LP *pfrct) {
+	LP frct;
 	ILP indx;
-	double m00, m10, m01, m11;
-	FLP *f00, *f10, *f01, *f11;
-	long index;
 	int in;
 
 	indx.lam = floor(t.u /= ct->del.u);
 	indx.phi = floor(t.v /= ct->del.v);
 	frct.u = t.u - indx.lam;
 	frct.v = t.v - indx.phi;
-	val.u = val.v = HUGE_VAL;
 	if (indx.lam < 0) {
 		if (indx.lam == -1 && frct.u > 0.99999999999) {
 			++indx.lam;
 			frct.u = 0.;
 		} else
-			return val;
+			return 0;
 	} else if ((in = indx.lam + 1) >= ct->lim.lam) {
 		if (in == ct->lim.lam && frct.u < 1e-11) {
 			--indx.lam;
 			frct.u = 1.;
 		} else
-			return val;
+			return 0;
 	}
 	if (indx.phi < 0) {
 		if (indx.phi == -1 && frct.v > 0.99999999999) {
 			++indx.phi;
 			frct.v = 0.;
 		} else
-			return val;
+			return 0;
 	} else if ((in = indx.phi + 1) >= ct->lim.phi) {
 		if (in == ct->lim.phi && frct.v < 1e-11) {
 			--indx.phi;
 			frct.v = 1.;
 		} else
-			return val;
+			return 0;
 	}
-	index = indx.phi * ct->lim.lam + indx.lam;
+	*pindex = indx.phi * ct->lim.lam + indx.lam;
+	*pfrct = frct;
+	return 1;
+}
+
+LP
+ct3D_nad_intr(LP t, struct CTABLE *ct) {
+	LP val, frct;
+	double m00, m10, m01, m11;
+	FLP *f00, *f10, *f01, *f11;
+	long index;
+
+	val.u = val.v = HUGE_VAL;
+	if (!ct3D_nad_intr_cell(t, ct, &index, &frct))
+		return val;
 	f00 = ct->cvs + index++;
 	f10 = ct->cvs + index;
 	index += ct->lim.lam;
@@ -902,71 +1977,253 @@ ct3D_nad_intr(LP t, struct CTABLE *ct) {
 	return val;
 }
 
-#define MAX_TRY 9
+/* number of points the batch versions of nad_intr/nad_cvt work on at once */
+#define CT3D_NAD_BATCH 64
+
+/*
+ * ct3D_nad_intr() for nCount <= CT3D_NAD_BATCH points, the cells are found
+ * per point and interpolated together with bilinearPairBatch(). If dlam is
+ * set, the derivatives of the shift along t.u (in .u) and t.v (in .v) are 
+ * returned in dlam and dphi, the mixed second derivatives (lam in .u, phi
+ * in .v) in dmixed and the cell of every point in cell.
+ */
+static void
+ct3D_nad_intr_batch(int nCount, const LP *t, LP *val, struct CTABLE *ct,
+					LP *dlam = NULL, LP *dphi = NULL, LP *dmixed = NULL, 
+					long *cell = NULL) {
+	int anPoint[CT3D_NAD_BATCH], anOffset[CT3D_NAD_BATCH];
+	double adfFrctU[CT3D_NAD_BATCH], adfFrctV[CT3D_NAD_BATCH];
+	double adfU[CT3D_NAD_BATCH], adfV[CT3D_NAD_BATCH];
+	double adfGradU[3*CT3D_NAD_BATCH], adfGradV[3*CT3D_NAD_BATCH];
+	int i, nCells = 0;
+
+	for (i = 0; i < nCount; i++) {
+		long index;
+		LP frct;
+
+		if (!ct3D_nad_intr_cell(t[i], ct, &index, &frct)) {
+			val[i].u = val[i].v = HUGE_VAL;
+			continue;
+		}
+		if (cell != NULL)
+			cell[i] = index;
+		anPoint[nCells] = i;
+		anOffset[nCells] = (int) index;
+		adfFrctU[nCells] = frct.u;
+		adfFrctV[nCells] = frct.v;
+		nCells++;
+	}
+
+	if (nCells == 0)
+		return;
+
+	/* FLP holds lam, phi */
+	if (dlam == NULL) {
+		bilinearPairBatch(nCells, (const float *) ct->cvs, anOffset, ct->lim.lam,
+						  adfFrctU, adfFrctV, adfU, adfV);
+	} else {
+		bilinearPairGradientBatch(nCells, (const float *) ct->cvs, anOffset, ct->lim.lam,
+								  adfFrctU, adfFrctV, adfU, adfV, adfGradU, adfGradV);
+	}
+
+	for (i = 0; i < nCells; i++) {
+		int k = anPoint[i];
+
+		val[k].u = adfU[i];
+		val[k].v = adfV[i];
+		if (dlam != NULL) {
+			/* per cell to per radian */
+			dlam[k].u = adfGradU[i] / ct->del.u;
+			dlam[k].v = adfGradU[nCells + i] / ct->del.v;
+			dphi[k].u = adfGradV[i] / ct->del.u;
+			dphi[k].v = adfGradV[nCells + i] / ct->del.v;
+			dmixed[k].u = adfGradU[2*nCells + i] / (ct->del.u * ct->del.v);
+			dmixed[k].v = adfGradV[2*nCells + i] / (ct->del.u * ct->del.v);
+		}
+	}
+}
+
 #define TOL 1e-12
+
+static void
+ct3D_nad_cvt_batch(int nCount, const LP *in, LP *out, int inverse, struct CTABLE *ct,
+				   GridShiftStats *psStats);
+
 LP
-ct3D_nad_cvt(LP in, int inverse, struct CTABLE *ct) {
-	LP t, tb;
+ct3D_nad_cvt(LP in, int inverse, struct CTABLE *ct, GridShiftStats *psStats) {
+	LP out;
+
+	ct3D_nad_cvt_batch(1, &in, &out, inverse, ct, psStats);
+	return out;
+}
+
+/*
+ * Shift nCount <= CT3D_NAD_BATCH points forward (from the grid datum, in.u 
+ * minus the lam shift and in.v plus the phi shift) or inverse.
+ *
+ * The inverse solves t - shift(t) = tb with Newton's method on the bilinear 
+ * shift surface, starting from the shift at the grid node nearest to tb, so
+ * the result of a point does not depend on the points around it. All points
+ * iterate together, points leave the active set once they are done so the 
+ * others keep iterating on a compact batch. Within a cell the surface is 
+ * bilinear, so the residual left by a step is exactly the mixed derivative 
+ * times the product of the step components. Points stop as soon as that is
+ * below TOL and the step stayed in the cell, which for smooth grids is after
+ * the first evaluation, and otherwise once both step components are below 
+ * TOL.
+ */
+static void
+ct3D_nad_cvt_batch(int nCount, const LP *in, LP *out, int inverse, struct CTABLE *ct,
+				   GridShiftStats *psStats) {
+	LP tb[CT3D_NAD_BATCH], t[CT3D_NAD_BATCH], val[CT3D_NAD_BATCH];
+	LP dlam[CT3D_NAD_BATCH], dphi[CT3D_NAD_BATCH], dmixed[CT3D_NAD_BATCH];
+	long cell[CT3D_NAD_BATCH];
+	int anPoint[CT3D_NAD_BATCH], anIter[CT3D_NAD_BATCH];
+	int i, k, nActive = 0;
 
-	if (in.u == HUGE_VAL)
-		return in;
 	/* normalize input to ll origin */
-	tb = in;
-	tb.u -= ct->ll.u;
-	tb.v -= ct->ll.v;
-	tb.u = adjlon(tb.u - PI) + PI;
-	t = ct3D_nad_intr(tb, ct);
-	if (inverse) {
-		LP del, dif;
-		int i = MAX_TRY;
-
-		if (t.u == HUGE_VAL) return t;
-		t.u = tb.u + t.u;
-		t.v = tb.v - t.v;
-
-		do {
-			del = ct3D_nad_intr(t, ct);
-
-                        /* This case used to return failure, but I have
-                           changed it to return the first order approximation
-                           of the inverse shift.  This avoids cases where the
-                           grid shift *into* this grid came from another grid.
-                           While we aren't returning optimally correct results
-                           I feel a close result in this case is better than
-                           no result.  NFW
-                           To demonstrate use -112.5839956 49.4914451 against
-                           the NTv2 grid shift file from Canada. */
-			if (del.u == HUGE_VAL) 
-                        {
-                            if( getenv( "PROJ_DEBUG" ) != NULL )
-                                fprintf( stderr, 
-                                         "Inverse grid shift iteration failed, presumably at grid edge.\n"
-                                         "Using first approximation.\n" );
-                            /* return del */;
-                            break;
-                        }
-
-			t.u -= dif.u = t.u - del.u - tb.u;
-			t.v -= dif.v = t.v + del.v - tb.v;
-		} while (i-- && fabs(dif.u) > TOL && fabs(dif.v) > TOL);
-		if (i < 0) {
-                    if( getenv( "PROJ_DEBUG" ) != NULL )
-                        fprintf( stderr, 
-                                 "Inverse grid shift iterator failed to converge.\n" );
-                    t.u = t.v = HUGE_VAL;
-                    return t;
+	for (i = 0; i < nCount; i++) {
+		out[i] = in[i];
+		if (in[i].u == HUGE_VAL)
+			continue;
+		anPoint[nActive] = i;
+		tb[nActive].u = adjlon(in[i].u - ct->ll.u - PI) + PI;
+		tb[nActive].v = in[i].v - ct->ll.v;
+		nActive++;
+	}
+
+	if (!inverse) {
+		ct3D_nad_intr_batch(nActive, tb, t, ct);
+
+		for (k = 0; k < nActive; k++) {
+			i = anPoint[k];
+			if (t[k].u == HUGE_VAL)
+				out[i] = t[k];
+			else {
+				out[i].u -= t[k].u;
+				out[i].v += t[k].v;
+			}
 		}
-		in.u = adjlon(t.u + ct->ll.u);
-		in.v = t.v + ct->ll.v;
-	} else {
-		if (t.u == HUGE_VAL)
-			in = t;
-		else {
-			in.u -= t.u;
-			in.v += t.v;
+		return;
+	}
+
+	/* start from the shift at the nearest node */
+	for (k = 0; k < nActive; k++) {
+		int iu = (int) floor(tb[k].u / ct->del.u + 0.5);
+		int iv = (int) floor(tb[k].v / ct->del.v + 0.5);
+		FLP *node;
+
+		iu = MAX(0, MIN(iu, ct->lim.lam - 1));
+		iv = MAX(0, MIN(iv, ct->lim.phi - 1));
+		node = ct->cvs + (long) iv * ct->lim.lam + iu;
+		t[k].u = tb[k].u + node->lam;
+		t[k].v = tb[k].v - node->phi;
+		anIter[k] = 0;
+	}
+
+	while (nActive > 0) {
+		int nStill = 0;
+
+		ct3D_nad_intr_batch(nActive, t, val, ct, dlam, dphi, dmixed, cell);
+
+		for (k = 0; k < nActive; k++) {
+			LP dif;
+			long index;
+			LP frct;
+			int bDone;
+
+			i = anPoint[k];
+			if (val[k].u == HUGE_VAL && anIter[k] == 0) {
+				LP del = ct3D_nad_intr(tb[k], ct);
+
+				/* the point is not on the grid */
+				if (del.u == HUGE_VAL) {
+					out[i] = del;
+					continue;
+				}
+
+				/* the start left the grid, go on from the first order
+				   approximation as the fixed point iteration did */
+				anPoint[nStill] = i;
+				anIter[nStill] = 1;
+				tb[nStill] = tb[k];
+				t[nStill].u = tb[k].u + del.u;
+				t[nStill].v = tb[k].v - del.v;
+				nStill++;
+				continue;
+			}
+
+			if (val[k].u == HUGE_VAL) {
+				/* This case used to return failure, but the last
+				   approximation of the inverse shift is returned
+				   instead, see the comment in proj's nad_cvt(). */
+				if( getenv( "PROJ_DEBUG" ) != NULL )
+					fprintf( stderr, 
+							 "Inverse grid shift iteration failed, presumably at grid edge.\n"
+							 "Using first approximation.\n" );
+				if (psStats != NULL) {
+					psStats->nInversePoints++;
+					psStats->nIterations += anIter[k];
+					psStats->nEdgeFallbacks++;
+				}
+				out[i].u = adjlon(t[k].u + ct->ll.u);
+				out[i].v = t[k].v + ct->ll.v;
+				continue;
+			}
+
+			/* Newton step on (t.u - lam(t) - tb.u, t.v + phi(t) - tb.v) */
+			double fu = t[k].u - val[k].u - tb[k].u;
+			double fv = t[k].v + val[k].v - tb[k].v;
+			double juu = 1. - dlam[k].u, juv = -dlam[k].v;
+			double jvu = dphi[k].u, jvv = 1. + dphi[k].v;
+			double det = juu * jvv - juv * jvu;
+
+			dif.u = (jvv * fu - juv * fv) / det;
+			dif.v = (juu * fv - jvu * fu) / det;
+			t[k].u -= dif.u;
+			t[k].v -= dif.v;
+			anIter[k]++;
+
+			bDone = fabs(dif.u) <= TOL && fabs(dif.v) <= TOL;
+			if (!bDone) {
+				double residual = MAX(fabs(dmixed[k].u), fabs(dmixed[k].v))
+					* fabs(dif.u * dif.v);
+
+				bDone = residual <= 0.5 * TOL
+					&& ct3D_nad_intr_cell(t[k], ct, &index, &frct)
+					&& index == cell[k];
+			}
+
+			if (!bDone && anIter[k] < GRIDSHIFT_MAX_ITERATIONS) {
+				anPoint[nStill] = i;
+				anIter[nStill] = anIter[k];
+				tb[nStill] = tb[k];
+				t[nStill] = t[k];
+				nStill++;
+				continue;
+			}
+
+			if (psStats != NULL) {
+				psStats->nInversePoints++;
+				psStats->nIterations += anIter[k];
+			}
+
+			if (!bDone) {
+				if( getenv( "PROJ_DEBUG" ) != NULL )
+					fprintf( stderr, 
+							 "Inverse grid shift iterator failed to converge.\n" );
+				if (psStats != NULL)
+					psStats->nNotConverged++;
+				out[i].u = out[i].v = HUGE_VAL;
+			} else {
+				if (psStats != NULL)
+					psStats->anIterationCount[anIter[k] - 1]++;
+				out[i].u = adjlon(t[k].u + ct->ll.u);
+				out[i].v = t[k].v + ct->ll.v;
+			}
 		}
+		nActive = nStill;
 	}
-	return in;
 }
 
 /************************************************************************/
@@ -1515,286 +2772,860 @@ int ct3D_pj_gridinfo_load( projCtx ctx, PJ_GRIDINFO *gi )
 }
 
 /************************************************************************/
-/*                        pj_apply_gridshift_3()                        */
+/*                         CT3DGridMemory                               */
 /*                                                                      */
-/*      This is the real workhorse, given a gridlist.                   */
+/*      Accounts the loaded grid shift tables (ct->cvs) in the process  */
+/*      wide GridMemoryManager budget. Tables are pinned while a        */
+/*      gridshift call uses them and reloaded on their next use after   */
+/*      being evicted.                                                  */
 /************************************************************************/
 
-int ct3D_pj_apply_gridshift_3( projCtx ctx, PJ_GRIDINFO **tables, int grid_count,
-                          int inverse, long point_count, int point_offset,
-                          double *x, double *y, double *z )
-
+class CT3DGridMemory : public GridMemoryClient
 {
-    int  i;
-    static int debug_count = 0;
+public:
+    virtual void DetachEntry( GridMemoryEntry *psEntry );
 
-    if( tables == NULL || grid_count == 0 )
-    {
-        pj_ctx_set_errno( ctx, -38);
-        return -38;
-    }
+    /* DetachEntry() already freed the table under the manager lock */
+    virtual void EvictEntry( GridMemoryEntry * ) {}
+};
 
-    ctx->last_errno = 0;
+/* memory entry of a table, cvs either points into poMapped or was allocated */
+struct CT3DGridEntry : public GridMemoryEntry
+{
+    MappedFile *poMapped;
+};
 
-    for( i = 0; i < point_count; i++ )
-    {
-        long io = i * point_offset;
-        LP   input, output;
-        int  itable;
+typedef std::map<PJ_GRIDINFO*, CT3DGridEntry*> GridMemoryMap;
 
-        input.v = y[io];
-        input.u = x[io];
-        output.v = HUGE_VAL;
-        output.u = HUGE_VAL;
+static CT3DGridMemory oGridMemory;
+static GridMemoryMap oGridMemoryEntries;
+static void *hGridMemoryMutex = NULL;
+static void *hGridLoadMutex = NULL;     /* serializes loading of tables */
 
-        /* keep trying till we find a table that works */
-        for( itable = 0; itable < grid_count; itable++ )
-        {
-            PJ_GRIDINFO *gi = tables[itable];
-            struct CTABLE *ct = gi->ct;
-            double epsilon = (fabs(ct->del.v)+fabs(ct->del.u))/10000.0;
+void CT3DGridMemory::DetachEntry( GridMemoryEntry *psEntry )
 
-            /* skip tables that don't match our point at all.  */
-            if( ct->ll.v - epsilon > input.v 
-                || ct->ll.u - epsilon > input.u
-                || (ct->ll.v + (ct->lim.phi-1) * ct->del.v + epsilon 
-                    < input.v)
-                || (ct->ll.u + (ct->lim.lam-1) * ct->del.u + epsilon 
-                    < input.u) )
-                continue;
+{
+    /* unpinned tables are not in use, they can be freed right away */
+    CT3DGridEntry *psGridEntry = (CT3DGridEntry *) psEntry;
+    PJ_GRIDINFO *gi = (PJ_GRIDINFO *) psEntry->pData;
 
-            /* If we have child nodes, check to see if any of them apply. */
-            if( gi->child != NULL )
-            {
-                PJ_GRIDINFO *child;
+    if( psGridEntry->poMapped != NULL )
+    {
+        delete psGridEntry->poMapped;
+        psGridEntry->poMapped = NULL;
+    }
+    else
+        pj_dalloc( gi->ct->cvs );
+    gi->ct->cvs = NULL;
+}
 
-                for( child = gi->child; child != NULL; child = child->next )
-                {
-                    struct CTABLE *ct1 = child->ct;
-                    double epsilon = 
-                        (fabs(ct1->del.v)+fabs(ct1->del.u))/10000.0;
-
-                    if( ct1->ll.v - epsilon > input.v 
-                        || ct1->ll.u - epsilon > input.u
-                        || (ct1->ll.v+(ct1->lim.phi-1)*ct1->del.v + epsilon 
-                            < input.v)
-                        || (ct1->ll.u+(ct1->lim.lam-1)*ct1->del.u + epsilon 
-                            < input.u) )
-                        continue;
+static GridMemoryEntry *ct3D_gridinfo_memory( PJ_GRIDINFO *gi )
 
-                    break;
-                }
+{
+    CPLMutexHolderD( &hGridMemoryMutex );
 
-                /* we found a more refined child node to use */
-                if( child != NULL )
-                {
-                    gi = child;
-                    ct = child->ct;
-                }
-            }
+    GridMemoryMap::iterator oIter = oGridMemoryEntries.find( gi );
+    if( oIter != oGridMemoryEntries.end() )
+        return oIter->second;
 
-            /* load the grid shift info if we don't have it. */
-            if( ct->cvs == NULL && !ct3D_pj_gridinfo_load( ctx, gi ) )
-            {
-                pj_ctx_set_errno( ctx, -38 );
-                return -38;
-            }
-            
-            output = ct3D_nad_cvt( input, inverse, ct );
-            if( output.u != HUGE_VAL )
-            {
-                if( debug_count++ < 20 )
-                    pj_log( ctx, PJ_LOG_DEBUG_MINOR,
-                            "ct3D_pj_apply_gridshift(): used %s", ct->id );
-                break;
-            }
-        }
+    /* grid infos stay in grid_list for the lifetime of the process */
+    CT3DGridEntry *psEntry = new CT3DGridEntry;
+    GridMemoryManager::InitEntry( psEntry, &oGridMemory, gi );
+    psEntry->poMapped = NULL;
+    oGridMemoryEntries[gi] = psEntry;
 
-        if( output.u == HUGE_VAL )
-        {
-            if( ctx->debug_level >= PJ_LOG_DEBUG_MAJOR )
-            {
-                pj_log( ctx, PJ_LOG_DEBUG_MAJOR,
-                    "pj_apply_gridshift(): failed to find a grid shift table for\n"
-                    "                      location (%.7fdW,%.7fdN)",
-                    x[io] * RAD_TO_DEG, 
-                    y[io] * RAD_TO_DEG );
-                for( itable = 0; itable < grid_count; itable++ )
-                {
-                    PJ_GRIDINFO *gi = tables[itable];
-                    if( itable == 0 )
-                        pj_log( ctx, PJ_LOG_DEBUG_MAJOR,
-                                "   tried: %s", gi->gridname );
-                    else
-                        pj_log( ctx, PJ_LOG_DEBUG_MAJOR,
-                                ",%s", gi->gridname );
-                }
-            }
+    return psEntry;
+}
 
-            /* 
-             * We don't actually have any machinery currently to set the 
-             * following macro, so this is mostly kept here to make it clear 
-             * how we ought to operate if we wanted to make it super clear 
-             * that an error has occured when points are outside our available
-             * datum shift areas.  But if this is on, we will find that "low 
-             * value" points on the fringes of some datasets will completely 
-             * fail causing lots of problems when it is more or less ok to 
-             * just not apply a datum shift.  So rather than deal with
-             * that we just fallback to no shift. (see also bug #45).
-             */
-#ifdef ERR_GRID_AREA_TRANSIENT_SEVERE
-            y[io] = HUGE_VAL;
-            x[io] = HUGE_VAL;
-#else
-            /* leave x/y unshifted. */
-#endif
-        }
-        else
-        {
-            y[io] = output.v;
-            x[io] = output.u;
-        }
-    }
+static GIntBig ct3D_gridinfo_bytes( PJ_GRIDINFO *gi )
 
-    return 0;
+{
+    /* gtx tables hold one float per cell, the others a FLP pair */
+    if( strcmp(gi->format,"gtx") == 0 )
+        return (GIntBig) sizeof(float) * gi->ct->lim.lam * gi->ct->lim.phi;
+
+    return (GIntBig) sizeof(FLP) * gi->ct->lim.lam * gi->ct->lim.phi;
 }
 
 /************************************************************************/
-/*                       pj_gridinfo_init_ntv1()                        */
+/*                      ct3D_gridinfo_load_mapped()                     */
 /*                                                                      */
-/*      Load an NTv1 style Canadian grid shift file.                    */
+/*      Load a table by mapping a cache file holding its cells in the   */
+/*      layout of ct->cvs, so processes using the same table share      */
+/*      one copy in the page cache. The cache file is written from a    */
+/*      regular load the first time and whenever the grid file          */
+/*      changed. Caching is only done in the directory set by           */
+/*      SPATIALREF3D_GRID_CACHE_DIR and cache files of other users are  */
+/*      never mapped. Returns FALSE with cvs unset if the table could   */
+/*      not be loaded at all, otherwise cvs is mapped or allocated.     */
 /************************************************************************/
 
-static int ct3D_pj_gridinfo_init_ntv1( projCtx ctx, FILE * fid, PJ_GRIDINFO *gi )
+#define CT3D_GRID_CACHE_MAGIC       "CT3DGRD1"
+#define CT3D_GRID_CACHE_HEADER_SIZE 64      /* keeps the cells aligned */
 
+struct CT3DGridCacheHeader
 {
-    unsigned char header[176];
-    struct CTABLE *ct;
-    LP		ur;
-    
-    assert( sizeof(int) == 4 );
-    assert( sizeof(double) == 8 );
-    if( sizeof(int) != 4 || sizeof(double) != 8 )
+    char    achMagic[8];
+    GUInt32 nByteOrder;         /* 0x01020304 in the byte order of the writer */
+    GInt32  nLam;
+    GInt32  nPhi;
+    GInt32  nCellBytes;
+    GIntBig nSourceSize;        /* size and modification time of the grid file */
+    GIntBig nSourceTime;
+    GIntBig nGridOffset;
+};
+
+static void ct3D_gridinfo_cache_header( PJ_GRIDINFO *gi, VSIStatBufL *psStat,
+                                        GByte *pabyHeader )
+
+{
+    CT3DGridCacheHeader sHeader;
+
+    memset( &sHeader, 0, sizeof(sHeader) );
+    memcpy( sHeader.achMagic, CT3D_GRID_CACHE_MAGIC, 8 );
+    sHeader.nByteOrder = 0x01020304;
+    sHeader.nLam = gi->ct->lim.lam;
+    sHeader.nPhi = gi->ct->lim.phi;
+    sHeader.nCellBytes = strcmp(gi->format,"gtx") == 0 ? sizeof(float) : sizeof(FLP);
+    sHeader.nSourceSize = (GIntBig) psStat->st_size;
+    sHeader.nSourceTime = (GIntBig) psStat->st_mtime;
+    sHeader.nGridOffset = gi->grid_offset;
+
+    memset( pabyHeader, 0, CT3D_GRID_CACHE_HEADER_SIZE );
+    memcpy( pabyHeader, &sHeader, sizeof(sHeader) );
+}
+
+static int ct3D_gridinfo_map_cache( const char *pszCacheFile, const GByte *pabyHeader,
+                                    GIntBig nBytes, CT3DGridEntry *psEntry )
+
+{
+    MappedFile *poMapped = new MappedFile();
+
+    if( !poMapped->Open( pszCacheFile, true )
+        || (GIntBig) poMapped->GetSize() != CT3D_GRID_CACHE_HEADER_SIZE + nBytes
+        || memcmp( poMapped->GetData(), pabyHeader, CT3D_GRID_CACHE_HEADER_SIZE ) != 0 )
     {
-        pj_log( ctx, PJ_LOG_ERROR,
-                 "basic types of inappropraiate size in nad_load_ntv1()" );
-        pj_ctx_set_errno( ctx, -38 );
-        return 0;
+        delete poMapped;
+        return FALSE;
     }
 
+    psEntry->poMapped = poMapped;
+    return TRUE;
+}
+
+static int ct3D_gridinfo_load_mapped( projCtx ctx, PJ_GRIDINFO *gi,
+                                      CT3DGridEntry *psEntry )
+
+{
+    VSIStatBufL sStat;
+    const char *pszCacheDir = CPLGetConfigOption( "SPATIALREF3D_GRID_CACHE_DIR", NULL );
+
+    if( pszCacheDir == NULL || gi->filename == NULL 
+        || VSIStatL( gi->filename, &sStat ) != 0 )
+        return ct3D_pj_gridinfo_load( ctx, gi );
+
 /* -------------------------------------------------------------------- */
-/*      Read the header.                                                */
+/*      The cache file name tells tables of different grid files and    */
+/*      the subgrids of one file apart.                                 */
 /* -------------------------------------------------------------------- */
-    if( fread( header, sizeof(header), 1, fid ) != 1 )
-    {
-        pj_ctx_set_errno( ctx, -38 );
-        return 0;
-    }
+    CPLString osCacheFile = CPLFormFilename( pszCacheDir, 
+        CPLSPrintf( "%s_%08x_%s_" CPL_FRMT_GIB, CPLGetBasename( gi->filename ),
+                    (unsigned int) CPLHashSetHashStr( gi->filename ), 
+                    gi->format, (GIntBig) gi->grid_offset ), "ct3dgrid" );
+
+    GByte abyHeader[CT3D_GRID_CACHE_HEADER_SIZE];
+    ct3D_gridinfo_cache_header( gi, &sStat, abyHeader );
+
+    GIntBig nBytes = ct3D_gridinfo_bytes( gi );
 
+    if( !ct3D_gridinfo_map_cache( osCacheFile, abyHeader, nBytes, psEntry ) )
+    {
 /* -------------------------------------------------------------------- */
-/*      Regularize fields of interest.                                  */
+/*      Write a new cache file under a temporary name, so processes     */
+/*      sharing the cache never map a partial file. The name is not     */
+/*      predictable and the file is created exclusively, so nobody      */
+/*      can make us write through a link planted in the directory.      */
 /* -------------------------------------------------------------------- */
-    if( IS_LSB )
-    {
-        ct3D_swap_words( header+8, 4, 1 );
-        ct3D_swap_words( header+24, 8, 1 );
-        ct3D_swap_words( header+40, 8, 1 );
-        ct3D_swap_words( header+56, 8, 1 );
-        ct3D_swap_words( header+72, 8, 1 );
-        ct3D_swap_words( header+88, 8, 1 );
-        ct3D_swap_words( header+104, 8, 1 );
-    }
+        if( !ct3D_pj_gridinfo_load( ctx, gi ) )
+            return FALSE;
 
-    if( *((int *) (header+8)) != 12 )
-    {
-        pj_log( ctx, PJ_LOG_ERROR, 
-                "NTv1 grid shift file has wrong record count, corrupt?" );
-        pj_ctx_set_errno( ctx, -38 );
-        return 0;
+        CPLString osTempFile;
+        FILE *fp = NULL;
+        for( int iTry = 0; fp == NULL && iTry < 16; iTry++ )
+        {
+            osTempFile = osCacheFile + CPLSPrintf( ".%x.%08x%04x", 
+                (unsigned int) CPLGetPID(), 
+                (unsigned int) time( NULL ) ^ (unsigned int) (size_t) &osTempFile,
+                (unsigned int) rand() & 0xffff );
+            fp = MappedFile::CreatePrivate( osTempFile );
+        }
+
+        int bWritten = fp != NULL
+            && fwrite( abyHeader, CT3D_GRID_CACHE_HEADER_SIZE, 1, fp ) == 1
+            && fwrite( gi->ct->cvs, (size_t) nBytes, 1, fp ) == 1;
+        if( fp != NULL && fclose( fp ) != 0 )
+            bWritten = FALSE;
+
+        /* another process may have renamed its copy into place already */
+        if( fp != NULL && (!bWritten || VSIRename( osTempFile, osCacheFile ) != 0) )
+            VSIUnlink( osTempFile );
+
+        if( !ct3D_gridinfo_map_cache( osCacheFile, abyHeader, nBytes, psEntry ) )
+        {
+            CPLDebug( "OGRCT3D", "Could not map grid cache file %s, using %s in memory",
+                      osCacheFile.c_str(), gi->ct->id );
+            return TRUE;
+        }
+
+        pj_dalloc( gi->ct->cvs );
     }
 
-/* -------------------------------------------------------------------- */
-/*      Fill in CTABLE structure.                                       */
-/* -------------------------------------------------------------------- */
-    ct = (struct CTABLE *) pj_malloc(sizeof(struct CTABLE));
-    strcpy( ct->id, "NTv1 Grid Shift File" );
+    gi->ct->cvs = (FLP *) (psEntry->poMapped->GetData() + CT3D_GRID_CACHE_HEADER_SIZE);
 
-    ct->ll.u = - *((double *) (header+72));
-    ct->ll.v = *((double *) (header+24));
-    ur.u = - *((double *) (header+56));
-    ur.v = *((double *) (header+40));
-    ct->del.u = *((double *) (header+104));
-    ct->del.v = *((double *) (header+88));
-    ct->lim.lam = (int) (fabs(ur.u-ct->ll.u)/ct->del.u + 0.5) + 1;
-    ct->lim.phi = (int) (fabs(ur.v-ct->ll.v)/ct->del.v + 0.5) + 1;
+    return TRUE;
+}
 
-    pj_log( ctx, PJ_LOG_DEBUG_MINOR,
-            "NTv1 %dx%d: LL=(%.9g,%.9g) UR=(%.9g,%.9g)",
-            ct->lim.lam, ct->lim.phi,
-            ct->ll.u, ct->ll.v, ur.u, ur.v );
+/************************************************************************/
+/*                       ct3D_gridinfo_ensure_loaded()                  */
+/*                                                                      */
+/*      Load the table of a pinned grid which was not resident when     */
+/*      it was pinned, unless another thread did so meanwhile.          */
+/************************************************************************/
 
-    ct->ll.u *= DEG_TO_RAD;
-    ct->ll.v *= DEG_TO_RAD;
-    ct->del.u *= DEG_TO_RAD;
-    ct->del.v *= DEG_TO_RAD;
-    ct->cvs = NULL;
+static int ct3D_gridinfo_ensure_loaded( projCtx ctx, PJ_GRIDINFO *gi,
+                                        GridMemoryEntry *psEntry )
 
-    gi->ct = ct;
-    gi->grid_offset = ftell( fid );
-    gi->format = "ntv1";
+{
+    CPLMutexHolderD( &hGridLoadMutex );
+
+    /* the pin keeps cvs from being freed, other writers hold the lock */
+    if( gi->ct->cvs != NULL )
+        return 1;
+
+    int bLoaded;
+    if( CSLTestBoolean(CPLGetConfigOption( "SPATIALREF3D_GRID_MMAP", "YES" )) )
+        bLoaded = ct3D_gridinfo_load_mapped( ctx, gi, (CT3DGridEntry *) psEntry );
+    else
+        bLoaded = ct3D_pj_gridinfo_load( ctx, gi );
+
+    if( !bLoaded )
+        return 0;
+
+    GridMemoryManager::Add( psEntry, ct3D_gridinfo_bytes( gi ) );
 
     return 1;
 }
 
 /************************************************************************/
-/*                       pj_gridinfo_init_ntv2()                        */
+/*                            CT3DGridIndex                             */
 /*                                                                      */
-/*      Load a ntv2 (.gsb) file.                                        */
+/*      Bucket index over the tables of a grid list and the children    */
+/*      of every table. A bucket lists the grids whose bounds touch     */
+/*      it in the order the linear search tries them (the children of   */
+/*      a table, then the table), so a lookup finds the same grid as    */
+/*      trying every table and child in turn.                           */
 /************************************************************************/
 
-static int ct3D_pj_gridinfo_init_ntv2( projCtx ctx, FILE *fid, PJ_GRIDINFO *gilist )
+/* number of buckets per grid (table or child) in an index */
+#define CT3D_GRID_INDEX_BUCKETS_PER_GRID 4
+#define CT3D_GRID_INDEX_MAX_BUCKETS 65536
 
+struct CT3DGridCandidate
 {
-    unsigned char header[11*16];
-    int num_subfiles, subfile;
+    PJ_GRIDINFO *gi;
+    int         nTableOffset;   /* candidates up to the entry of the table, 0 for the table */
+};
 
-    assert( sizeof(int) == 4 );
-    assert( sizeof(double) == 8 );
-    if( sizeof(int) != 4 || sizeof(double) != 8 )
-    {
-        pj_log( ctx, PJ_LOG_ERROR,
-             "basic types of inappropraiate size in pj_gridinfo_init_ntv2()" );
-        pj_ctx_set_errno( ctx, -38 );
-        return 0;
-    }
+class CT3DGridIndex
+{
+    PJ_GRIDINFO **papoTables;   /* copy of the grid list the index was built for */
+    int         nTables;
+
+    double      dfMinU, dfMinV, dfMaxU, dfMaxV;
+    double      dfBucketU, dfBucketV;
+    int         nBucketsU, nBucketsV;
+    int        *panBucketStart; /* first candidate of every bucket and the end */
+    CT3DGridCandidate *pasCandidates;
+
+    void        GetBucketRange( struct CTABLE *ct, int *pnU0, int *pnV0, 
+                                int *pnU1, int *pnV1 );
+public:
+    CT3DGridIndex( PJ_GRIDINFO **papoTablesIn, int nTablesIn );
+    ~CT3DGridIndex();
+
+    void        GetCandidates( LP input, int *pnFirst, int *pnEnd );
+    const CT3DGridCandidate *GetCandidate( int i ) { return pasCandidates + i; }
+};
+
+/* same test as the linear search, including its tolerance */
+static int ct3D_grid_contains( struct CTABLE *ct, LP input )
+
+{
+    double epsilon = (fabs(ct->del.v)+fabs(ct->del.u))/10000.0;
+
+    return !( ct->ll.v - epsilon > input.v 
+              || ct->ll.u - epsilon > input.u
+              || (ct->ll.v + (ct->lim.phi-1) * ct->del.v + epsilon < input.v)
+              || (ct->ll.u + (ct->lim.lam-1) * ct->del.u + epsilon < input.u) );
+}
+
+static void ct3D_grid_bounds( struct CTABLE *ct, double *pdfMinU, double *pdfMinV,
+                              double *pdfMaxU, double *pdfMaxV )
+
+{
+    double epsilon = (fabs(ct->del.v)+fabs(ct->del.u))/10000.0;
+
+    *pdfMinU = ct->ll.u - epsilon;
+    *pdfMinV = ct->ll.v - epsilon;
+    *pdfMaxU = ct->ll.u + (ct->lim.lam-1) * ct->del.u + epsilon;
+    *pdfMaxV = ct->ll.v + (ct->lim.phi-1) * ct->del.v + epsilon;
+}
+
+CT3DGridIndex::CT3DGridIndex( PJ_GRIDINFO **papoTablesIn, int nTablesIn )
+
+{
+    int itable, iu, iv, nGrids = 0;
+    PJ_GRIDINFO *child;
+
+    nTables = nTablesIn;
+    papoTables = (PJ_GRIDINFO **) CPLMalloc( sizeof(PJ_GRIDINFO *) * nTables );
+    memcpy( papoTables, papoTablesIn, sizeof(PJ_GRIDINFO *) * nTables );
 
 /* -------------------------------------------------------------------- */
-/*      Read the overview header.                                       */
+/*      The buckets cover the union of the table bounds.                */
 /* -------------------------------------------------------------------- */
-    if( fread( header, sizeof(header), 1, fid ) != 1 )
+    dfMinU = dfMinV = HUGE_VAL;
+    dfMaxU = dfMaxV = -HUGE_VAL;
+    for( itable = 0; itable < nTables; itable++ )
     {
-        pj_ctx_set_errno( ctx, -38 );
-        return 0;
+        double dfMinU1, dfMinV1, dfMaxU1, dfMaxV1;
+
+        ct3D_grid_bounds( papoTables[itable]->ct, &dfMinU1, &dfMinV1, 
+                          &dfMaxU1, &dfMaxV1 );
+        dfMinU = MIN(dfMinU, dfMinU1);
+        dfMinV = MIN(dfMinV, dfMinV1);
+        dfMaxU = MAX(dfMaxU, dfMaxU1);
+        dfMaxV = MAX(dfMaxV, dfMaxV1);
+
+        nGrids++;
+        for( child = papoTables[itable]->child; child != NULL; child = child->next )
+            nGrids++;
     }
 
-/* -------------------------------------------------------------------- */
-/*      Byte swap interesting fields if needed.                         */
-/* -------------------------------------------------------------------- */
-    if( !IS_LSB )
+    int nBuckets = MIN(nGrids * CT3D_GRID_INDEX_BUCKETS_PER_GRID, 
+                       CT3D_GRID_INDEX_MAX_BUCKETS);
+    double dfSizeU = dfMaxU - dfMinU;
+    double dfSizeV = dfMaxV - dfMinV;
+
+    if( nTables == 0 || !(dfSizeU > 0.0 && dfSizeV > 0.0) )
     {
-        ct3D_swap_words( header+8, 4, 1 );
-        ct3D_swap_words( header+8+16, 4, 1 );
-        ct3D_swap_words( header+8+32, 4, 1 );
-        ct3D_swap_words( header+8+7*16, 8, 1 );
-        ct3D_swap_words( header+8+8*16, 8, 1 );
-        ct3D_swap_words( header+8+9*16, 8, 1 );
-        ct3D_swap_words( header+8+10*16, 8, 1 );
+        nBucketsU = nBucketsV = 1;
+    }
+    else
+    {
+        nBucketsU = (int) (sqrt( nBuckets * dfSizeU / dfSizeV ) + 0.5);
+        nBucketsU = MAX(1, MIN(nBucketsU, nBuckets));
+        nBucketsV = MAX(1, nBuckets / nBucketsU);
     }
+    dfBucketU = (dfSizeU > 0.0) ? dfSizeU / nBucketsU : 1.0;
+    dfBucketV = (dfSizeV > 0.0) ? dfSizeV / nBucketsV : 1.0;
 
 /* -------------------------------------------------------------------- */
-/*      Get the subfile count out ... all we really use for now.        */
+/*      Collect the candidates of every bucket in search order.         */
 /* -------------------------------------------------------------------- */
-    memcpy( &num_subfiles, header+8+32, 4 );
+    std::vector< std::vector<CT3DGridCandidate> > aoBuckets( nBucketsU * nBucketsV );
+
+    for( itable = 0; itable < nTables; itable++ )
+    {
+        int nU0, nV0, nU1, nV1;
+
+        GetBucketRange( papoTables[itable]->ct, &nU0, &nV0, &nU1, &nV1 );
+        for( iv = nV0; iv <= nV1; iv++ )
+        {
+            for( iu = nU0; iu <= nU1; iu++ )
+            {
+                std::vector<CT3DGridCandidate> &oBucket = aoBuckets[iv * nBucketsU + iu];
+                int nFirst = (int) oBucket.size();
+
+                for( child = papoTables[itable]->child; child != NULL; child = child->next )
+                {
+                    int nCU0, nCV0, nCU1, nCV1;
+
+                    GetBucketRange( child->ct, &nCU0, &nCV0, &nCU1, &nCV1 );
+                    if( iu < nCU0 || iu > nCU1 || iv < nCV0 || iv > nCV1 )
+                        continue;
+
+                    CT3DGridCandidate sCandidate;
+                    sCandidate.gi = child;
+                    sCandidate.nTableOffset = 0;
+                    oBucket.push_back( sCandidate );
+                }
+
+                CT3DGridCandidate sTable;
+                sTable.gi = papoTables[itable];
+                sTable.nTableOffset = 0;
+                oBucket.push_back( sTable );
+
+                for( int i = nFirst; i < (int) oBucket.size(); i++ )
+                    oBucket[i].nTableOffset = (int) oBucket.size() - 1 - i;
+            }
+        }
+    }
+
+    int nCandidates = 0;
+    panBucketStart = (int *) CPLMalloc( sizeof(int) * (aoBuckets.size() + 1) );
+    for( size_t i = 0; i < aoBuckets.size(); i++ )
+    {
+        panBucketStart[i] = nCandidates;
+        nCandidates += (int) aoBuckets[i].size();
+    }
+    panBucketStart[aoBuckets.size()] = nCandidates;
+
+    pasCandidates = (CT3DGridCandidate *) 
+        CPLMalloc( sizeof(CT3DGridCandidate) * MAX(1, nCandidates) );
+    for( size_t i = 0; i < aoBuckets.size(); i++ )
+    {
+        if( !aoBuckets[i].empty() )
+            memcpy( pasCandidates + panBucketStart[i], &aoBuckets[i][0],
+                    sizeof(CT3DGridCandidate) * aoBuckets[i].size() );
+    }
+}
+
+CT3DGridIndex::~CT3DGridIndex()
+
+{
+    CPLFree( papoTables );
+    CPLFree( panBucketStart );
+    CPLFree( pasCandidates );
+}
+
+void CT3DGridIndex::GetBucketRange( struct CTABLE *ct, int *pnU0, int *pnV0, 
+                                    int *pnU1, int *pnV1 )
+/*
+ * computed from the same bounds as the containment test, bucket numbers 
+ * grow monotonically with the coordinate so every point inside a grid
+ * falls into one of its buckets
+ */
+{
+    double dfMinU1, dfMinV1, dfMaxU1, dfMaxV1;
+
+    ct3D_grid_bounds( ct, &dfMinU1, &dfMinV1, &dfMaxU1, &dfMaxV1 );
+
+    *pnU0 = MAX(0, MIN(nBucketsU - 1, (int) floor((dfMinU1 - dfMinU) / dfBucketU)));
+    *pnV0 = MAX(0, MIN(nBucketsV - 1, (int) floor((dfMinV1 - dfMinV) / dfBucketV)));
+    *pnU1 = MAX(0, MIN(nBucketsU - 1, (int) floor((dfMaxU1 - dfMinU) / dfBucketU)));
+    *pnV1 = MAX(0, MIN(nBucketsV - 1, (int) floor((dfMaxV1 - dfMinV) / dfBucketV)));
+}
+
+void CT3DGridIndex::GetCandidates( LP input, int *pnFirst, int *pnEnd )
+
+{
+    /* also catches HUGE_VAL and NaN input */
+    if( !(input.u >= dfMinU && input.u <= dfMaxU 
+          && input.v >= dfMinV && input.v <= dfMaxV) )
+    {
+        *pnFirst = *pnEnd = 0;
+        return;
+    }
+
+    int iu = MIN(nBucketsU - 1, (int) floor((input.u - dfMinU) / dfBucketU));
+    int iv = MIN(nBucketsV - 1, (int) floor((input.v - dfMinV) / dfBucketV));
+    int iBucket = iv * nBucketsU + iu;
+
+    *pnFirst = panBucketStart[iBucket];
+    *pnEnd = panBucketStart[iBucket + 1];
+}
+
+static void ct3D_gridindex_free( CT3DGridIndex *poIndex )
+
+{
+    delete poIndex;
+}
+
+/* number of tables one gridshift call keeps pinned at most */
+#define CT3D_MAX_PINNED 16
+
+static void ct3D_gridinfo_unpin_all( GridMemoryEntry **papoPinned, int *pnPinned )
+
+{
+    for( int i = 0; i < *pnPinned; i++ )
+        GridMemoryManager::Unpin( papoPinned[i] );
+    *pnPinned = 0;
+
+    GridMemoryManager::Enforce();
+}
+
+/************************************************************************/
+/*                        ct3D_gridlist_next()                          */
+/*                                                                      */
+/*      Find the grid to try next for a point, i.e. the next table of   */
+/*      the candidates from *piCandidate on holding the point, or its   */
+/*      first child holding it. NULL once all tables were tried.        */
+/************************************************************************/
+
+static PJ_GRIDINFO *ct3D_gridlist_next( CT3DGridIndex *poIndex, LP input,
+                                        int *piCandidate, int iEnd )
+
+{
+    /* 
+     * The buckets list the tables in order, each after those of its 
+     * children that touch the bucket, and tables not listed cannot hold 
+     * the point.
+     */
+    while( *piCandidate < iEnd )
+    {
+        const CT3DGridCandidate *psCandidate = poIndex->GetCandidate( *piCandidate );
+        int iTableCandidate = *piCandidate + psCandidate->nTableOffset;
+        PJ_GRIDINFO *gi = poIndex->GetCandidate( iTableCandidate )->gi;
+
+        /* the next candidate is the first one of the next table */
+        *piCandidate = iTableCandidate + 1;
+
+        /* skip tables that don't match our point at all.  */
+        if( !ct3D_grid_contains( gi->ct, input ) )
+            continue;
+
+        /* check to see if a more refined child node applies. */
+        for( ; psCandidate->nTableOffset > 0; psCandidate++ )
+        {
+            if( ct3D_grid_contains( psCandidate->gi->ct, input ) )
+                return psCandidate->gi;
+        }
+
+        return gi;
+    }
+
+    return NULL;
+}
+
+/************************************************************************/
+/*                        ct3D_gridinfo_use()                           */
+/*                                                                      */
+/*      Keep the table resident while a gridshift call uses it, loading */
+/*      it if needed. Returns FALSE if the table could not be loaded.   */
+/************************************************************************/
+
+static int ct3D_gridinfo_use( projCtx ctx, PJ_GRIDINFO *gi,
+                              GridMemoryEntry **papoPinned, int *pnPinned )
+
+{
+    GridMemoryEntry *psMemory = ct3D_gridinfo_memory( gi );
+
+    if( std::find( papoPinned, papoPinned + *pnPinned, psMemory ) 
+        != papoPinned + *pnPinned )
+        return TRUE;
+
+    /* tables are pinned before their data is checked, so
+       dropping older pins never affects the current one */
+    if( *pnPinned == CT3D_MAX_PINNED )
+        ct3D_gridinfo_unpin_all( papoPinned, pnPinned );
+
+    int bResident = GridMemoryManager::Pin( psMemory );
+    papoPinned[(*pnPinned)++] = psMemory;
+
+    /* load the grid shift info if we don't have it. */
+    return bResident || ct3D_gridinfo_ensure_loaded( ctx, gi, psMemory );
+}
+
+/************************************************************************/
+/*                        pj_apply_gridshift_3()                        */
+/*                                                                      */
+/*      This is the real workhorse, given a gridlist.                   */
+/************************************************************************/
+
+int ct3D_pj_apply_gridshift_3( projCtx ctx, PJ_GRIDINFO **tables, int grid_count,
+                          CT3DGridIndex *poIndex,
+                          int inverse, long point_count, int point_offset,
+                          double *x, double *y, double *z, 
+                          GridShiftStats *psStats = NULL )
+
+{
+    int  i;
+    static volatile int debug_count = 0;
+    GridMemoryEntry *apoPinned[CT3D_MAX_PINNED];
+    int nPinned = 0;
+    PJ_GRIDINFO *last_gi = NULL;
+
+    if( tables == NULL || grid_count == 0 )
+    {
+        pj_ctx_set_errno( ctx, -38);
+        return -38;
+    }
+
+    ctx->last_errno = 0;
+
+    for( i = 0; i < point_count; i += CT3D_NAD_BATCH )
+    {
+        int  nBlock = (int) MIN(CT3D_NAD_BATCH, point_count - i);
+        LP   asInput[CT3D_NAD_BATCH], asOutput[CT3D_NAD_BATCH];
+        PJ_GRIDINFO *apoGrid[CT3D_NAD_BATCH];
+        int  anCandidate[CT3D_NAD_BATCH], anEnd[CT3D_NAD_BATCH];
+        int  j, nRun;
+
+        /* find the first grid to try for every point of the block */
+        for( j = 0; j < nBlock; j++ )
+        {
+            long io = (i + j) * point_offset;
+
+            asInput[j].v = y[io];
+            asInput[j].u = x[io];
+            poIndex->GetCandidates( asInput[j], anCandidate + j, anEnd + j );
+            apoGrid[j] = ct3D_gridlist_next( poIndex, asInput[j], 
+                                             anCandidate + j, anEnd[j] );
+        }
+
+        /* shift runs of points using the same grid together */
+        for( j = 0; j < nBlock; j += nRun )
+        {
+            PJ_GRIDINFO *gi = apoGrid[j];
+
+            for( nRun = 1; j + nRun < nBlock && apoGrid[j + nRun] == gi; nRun++ ) {}
+
+            if( gi == NULL )
+            {
+                for( int k = j; k < j + nRun; k++ )
+                    asOutput[k].u = asOutput[k].v = HUGE_VAL;
+                continue;
+            }
+
+            if( gi != last_gi )
+            {
+                if( !ct3D_gridinfo_use( ctx, gi, apoPinned, &nPinned ) )
+                {
+                    ct3D_gridinfo_unpin_all( apoPinned, &nPinned );
+                    pj_ctx_set_errno( ctx, -38 );
+                    return -38;
+                }
+                last_gi = gi;
+            }
+
+            ct3D_nad_cvt_batch( nRun, asInput + j, asOutput + j, inverse, gi->ct, psStats );
+        }
+
+        for( j = 0; j < nBlock; j++ )
+        {
+            long io = (i + j) * point_offset;
+            LP   output = asOutput[j];
+            int  itable;
+
+            /* keep trying till we find a table that works */
+            while( output.u == HUGE_VAL && apoGrid[j] != NULL )
+            {
+                PJ_GRIDINFO *gi = ct3D_gridlist_next( poIndex, asInput[j], 
+                                                      anCandidate + j, anEnd[j] );
+
+                apoGrid[j] = gi;
+                if( gi == NULL )
+                    break;
+
+                if( gi != last_gi )
+                {
+                    if( !ct3D_gridinfo_use( ctx, gi, apoPinned, &nPinned ) )
+                    {
+                        ct3D_gridinfo_unpin_all( apoPinned, &nPinned );
+                        pj_ctx_set_errno( ctx, -38 );
+                        return -38;
+                    }
+                    last_gi = gi;
+                }
+
+                output = ct3D_nad_cvt( asInput[j], inverse, gi->ct, psStats );
+            }
+
+            /* the shared counter is only touched while messages are logged */
+            if( output.u != HUGE_VAL && ctx->debug_level >= PJ_LOG_DEBUG_MINOR
+                && debug_count < 20 && CPLAtomicInc( &debug_count ) <= 20 )
+                pj_log( ctx, PJ_LOG_DEBUG_MINOR,
+                        "ct3D_pj_apply_gridshift(): used %s", apoGrid[j]->ct->id );
+
+            if( output.u == HUGE_VAL )
+            {
+                if( ctx->debug_level >= PJ_LOG_DEBUG_MAJOR )
+                {
+                    pj_log( ctx, PJ_LOG_DEBUG_MAJOR,
+                        "pj_apply_gridshift(): failed to find a grid shift table for\n"
+                        "                      location (%.7fdW,%.7fdN)",
+                        x[io] * RAD_TO_DEG, 
+                        y[io] * RAD_TO_DEG );
+                    for( itable = 0; itable < grid_count; itable++ )
+                    {
+                        PJ_GRIDINFO *gi = tables[itable];
+                        if( itable == 0 )
+                            pj_log( ctx, PJ_LOG_DEBUG_MAJOR,
+                                    "   tried: %s", gi->gridname );
+                        else
+                            pj_log( ctx, PJ_LOG_DEBUG_MAJOR,
+                                    ",%s", gi->gridname );
+                    }
+                }
+
+                /* 
+                 * We don't actually have any machinery currently to set the 
+                 * following macro, so this is mostly kept here to make it clear 
+                 * how we ought to operate if we wanted to make it super clear 
+                 * that an error has occured when points are outside our available
+                 * datum shift areas.  But if this is on, we will find that "low 
+                 * value" points on the fringes of some datasets will completely 
+                 * fail causing lots of problems when it is more or less ok to 
+                 * just not apply a datum shift.  So rather than deal with
+                 * that we just fallback to no shift. (see also bug #45).
+                 */
+#ifdef ERR_GRID_AREA_TRANSIENT_SEVERE
+                y[io] = HUGE_VAL;
+                x[io] = HUGE_VAL;
+#else
+                /* leave x/y unshifted. */
+#endif
+            }
+            else
+            {
+                y[io] = output.v;
+                x[io] = output.u;
+            }
+        }
+    }
+
+    ct3D_gridinfo_unpin_all( apoPinned, &nPinned );
+
+    return 0;
+}
+
+/************************************************************************/
+/*                       pj_gridinfo_init_ntv1()                        */
+/*                                                                      */
+/*      Load an NTv1 style Canadian grid shift file.                    */
+/************************************************************************/
+
+static int ct3D_pj_gridinfo_init_ntv1( projCtx ctx, FILE * fid, PJ_GRIDINFO *gi )
+
+{
+    unsigned char header[176];
+    struct CTABLE *ct;
+    LP		ur;
+    
+    assert( sizeof(int) == 4 );
+    assert( sizeof(double) == 8 );
+    if( sizeof(int) != 4 || sizeof(double) != 8 )
+    {
+        pj_log( ctx, PJ_LOG_ERROR,
+                 "basic types of inappropraiate size in nad_load_ntv1()" );
+        pj_ctx_set_errno( ctx, -38 );
+        return 0;
+    }
+
+/* -------------------------------------------------------------------- */
+/*      Read the header.                                                */
+/* -------------------------------------------------------------------- */
+    if( fread( header, sizeof(header), 1, fid ) != 1 )
+    {
+        pj_ctx_set_errno( ctx, -38 );
+        return 0;
+    }
+
+/* -------------------------------------------------------------------- */
+/*      Regularize fields of interest.                                  */
+/* -------------------------------------------------------------------- */
+    if( IS_LSB )
+    {
+        ct3D_swap_words( header+8, 4, 1 );
+        ct3D_swap_words( header+24, 8, 1 );
+        ct3D_swap_words( header+40, 8, 1 );
+        ct3D_swap_words( header+56, 8, 1 );
+        ct3D_swap_words( header+72, 8, 1 );
+        ct3D_swap_words( header+88, 8, 1 );
+        ct3D_swap_words( header+104, 8, 1 );
+    }
+
+    if( *((int *) (header+8)) != 12 )
+    {
+        pj_log( ctx, PJ_LOG_ERROR, 
+                "NTv1 grid shift file has wrong record count, corrupt?" );
+        pj_ctx_set_errno( ctx, -38 );
+        return 0;
+    }
+
+/* -------------------------------------------------------------------- */
+/*      Fill in CTABLE structure.                                       */
+/* -------------------------------------------------------------------- */
+    ct = (struct CTABLE *) pj_malloc(sizeof(struct CTABLE));
+    strcpy( ct->id, "NTv1 Grid Shift File" );
+
+    ct->ll.u = - *((double *) (header+72));
+    ct->ll.v = *((double *) (header+24));
+    ur.u = - *((double *) (header+56));
+    ur.v = *((double *) (header+40));
+    ct->del.u = *((double *) (header+104));
+    ct->del.v = *((double *) (header+88));
+    ct->lim.lam = (int) (fabs(ur.u-ct->ll.u)/ct->del.u + 0.5) + 1;
+    ct->lim.phi = (int) (fabs(ur.v-ct->ll.v)/ct->del.v + 0.5) + 1;
+
+    pj_log( ctx, PJ_LOG_DEBUG_MINOR,
+            "NTv1 %dx%d: LL=(%.9g,%.9g) UR=(%.9g,%.9g)",
+            ct->lim.lam, ct->lim.phi,
+            ct->ll.u, ct->ll.v, ur.u, ur.v );
+
+    ct->ll.u *= DEG_TO_RAD;
+    ct->ll.v *= DEG_TO_RAD;
+    ct->del.u *= DEG_TO_RAD;
+    ct->del.v *= DEG_TO_RAD;
+    ct->cvs = NULL;
+
+    gi->ct = ct;
+    gi->grid_offset = ftell( fid );
+    gi->format = "ntv1";
+
+    return 1;
+}
+
+/************************************************************************/
+/*                       pj_gridinfo_init_ntv2()                        */
+/*                                                                      */
+/*      Load a ntv2 (.gsb) file.                                        */
+/************************************************************************/
+
+static int ct3D_pj_gridinfo_init_ntv2( projCtx ctx, FILE *fid, PJ_GRIDINFO *gilist )
+
+{
+    unsigned char header[11*16];
+    int num_subfiles, subfile;
+
+    assert( sizeof(int) == 4 );
+    assert( sizeof(double) == 8 );
+    if( sizeof(int) != 4 || sizeof(double) != 8 )
+    {
+        pj_log( ctx, PJ_LOG_ERROR,
+             "basic types of inappropraiate size in pj_gridinfo_init_ntv2()" );
+        pj_ctx_set_errno( ctx, -38 );
+        return 0;
+    }
+
+/* -------------------------------------------------------------------- */
+/*      Read the overview header.                                       */
+/* -------------------------------------------------------------------- */
+    if( fread( header, sizeof(header), 1, fid ) != 1 )
+    {
+        pj_ctx_set_errno( ctx, -38 );
+        return 0;
+    }
+
+/* -------------------------------------------------------------------- */
+/*      Byte swap interesting fields if needed.                         */
+/* -------------------------------------------------------------------- */
+    if( !IS_LSB )
+    {
+        ct3D_swap_words( header+8, 4, 1 );
+        ct3D_swap_words( header+8+16, 4, 1 );
+        ct3D_swap_words( header+8+32, 4, 1 );
+        ct3D_swap_words( header+8+7*16, 8, 1 );
+        ct3D_swap_words( header+8+8*16, 8, 1 );
+        ct3D_swap_words( header+8+9*16, 8, 1 );
+        ct3D_swap_words( header+8+10*16, 8, 1 );
+    }
+
+/* -------------------------------------------------------------------- */
+/*      Get the subfile count out ... all we really use for now.        */
+/* -------------------------------------------------------------------- */
+    memcpy( &num_subfiles, header+8+32, 4 );
 
 /* ==================================================================== */
 /*      Step through the subfiles, creating a PJ_GRIDINFO for each.     */
@@ -2174,6 +4005,10 @@ PJ_GRIDINFO *ct3D_pj_gridinfo_init( projCtx ctx, const char *gridname )
 
 static PJ_GRIDINFO *grid_list = NULL;
 
+/* number of grids in grid_list visible to lookups without the lock, it is
+   raised (a full barrier) after the grids and their links are written */
+static volatile int grid_list_count = 0;
+
 /************************************************************************/
 /*                       pj_gridlist_merge_grid()                       */
 /*                                                                      */
@@ -2189,14 +4024,19 @@ static int ct3D_pj_gridlist_merge_gridfile( projCtx ctx,
 
 {
     int got_match=0;
+    int i, published_count;
     PJ_GRIDINFO *this_grid, *tail = NULL;
 
 /* -------------------------------------------------------------------- */
 /*      Try to find in the existing list of loaded grids.  Add all      */
 /*      matching grids as with NTv2 we can get many grids from one      */
 /*      file (one shared gridname).                                     */
+/*      Only the published part of the list is read, without locking.   */
 /* -------------------------------------------------------------------- */
-    for( this_grid = grid_list; this_grid != NULL; this_grid = this_grid->next)
+    published_count = CPLAtomicAdd( &grid_list_count, 0 );
+
+    for( i = 0, this_grid = grid_list; i < published_count; 
+         i++, this_grid = this_grid->next )
     {
         if( strcmp(this_grid->gridname,gridname) == 0 )
         {
@@ -2228,29 +4068,50 @@ static int ct3D_pj_gridlist_merge_gridfile( projCtx ctx,
             (*p_gridlist)[(*p_gridcount)++] = this_grid;
             (*p_gridlist)[*p_gridcount] = NULL;
         }
-
-        tail = this_grid;
     }
 
     if( got_match )
         return 1;
 
 /* -------------------------------------------------------------------- */
-/*      Try to load the named grid.                                     */
+/*      Try to load the named grid, unless another thread added it      */
+/*      after the lookup above.                                         */
 /* -------------------------------------------------------------------- */
-    this_grid = ct3D_pj_gridinfo_init( ctx, gridname );
+    ct3D_pj_acquire_lock();
+
+    for( this_grid = grid_list; this_grid != NULL; this_grid = this_grid->next)
+    {
+        if( strcmp(this_grid->gridname,gridname) == 0 )
+            got_match = 1;
+
+        tail = this_grid;
+    }
 
-    if( this_grid == NULL )
+    if( !got_match )
     {
-        /* we should get at least a stub grid with a missing "ct" member */
-        assert( FALSE );
-        return 0;
-    }
+        this_grid = ct3D_pj_gridinfo_init( ctx, gridname );
+
+        if( this_grid == NULL )
+        {
+            /* we should get at least a stub grid with a missing "ct" member */
+            assert( FALSE );
+            ct3D_pj_release_lock();
+            return 0;
+        }
     
-    if( tail != NULL )
-        tail->next = this_grid;
-    else
-        grid_list = this_grid;
+        if( tail != NULL )
+            tail->next = this_grid;
+        else
+            grid_list = this_grid;
+
+        /* NTv2 files can add several grids at once */
+        int added_count = 0;
+        for( ; this_grid != NULL; this_grid = this_grid->next )
+            added_count++;
+        CPLAtomicAdd( &grid_list_count, added_count );
+    }
+
+    ct3D_pj_release_lock();
 
 /* -------------------------------------------------------------------- */
 /*      Recurse to add the grid now that it is loaded.                  */
@@ -2277,11 +4138,9 @@ PJ_GRIDINFO **ct3D_pj_gridlist_from_nadgrids( projCtx ctx, const char *nadgrids,
     PJ_GRIDINFO **gridlist = NULL;
     int grid_max = 0;
 
-    pj_errno = 0;
+    ctx->last_errno = 0;
     *grid_count = 0;
 
-    ct3D_pj_acquire_lock();
-
 /* -------------------------------------------------------------------- */
 /*      Loop processing names out of nadgrids one at a time.            */
 /* -------------------------------------------------------------------- */
@@ -2304,7 +4163,6 @@ PJ_GRIDINFO **ct3D_pj_gridlist_from_nadgrids( projCtx ctx, const char *nadgrids,
         if( end_char >= sizeof(name) )
         {
             pj_ctx_set_errno( ctx, -38 );
-            ct3D_pj_release_lock();
             return NULL;
         }
         
@@ -2320,15 +4178,12 @@ PJ_GRIDINFO **ct3D_pj_gridlist_from_nadgrids( projCtx ctx, const char *nadgrids,
             && required )
         {
             pj_ctx_set_errno( ctx, -38 );
-            ct3D_pj_release_lock();
             return NULL;
         }
         else
-            pj_errno = 0;
+            ctx->last_errno = 0;
     }
 
-    ct3D_pj_release_lock();
-
     return gridlist;
 }
 
@@ -2339,12 +4194,13 @@ PJ_GRIDINFO **ct3D_pj_gridlist_from_nadgrids( projCtx ctx, const char *nadgrids,
 /*      This implmentation takes uses the gridlist from a coordinate    */
 /*      system definition.  If the gridlist has not yet been            */
 /*      populated in the coordinate system definition we set it up      */
-/*      now.                                                            */
+/*      now, along with its index kept in *ppoIndex.                    */
 /************************************************************************/
 
-int ct3D_pj_apply_gridshift_2( PJ *defn, int inverse, 
+int ct3D_pj_apply_gridshift_2( PJ *defn, CT3DGridIndex **ppoIndex, int inverse, 
                           long point_count, int point_offset,
-                          double *x, double *y, double *z )
+                          double *x, double *y, double *z,
+                          GridShiftStats *psStats = NULL )
 
 {
     if( defn->gridlist == NULL )
@@ -2357,188 +4213,93 @@ int ct3D_pj_apply_gridshift_2( PJ *defn, int inverse,
         if( defn->gridlist == NULL || defn->gridlist_count == 0 )
             return defn->ctx->last_errno;
     }
+
+    if( *ppoIndex == NULL )
+        *ppoIndex = new CT3DGridIndex( defn->gridlist, defn->gridlist_count );
      
     return ct3D_pj_apply_gridshift_3( pj_get_ctx( defn ),
-                                 defn->gridlist, defn->gridlist_count, inverse, 
-                                 point_count, point_offset, x, y, z );
+                                 defn->gridlist, defn->gridlist_count, *ppoIndex, inverse, 
+                                 point_count, point_offset, x, y, z, psStats );
 }
 
-int OGRProj4CT3D::ct3D_pj_datum_transform( PJ *srcdefn, PJ *dstdefn, 
-                        long point_count, int point_offset,
-                        double *x, double *y, double *z )
-{
-    double      src_a, src_es, dst_a, dst_es;
-    int         z_is_temp = FALSE;
-
-/* -------------------------------------------------------------------- */
-/*      We cannot do any meaningful datum transformation if either      */
-/*      the source or destination are of an unknown datum type          */
-/*      (ie. only a +ellps declaration, no +datum).  This is new        */
-/*      behavior for PROJ 4.6.0.                                        */
-/* -------------------------------------------------------------------- */
-    if( srcdefn->datum_type == PJD_UNKNOWN
-        || dstdefn->datum_type == PJD_UNKNOWN )
-        return 0;
-
-/* -------------------------------------------------------------------- */
-/*      Short cut if the datums are identical.                          */
-/* -------------------------------------------------------------------- */
-    if( pj_compare_datums( srcdefn, dstdefn ) )
-        return 0;
-
-    src_a = srcdefn->a_orig;
-    src_es = srcdefn->es_orig;
-
-    dst_a = dstdefn->a_orig;
-    dst_es = dstdefn->es_orig;
-
-/* -------------------------------------------------------------------- */
-/*      Create a temporary Z array if one is not provided.              */
-/* -------------------------------------------------------------------- */
-    if( z == NULL )
-    {
-        int	bytes = sizeof(double) * point_count * point_offset;
-        z = (double *) pj_malloc(bytes);
-        memset( z, 0, bytes );
-        z_is_temp = TRUE;
-    }
-
-#define CHECK_RETURN(defn) {if( defn->ctx->last_errno != 0 && (defn->ctx->last_errno > 0 || transient_error[-defn->ctx->last_errno] == 0) ) { if( z_is_temp ) pj_dalloc(z); return defn->ctx->last_errno; }}
-
-/* -------------------------------------------------------------------- */
-/*	If this datum requires grid shifts, then apply it to geodetic   */
-/*      coordinates.                                                    */
-/* -------------------------------------------------------------------- */
-    if( srcdefn->datum_type == PJD_GRIDSHIFT )
-    {
-				//PEB:gsoc2014 remove gridshift in datum transform
-        //ct3D_pj_apply_gridshift_2( srcdefn, 0, point_count, point_offset, x, y, z );
-        CHECK_RETURN(srcdefn);
-
-        src_a = SRS_WGS84_SEMIMAJOR;
-        src_es = SRS_WGS84_ESQUARED;
-    }
-
-    if( dstdefn->datum_type == PJD_GRIDSHIFT )
-    {
-        dst_a = SRS_WGS84_SEMIMAJOR;
-        dst_es = SRS_WGS84_ESQUARED;
-    }
-
-/* ==================================================================== */
-/*      Do we need to go through geocentric coordinates?                */
-/* ==================================================================== */
-    if( src_es != dst_es || src_a != dst_a
-        || srcdefn->datum_type == PJD_3PARAM 
-        || srcdefn->datum_type == PJD_7PARAM
-        || dstdefn->datum_type == PJD_3PARAM 
-        || dstdefn->datum_type == PJD_7PARAM)
-    {
-/* -------------------------------------------------------------------- */
-/*      Convert to geocentric coordinates.                              */
-/* -------------------------------------------------------------------- */
-        srcdefn->ctx->last_errno = 
-            pj_geodetic_to_geocentric( src_a, src_es,
-                                       point_count, point_offset, x, y, z );
-        CHECK_RETURN(srcdefn);
-
-/* -------------------------------------------------------------------- */
-/*      Convert between datums.                                         */
-/* -------------------------------------------------------------------- */
-        if( srcdefn->datum_type == PJD_3PARAM 
-            || srcdefn->datum_type == PJD_7PARAM )
-        {
-            pj_geocentric_to_wgs84( srcdefn, point_count, point_offset,x,y,z);
-            CHECK_RETURN(srcdefn);
-        }
+/************************************************************************/
+/*                          ct3D_pj_is_fatal()                          */
+/*                                                                      */
+/*      Whether the last error of a definition stops the batch, as      */
+/*      opposed to the transient errors that only fail some points.     */
+/************************************************************************/
 
-        if( dstdefn->datum_type == PJD_3PARAM 
-            || dstdefn->datum_type == PJD_7PARAM )
-        {
-            pj_geocentric_from_wgs84( dstdefn, point_count,point_offset,x,y,z);
-            CHECK_RETURN(dstdefn);
-        }
+static int ct3D_pj_is_fatal( PJ *defn )
 
-/* -------------------------------------------------------------------- */
-/*      Convert back to geodetic coordinates.                           */
-/* -------------------------------------------------------------------- */
-        dstdefn->ctx->last_errno = 
-            pj_geocentric_to_geodetic( dst_a, dst_es,
-                                       point_count, point_offset, x, y, z );
-        CHECK_RETURN(dstdefn);
-    }
+{
+    int nErr = defn->ctx->last_errno;
 
-/* -------------------------------------------------------------------- */
-/*      Apply grid shift to destination if required.                    */
-/* -------------------------------------------------------------------- */
-    if( dstdefn->datum_type == PJD_GRIDSHIFT )
-    {
-				//PEB:gsoc2014 remove datum transform
-        //ct3D_pj_apply_gridshift_2( dstdefn, 1, point_count, point_offset, x, y, z );
-        //CHECK_RETURN(dstdefn);
-    }
+    return nErr != 0 && (nErr > 0 || transient_error[-nErr] == 0);
+}
 
-    if( z_is_temp )
-        pj_dalloc( z );
+/* error of the datum shift, as reported by pj_transform() */
+static int ct3D_pj_datum_errno( PJ *srcdefn, PJ *dstdefn )
 
-    return 0;
+{
+    if( srcdefn->ctx->last_errno != 0 )
+        return srcdefn->ctx->last_errno;
+    else
+        return dstdefn->ctx->last_errno;
 }
 
+/************************************************************************/
+/*                         ct3D_pj_transform()                          */
+/*                                                                      */
+/*      Runs the steps chosen by BuildPipeline() for srcdefn and        */
+/*      dstdefn, or for dstdefn and srcdefn when bInverse is set.       */
+/************************************************************************/
+
 int OGRProj4CT3D::ct3D_pj_transform(PJ *srcdefn, PJ *dstdefn, long point_count, int point_offset,
-                  double *x, double *y, double *z)
+                  double *x, double *y, double *z, CT3DWorkerState *psState,
+                  int bInverse )
 {
-    long      i;
-    int       err;
-
-	//double x1,y1;
-	
-	//x1=*x;
-	//y1=*y;
-	int         z_is_temp = FALSE;
+    const CT3DPipeline *psPipeline = &asPipelines[bInverse ? 1 : 0][z != NULL ? 1 : 0];
+    double     *zDatum = z;
+    long        i;
+    int         err;
 
     srcdefn->ctx->last_errno = 0;
     dstdefn->ctx->last_errno = 0;
 
-
     if( point_offset == 0 )
         point_offset = 1;
 
+    for( int iStage = 0; iStage < psPipeline->nStages; iStage++ )
+    {
+        switch( psPipeline->anStages[iStage] )
+        {
 /* -------------------------------------------------------------------- */
 /*      Transform unusual input coordinate axis orientation to          */
-/*      standard form if needed.                                        */
+/*      standard form.                                                  */
 /* -------------------------------------------------------------------- */
-    if( strcmp(srcdefn->axis,"enu") != 0 )
-    {
-        int err;
-
-        err = pj_adjust_axis( srcdefn->ctx, srcdefn->axis, 
-                              0, point_count, point_offset, x, y, z );
-        if( err != 0 )
-            return err;
-    }
+          case CT3D_STAGE_SRC_AXIS:
+            err = pj_adjust_axis( srcdefn->ctx, srcdefn->axis, 
+                                  0, point_count, point_offset, x, y, z );
+            if( err != 0 )
+                return err;
+            break;
 
 /* -------------------------------------------------------------------- */
-/*      Transform Z to meters if it isn't already.                      */
+/*      Transform Z to meters.                                          */
 /* -------------------------------------------------------------------- */
-    if( srcdefn->vto_meter != 1.0 && z != NULL )
-    {
-        for( i = 0; i < point_count; i++ )
-            z[point_offset*i] *= srcdefn->vto_meter;
-    }
+          case CT3D_STAGE_SRC_Z_TO_METER:
+            for( i = 0; i < point_count; i++ )
+                z[point_offset*i] *= srcdefn->vto_meter;
+            break;
 
 /* -------------------------------------------------------------------- */
 /*      Transform geocentric source coordinates to lat/long.            */
 /* -------------------------------------------------------------------- */
-    if( srcdefn->is_geocent )
-    {
-        if( z == NULL )
-        {
+          case CT3D_STAGE_SRC_GEOCENT_NO_Z:
             pj_ctx_set_errno( pj_get_ctx(srcdefn), PJD_ERR_GEOCENTRIC);
             return PJD_ERR_GEOCENTRIC;
-        }
 
-        if( srcdefn->to_meter != 1.0 )
-        {
+          case CT3D_STAGE_SRC_GEOCENT_TO_METER:
             for( i = 0; i < point_count; i++ )
             {
                 if( x[point_offset*i] != HUGE_VAL )
@@ -2547,170 +4308,209 @@ int OGRProj4CT3D::ct3D_pj_transform(PJ *srcdefn, PJ *dstdefn, long point_count,
                     y[point_offset*i] *= srcdefn->to_meter;
                 }
             }
-        }
+            break;
 
-        err = pj_geocentric_to_geodetic( srcdefn->a_orig, srcdefn->es_orig,
-                                         point_count, point_offset, 
-                                         x, y, z );
-        if( err != 0 )
-            return err;
-    }
+          case CT3D_STAGE_SRC_GEOCENT_TO_GEODETIC:
+            err = geocentricToGeodeticBatch( srcdefn->a_orig, srcdefn->es_orig,
+                                             point_count, point_offset, 
+                                             x, y, z, nGeocentricSIMD );
+            if( err != 0 )
+                return err;
+            break;
 
 /* -------------------------------------------------------------------- */
-/*      Transform source points to lat/long, if they aren't             */
-/*      already.                                                        */
+/*      Transform source points to lat/long, and adjust for the prime   */
+/*      meridian of the source in the same loop.                        */
 /* -------------------------------------------------------------------- */
-    else if( !srcdefn->is_latlong )
-    {
-        if( srcdefn->inv == NULL )
-        {
-            pj_ctx_set_errno( pj_get_ctx(srcdefn), -17 );
-            pj_log( pj_get_ctx(srcdefn), PJ_LOG_ERROR, 
-                    "pj_transform(): source projection not invertable" );
-            return -17;
-        }
+          case CT3D_STAGE_SRC_INV_PROJECT:
+            if( srcdefn->inv == NULL )
+            {
+                pj_ctx_set_errno( pj_get_ctx(srcdefn), -17 );
+                pj_log( pj_get_ctx(srcdefn), PJ_LOG_ERROR, 
+                        "pj_transform(): source projection not invertable" );
+                return -17;
+            }
 
-        for( i = 0; i < point_count; i++ )
-        {
-            XY         projected_loc;
-            LP	       geodetic_loc;
+            for( i = 0; i < point_count; i++ )
+            {
+                XY         projected_loc;
+                LP	       geodetic_loc;
 
-            projected_loc.u = x[point_offset*i];
-            projected_loc.v = y[point_offset*i];
+                projected_loc.u = x[point_offset*i];
+                projected_loc.v = y[point_offset*i];
 
-            if( projected_loc.u == HUGE_VAL )
-                continue;
+                if( projected_loc.u == HUGE_VAL )
+                    continue;
 
-            geodetic_loc = pj_inv( projected_loc, srcdefn );
-            if( srcdefn->ctx->last_errno != 0 )
-            {
-                if( (srcdefn->ctx->last_errno != 33 /*EDOM*/ 
-                     && srcdefn->ctx->last_errno != 34 /*ERANGE*/ )
-                    && (srcdefn->ctx->last_errno > 0 
-                        || srcdefn->ctx->last_errno < -44 || point_count == 1
-                        || transient_error[-srcdefn->ctx->last_errno] == 0 ) )
-                    return srcdefn->ctx->last_errno;
-                else
+                geodetic_loc = pj_inv( projected_loc, srcdefn );
+                if( srcdefn->ctx->last_errno != 0 )
                 {
-                    geodetic_loc.u = HUGE_VAL;
-                    geodetic_loc.v = HUGE_VAL;
+                    if( (srcdefn->ctx->last_errno != 33 /*EDOM*/ 
+                         && srcdefn->ctx->last_errno != 34 /*ERANGE*/ )
+                        && (srcdefn->ctx->last_errno > 0 
+                            || srcdefn->ctx->last_errno < -44 || point_count == 1
+                            || transient_error[-srcdefn->ctx->last_errno] == 0 ) )
+                        return srcdefn->ctx->last_errno;
+                    else
+                    {
+                        geodetic_loc.u = HUGE_VAL;
+                        geodetic_loc.v = HUGE_VAL;
+                    }
                 }
+
+                if( psPipeline->dfSrcGreenwich != 0.0 && geodetic_loc.u != HUGE_VAL )
+                    geodetic_loc.u += psPipeline->dfSrcGreenwich;
+
+                x[point_offset*i] = geodetic_loc.u;
+                y[point_offset*i] = geodetic_loc.v;
             }
+            break;
 
-            x[point_offset*i] = geodetic_loc.u;
-            y[point_offset*i] = geodetic_loc.v;
-        }
-    }
+/* -------------------------------------------------------------------- */
+/*      Adjust for the prime meridian of the source.                    */
+/* -------------------------------------------------------------------- */
+          case CT3D_STAGE_SRC_PRIME_MERIDIAN:
+            for( i = 0; i < point_count; i++ )
+            {
+                if( x[point_offset*i] != HUGE_VAL )
+                    x[point_offset*i] += srcdefn->from_greenwich;
+            }
+            break;
 
 /* -------------------------------------------------------------------- */
-/*      But if they are already lat long, adjust for the prime          */
-/*      meridian if there is one in effect.                             */
+/*      Horizontal grid shift of the source datum (PEB:gsoc2014).       */
 /* -------------------------------------------------------------------- */
-    if( srcdefn->from_greenwich != 0.0 )
-    {
-        for( i = 0; i < point_count; i++ )
-        {
-            if( x[point_offset*i] != HUGE_VAL )
-                x[point_offset*i] += srcdefn->from_greenwich;
-        }
-    }
+          case CT3D_STAGE_SRC_GRIDSHIFT:
+            ct3D_pj_apply_gridshift_2( srcdefn, psState->GetGridIndex( srcdefn ), 0, point_count, point_offset, x, y, z,
+                                       &psState->sGridShiftStats );
+            if( ct3D_pj_is_fatal( srcdefn ) )
+                return srcdefn->ctx->last_errno;
+            break;
 
 /* -------------------------------------------------------------------- */
-/*      Do we need to translate from geoid to ellipsoidal vertical      */
-/*      datum?                                                          */
+/*      Source heights to ellipsoidal heights with the GDAL raster      */
+/*      models (PEB:gsoc2013).                                          */
 /* -------------------------------------------------------------------- */
-	/*
-    if( srcdefn->has_geoid_vgrids )	
-    {
-        if( pj_apply_vgridshift( srcdefn, "sgeoidgrids", 
-                                 &(srcdefn->vgridlist_geoid), 
-                                 &(srcdefn->vgridlist_geoid_count),
-                                 0, point_count, point_offset, x, y, z ) != 0 )
-            return pj_ctx_get_errno(srcdefn->ctx);
-    }
-	*/
-		
-	//PEB:gsoc2014 - do gridshift on horizontal coordinates
-	//TODO: the checking is not correct, deduce info from WKT
-	if( srcdefn->datum_type == PJD_GRIDSHIFT )
-  {
-      ct3D_pj_apply_gridshift_2( srcdefn, 0, point_count, point_offset, x, y, z );
-      CHECK_RETURN(srcdefn);
-  }
-
-	//PEB:gsoc2013 - use GDAL raster for vertical shift
-	if(z!=NULL && poSRSSource->HasVerticalModel())
-	{
-		poSRSSource->ApplyVerticalCorrection(0, point_count, x, y, z);
-	}
+          case CT3D_STAGE_SRC_VERTICAL:
+            if( poSRSSource->ApplyVerticalCorrection(0, point_count, x, y, z, &psState->oVerticalScratch, 
+                                                     point_offset) != OGRERR_NONE )
+                return CT3D_ERR_VERTICAL_MODEL;
+            break;
 
 /* -------------------------------------------------------------------- */
-/*      Convert datums if needed, and possible.                         */
+/*      Datum shift through geocentric coordinates, with zero heights   */
+/*      if the points have none.                                        */
 /* -------------------------------------------------------------------- */
-    if( ct3D_pj_datum_transform( srcdefn, dstdefn, point_count, point_offset, 
-                            x, y, z ) != 0 )
-    {
-        if( srcdefn->ctx->last_errno != 0 )
-            return srcdefn->ctx->last_errno;
-        else
-            return dstdefn->ctx->last_errno;
-    }
+          case CT3D_STAGE_DATUM_SCRATCH_Z:
+            psState->ReserveScratch( point_count * point_offset );
+            zDatum = psState->padfScratchZ;
+            memset( zDatum, 0, sizeof(double) * point_count * point_offset );
+            break;
+
+          case CT3D_STAGE_DATUM_TO_GEOCENTRIC:
+            srcdefn->ctx->last_errno = 
+                geodeticToGeocentricBatch( psPipeline->dfSrcA, psPipeline->dfSrcEs,
+                                           point_count, point_offset, x, y, zDatum,
+                                           nGeocentricSIMD );
+            if( ct3D_pj_is_fatal( srcdefn ) )
+                return ct3D_pj_datum_errno( srcdefn, dstdefn );
+            break;
+
+          case CT3D_STAGE_DATUM_TO_WGS84:
+            pj_geocentric_to_wgs84( srcdefn, point_count, point_offset, x, y, zDatum );
+            if( ct3D_pj_is_fatal( srcdefn ) )
+                return ct3D_pj_datum_errno( srcdefn, dstdefn );
+            break;
+
+          case CT3D_STAGE_DATUM_FROM_WGS84:
+            pj_geocentric_from_wgs84( dstdefn, point_count, point_offset, x, y, zDatum );
+            if( ct3D_pj_is_fatal( dstdefn ) )
+                return ct3D_pj_datum_errno( srcdefn, dstdefn );
+            break;
+
+          case CT3D_STAGE_DATUM_HELMERT:
+          {
+            const double *M = psPipeline->adfHelmert;
+
+            for( i = 0; i < point_count; i++ )
+            {
+                long io = i * point_offset;
+                double dfX = x[io], dfY = y[io], dfZ = zDatum[io];
+
+                if( dfX == HUGE_VAL )
+                    continue;
+
+                x[io] = M[0]*dfX + M[1]*dfY + M[2]*dfZ + M[9];
+                y[io] = M[3]*dfX + M[4]*dfY + M[5]*dfZ + M[10];
+                zDatum[io] = M[6]*dfX + M[7]*dfY + M[8]*dfZ + M[11];
+            }
+            break;
+          }
+
+          case CT3D_STAGE_DATUM_TO_GEODETIC:
+            dstdefn->ctx->last_errno = 
+                geocentricToGeodeticBatch( psPipeline->dfDstA, psPipeline->dfDstEs,
+                                           point_count, point_offset, x, y, zDatum,
+                                           nGeocentricSIMD );
+            if( ct3D_pj_is_fatal( dstdefn ) )
+                return ct3D_pj_datum_errno( srcdefn, dstdefn );
+            break;
+
 /* -------------------------------------------------------------------- */
-/*      Do we need to translate from geoid to ellipsoidal vertical      */
-/*      datum?                                                          */
+/*      Source heights to target heights where the horizontal           */
+/*      coordinates of both are the same.                               */
 /* -------------------------------------------------------------------- */
-	//PEB:gsoc2013
-	if(z != NULL && poSRSTarget->HasVerticalModel())
-	{
-		//x y z coordinates are in radian
-		poSRSTarget->ApplyVerticalCorrection(1, point_count, x, y, z);
-	}
-	//PEB:gsoc2014
-	//TODO: the checking may not be correct
-	if( dstdefn->datum_type == PJD_GRIDSHIFT )
-  {
-      ct3D_pj_apply_gridshift_2( dstdefn, 1, point_count, point_offset, x, y, z );
-      CHECK_RETURN(dstdefn);
-  }
-	/*
-    if( dstdefn->has_geoid_vgrids )
-    {
-        if( pj_apply_vgridshift( dstdefn, "sgeoidgrids", 
-                                 &(dstdefn->vgridlist_geoid), 
-                                 &(dstdefn->vgridlist_geoid_count),
-                                 1, point_count, point_offset, x, y, z ) != 0 )
-            return dstdefn->ctx->last_errno;
-    }
-      */  
+          case CT3D_STAGE_VERTICAL_DIFFERENCE:
+            if( poSRSSource->ApplyVerticalDifference(poSRSTarget, point_count, x, y, z, &psState->oVerticalScratch, 
+                                                     point_offset) != OGRERR_NONE )
+                return CT3D_ERR_VERTICAL_MODEL;
+            break;
+
 /* -------------------------------------------------------------------- */
-/*      But if they are staying lat long, adjust for the prime          */
-/*      meridian if there is one in effect.                             */
+/*      Ellipsoidal heights to target heights (PEB:gsoc2013).           */
 /* -------------------------------------------------------------------- */
-    if( dstdefn->from_greenwich != 0.0 )
-    {
-        for( i = 0; i < point_count; i++ )
-        {
-            if( x[point_offset*i] != HUGE_VAL )
-                x[point_offset*i] -= dstdefn->from_greenwich;
-        }
-    }
+          case CT3D_STAGE_DST_VERTICAL:
+            //x y z coordinates are in radian
+            if( poSRSTarget->ApplyVerticalCorrection(1, point_count, x, y, z, &psState->oVerticalScratch, 
+                                                     point_offset) != OGRERR_NONE )
+                return CT3D_ERR_VERTICAL_MODEL;
+            break;
 
 /* -------------------------------------------------------------------- */
-/*      Transform destination latlong to geocentric if required.        */
+/*      Horizontal grid shift of the target datum (PEB:gsoc2014).       */
 /* -------------------------------------------------------------------- */
-    if( dstdefn->is_geocent )
-    {
-        if( z == NULL )
-        {
+          case CT3D_STAGE_DST_GRIDSHIFT:
+            ct3D_pj_apply_gridshift_2( dstdefn, psState->GetGridIndex( dstdefn ), 1, point_count, point_offset, x, y, z,
+                                       &psState->sGridShiftStats );
+            if( ct3D_pj_is_fatal( dstdefn ) )
+                return dstdefn->ctx->last_errno;
+            break;
+
+/* -------------------------------------------------------------------- */
+/*      Adjust for the prime meridian of the target.                    */
+/* -------------------------------------------------------------------- */
+          case CT3D_STAGE_DST_PRIME_MERIDIAN:
+            for( i = 0; i < point_count; i++ )
+            {
+                if( x[point_offset*i] != HUGE_VAL )
+                    x[point_offset*i] -= dstdefn->from_greenwich;
+            }
+            break;
+
+/* -------------------------------------------------------------------- */
+/*      Transform destination latlong to geocentric.                    */
+/* -------------------------------------------------------------------- */
+          case CT3D_STAGE_DST_GEOCENT_NO_Z:
             pj_ctx_set_errno( dstdefn->ctx, PJD_ERR_GEOCENTRIC );
             return PJD_ERR_GEOCENTRIC;
-        }
 
-        pj_geodetic_to_geocentric( dstdefn->a_orig, dstdefn->es_orig,
-                                   point_count, point_offset, x, y, z );
+          case CT3D_STAGE_DST_GEODETIC_TO_GEOCENT:
+            geodeticToGeocentricBatch( dstdefn->a_orig, dstdefn->es_orig,
+                                       point_count, point_offset, x, y, z, 
+                                       nGeocentricSIMD );
+            break;
 
-        if( dstdefn->fr_meter != 1.0 )
-        {
+          case CT3D_STAGE_DST_GEOCENT_FROM_METER:
             for( i = 0; i < point_count; i++ )
             {
                 if( x[point_offset*i] != HUGE_VAL )
@@ -2719,87 +4519,84 @@ int OGRProj4CT3D::ct3D_pj_transform(PJ *srcdefn, PJ *dstdefn, long point_count,
                     y[point_offset*i] *= dstdefn->fr_meter;
                 }
             }
-        }
-    }
+            break;
 
 /* -------------------------------------------------------------------- */
-/*      Transform destination points to projection coordinates, if      */
-/*      desired.                                                        */
+/*      Adjust for the prime meridian of the target and transform the   */
+/*      destination points to projection coordinates.                   */
 /* -------------------------------------------------------------------- */
-    else if( !dstdefn->is_latlong )
-    {
-        for( i = 0; i < point_count; i++ )
-        {
-            XY         projected_loc;
-            LP	       geodetic_loc;
+          case CT3D_STAGE_DST_PROJECT:
+            for( i = 0; i < point_count; i++ )
+            {
+                XY         projected_loc;
+                LP	       geodetic_loc;
 
-            geodetic_loc.u = x[point_offset*i];
-            geodetic_loc.v = y[point_offset*i];
+                geodetic_loc.u = x[point_offset*i];
+                geodetic_loc.v = y[point_offset*i];
 
-            if( geodetic_loc.u == HUGE_VAL )
-                continue;
+                if( geodetic_loc.u == HUGE_VAL )
+                    continue;
 
-            projected_loc = pj_fwd( geodetic_loc, dstdefn );
-            if( dstdefn->ctx->last_errno != 0 )
-            {
-                if( (dstdefn->ctx->last_errno != 33 /*EDOM*/ 
-                     && dstdefn->ctx->last_errno != 34 /*ERANGE*/ )
-                    && (dstdefn->ctx->last_errno > 0 
-                        || dstdefn->ctx->last_errno < -44 || point_count == 1
-                        || transient_error[-dstdefn->ctx->last_errno] == 0 ) )
-                    return dstdefn->ctx->last_errno;
-                else
+                if( psPipeline->dfDstGreenwich != 0.0 )
+                    geodetic_loc.u -= psPipeline->dfDstGreenwich;
+
+                projected_loc = pj_fwd( geodetic_loc, dstdefn );
+                if( dstdefn->ctx->last_errno != 0 )
                 {
-                    projected_loc.u = HUGE_VAL;
-                    projected_loc.v = HUGE_VAL;
+                    if( (dstdefn->ctx->last_errno != 33 /*EDOM*/ 
+                         && dstdefn->ctx->last_errno != 34 /*ERANGE*/ )
+                        && (dstdefn->ctx->last_errno > 0 
+                            || dstdefn->ctx->last_errno < -44 || point_count == 1
+                            || transient_error[-dstdefn->ctx->last_errno] == 0 ) )
+                        return dstdefn->ctx->last_errno;
+                    else
+                    {
+                        projected_loc.u = HUGE_VAL;
+                        projected_loc.v = HUGE_VAL;
+                    }
                 }
-            }
 
-            x[point_offset*i] = projected_loc.u;
-            y[point_offset*i] = projected_loc.v;
-        }
-    }
+                x[point_offset*i] = projected_loc.u;
+                y[point_offset*i] = projected_loc.v;
+            }
+            break;
 
 /* -------------------------------------------------------------------- */
-/*      If a wrapping center other than 0 is provided, rewrap around    */
-/*      the suggested center (for latlong coordinate systems only).     */
+/*      Rewrap lat/long around the suggested center.                    */
 /* -------------------------------------------------------------------- */
-    else if( dstdefn->is_latlong && dstdefn->is_long_wrap_set )
-    {
-        for( i = 0; i < point_count; i++ )
-        {
-            if( x[point_offset*i] == HUGE_VAL )
-                continue;
+          case CT3D_STAGE_DST_LONG_WRAP:
+            for( i = 0; i < point_count; i++ )
+            {
+                if( x[point_offset*i] == HUGE_VAL )
+                    continue;
 
-            while( x[point_offset*i] < dstdefn->long_wrap_center - PI )
-                x[point_offset*i] += TWOPI;
-            while( x[point_offset*i] > dstdefn->long_wrap_center + PI )
-                x[point_offset*i] -= TWOPI;
-        }
-    }
+                while( x[point_offset*i] < dstdefn->long_wrap_center - PI )
+                    x[point_offset*i] += TWOPI;
+                while( x[point_offset*i] > dstdefn->long_wrap_center + PI )
+                    x[point_offset*i] -= TWOPI;
+            }
+            break;
 
 /* -------------------------------------------------------------------- */
-/*      Transform Z from meters if needed.                              */
+/*      Transform Z from meters.                                        */
 /* -------------------------------------------------------------------- */
-    if( dstdefn->vto_meter != 1.0 && z != NULL )
-    {
-        for( i = 0; i < point_count; i++ )
-            z[point_offset*i] *= dstdefn->vfr_meter;
-    }
+          case CT3D_STAGE_DST_Z_FROM_METER:
+            for( i = 0; i < point_count; i++ )
+                z[point_offset*i] *= dstdefn->vfr_meter;
+            break;
 
 /* -------------------------------------------------------------------- */
 /*      Transform normalized axes into unusual output coordinate axis   */
-/*      orientation if needed.                                          */
+/*      orientation.                                                    */
 /* -------------------------------------------------------------------- */
-    if( strcmp(dstdefn->axis,"enu") != 0 )
-    {
-        int err;
-
-        err = pj_adjust_axis( dstdefn->ctx, dstdefn->axis, 
-                              1, point_count, point_offset, x, y, z );
-        if( err != 0 )
-            return err;
-	}
+          case CT3D_STAGE_DST_AXIS:
+            err = pj_adjust_axis( dstdefn->ctx, dstdefn->axis, 
+                                  1, point_count, point_offset, x, y, z );
+            if( err != 0 )
+                return err;
+            break;
+        }
+    }
 
- return 0;
+    return 0;
 }
\ No newline at end of file
@@ -0,0 +1,483 @@
+/******************************************************************************
+ *
+ * Project:  OGR SpatialRef3D
+ * Purpose:  batch conversion between geodetic and geocentric coordinates
+ *           with SSE2 and AVX kernels
+ * Authors:  Peb Ruswono Aryan, Gottfried Mandlburger, Johannes Otepka
+ *
+ ******************************************************************************
+ * Copyright (c) 2012-2014,  I.P.F., TU Vienna.
+  *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ ****************************************************************************/
+#include "math.h"
+#include "geocentric_batch.h"
+
+#include "cpl_port.h"
+#include "cpl_conv.h"
+#include "cpl_error.h"
+#include "cpl_string.h"
+
+#include "..\..\proj-4.8.0\src\projects.h"
+#include "..\..\proj-4.8.0\src\geocent.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  define GEOCENTRIC_SSE2
+#  include <emmintrin.h>
+// the AVX kernel is compiled for the AVX target only and run when the CPU has it
+#  if defined(__AVX__) || defined(_MSC_VER) || defined(__clang__) || \
+      (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)))
+#    define GEOCENTRIC_AVX
+#    include <immintrin.h>
+#    if defined(_MSC_VER)
+#      include <intrin.h>
+#    endif
+#  endif
+#endif
+
+#define GEOCENTRIC_PI        3.14159265358979323e0
+#define GEOCENTRIC_PIO2      (GEOCENTRIC_PI / 2.0e0)
+#define GEOCENTRIC_PIO4      7.85398163397448309616E-1
+#define GEOCENTRIC_GENAU     1.E-12
+#define GEOCENTRIC_MAXITER   30
+
+// largest longitude (radians) handed to the vectorized sine and cosine
+#define GEOCENTRIC_MAX_LON   1.0E4
+
+// constants of the Cephes library sin.c, cos.c and atan.c
+#define GEOCENTRIC_FOPI      1.27323954473516268615
+#define GEOCENTRIC_DP1       7.85398125648498535156E-1
+#define GEOCENTRIC_DP2       3.77489470793079817668E-8
+#define GEOCENTRIC_DP3       2.69515142907905952645E-15
+#define GEOCENTRIC_T3P8      2.41421356237309504880
+#define GEOCENTRIC_MOREBITS  6.123233995736765886130E-17
+
+static const double adfGeocentricSinCoef[6] = {
+	 1.58962301576546568060E-10,
+	-2.50507477628578072866E-8,
+	 2.75573136213857245213E-6,
+	-1.98412698295895385996E-4,
+	 8.33333333332211858878E-3,
+	-1.66666666666666307295E-1
+};
+
+static const double adfGeocentricCosCoef[6] = {
+	-1.13585365213876817300E-11,
+	 2.08757008419747316778E-9,
+	-2.75573141792967388112E-7,
+	 2.48015872888517045348E-5,
+	-1.38888888888730564116E-3,
+	 4.16666666666665929218E-2
+};
+
+static const double adfGeocentricAtanP[5] = {
+	-8.750608600031904122785E-1,
+	-1.615753718733365076637E1,
+	-7.500855792314704667340E1,
+	-1.228866684490136173410E2,
+	-6.485021904942025371773E1
+};
+
+static const double adfGeocentricAtanQ[5] = {
+	 2.485846490142306297962E1,
+	 1.650270098316988542046E2,
+	 4.328810604912902668951E2,
+	 4.853903996359136964868E2,
+	 1.945506571482613964425E2
+};
+
+//! kernel converting a block of points, see geocentric_batch_kernel.h
+typedef void (*GeocentricKernelFunc)(int nCount, const GeocentricInfo *gi,
+									 double *x, double *y, double *z);
+
+typedef struct
+{
+	const char *pszName;
+	int nWidth;
+	GeocentricKernelFunc pfnToGeocentric;
+	GeocentricKernelFunc pfnToGeodetic;
+} GeocentricKernel;
+
+/************************************************************************/
+/*                            SSE2 kernel                               */
+/************************************************************************/
+#if defined(GEOCENTRIC_SSE2)
+
+#define GK_NAME(name)       name##SSE2
+#define GK_V                __m128d
+#define GK_W                2
+#define GK_SET1(d)          _mm_set1_pd(d)
+#define GK_LOADU(p)         _mm_loadu_pd(p)
+#define GK_STOREU(p, v)     _mm_storeu_pd(p, v)
+#define GK_ADD(a, b)        _mm_add_pd(a, b)
+#define GK_SUB(a, b)        _mm_sub_pd(a, b)
+#define GK_MUL(a, b)        _mm_mul_pd(a, b)
+#define GK_DIV(a, b)        _mm_div_pd(a, b)
+#define GK_SQRT(a)          _mm_sqrt_pd(a)
+#define GK_AND(a, b)        _mm_and_pd(a, b)
+#define GK_ANDNOT(a, b)     _mm_andnot_pd(a, b)
+#define GK_OR(a, b)         _mm_or_pd(a, b)
+#define GK_XOR(a, b)        _mm_xor_pd(a, b)
+#define GK_CMPLT(a, b)      _mm_cmplt_pd(a, b)
+#define GK_CMPGT(a, b)      _mm_cmpgt_pd(a, b)
+#define GK_CMPEQ(a, b)      _mm_cmpeq_pd(a, b)
+#define GK_BLEND(a, b, m)   _mm_or_pd(_mm_and_pd(m, b), _mm_andnot_pd(m, a))
+#define GK_MOVEMASK(a)      _mm_movemask_pd(a)
+#define GK_TRUNC(a)         _mm_cvtepi32_pd(_mm_cvttpd_epi32(a))
+#define GK_CLEANUP()
+
+#include "geocentric_batch_kernel.h"
+
+#undef GK_NAME
+#undef GK_V
+#undef GK_W
+#undef GK_SET1
+#undef GK_LOADU
+#undef GK_STOREU
+#undef GK_ADD
+#undef GK_SUB
+#undef GK_MUL
+#undef GK_DIV
+#undef GK_SQRT
+#undef GK_AND
+#undef GK_ANDNOT
+#undef GK_OR
+#undef GK_XOR
+#undef GK_CMPLT
+#undef GK_CMPGT
+#undef GK_CMPEQ
+#undef GK_BLEND
+#undef GK_MOVEMASK
+#undef GK_TRUNC
+#undef GK_CLEANUP
+
+#endif /* GEOCENTRIC_SSE2 */
+
+/************************************************************************/
+/*                             AVX kernel                               */
+/*                                                                      */
+/*      Compiled for AVX whatever the target of the rest of the         */
+/*      library is; it is only called after checking the CPU.           */
+/************************************************************************/
+#if defined(GEOCENTRIC_AVX)
+
+#if !defined(__AVX__)
+#  if defined(__clang__)
+#    pragma clang attribute push (__attribute__((target("avx"))), apply_to = function)
+#  elif defined(__GNUC__)
+#    pragma GCC push_options
+#    pragma GCC target("avx")
+#  endif
+#endif
+
+#define GK_NAME(name)       name##AVX
+#define GK_V                __m256d
+#define GK_W                4
+#define GK_SET1(d)          _mm256_set1_pd(d)
+#define GK_LOADU(p)         _mm256_loadu_pd(p)
+#define GK_STOREU(p, v)     _mm256_storeu_pd(p, v)
+#define GK_ADD(a, b)        _mm256_add_pd(a, b)
+#define GK_SUB(a, b)        _mm256_sub_pd(a, b)
+#define GK_MUL(a, b)        _mm256_mul_pd(a, b)
+#define GK_DIV(a, b)        _mm256_div_pd(a, b)
+#define GK_SQRT(a)          _mm256_sqrt_pd(a)
+#define GK_AND(a, b)        _mm256_and_pd(a, b)
+#define GK_ANDNOT(a, b)     _mm256_andnot_pd(a, b)
+#define GK_OR(a, b)         _mm256_or_pd(a, b)
+#define GK_XOR(a, b)        _mm256_xor_pd(a, b)
+#define GK_CMPLT(a, b)      _mm256_cmp_pd(a, b, _CMP_LT_OQ)
+#define GK_CMPGT(a, b)      _mm256_cmp_pd(a, b, _CMP_GT_OQ)
+#define GK_CMPEQ(a, b)      _mm256_cmp_pd(a, b, _CMP_EQ_OQ)
+#define GK_BLEND(a, b, m)   _mm256_blendv_pd(a, b, m)
+#define GK_MOVEMASK(a)      _mm256_movemask_pd(a)
+#define GK_TRUNC(a)         _mm256_round_pd(a, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC)
+#define GK_CLEANUP()        _mm256_zeroupper()
+
+#include "geocentric_batch_kernel.h"
+
+#undef GK_NAME
+#undef GK_V
+#undef GK_W
+#undef GK_SET1
+#undef GK_LOADU
+#undef GK_STOREU
+#undef GK_ADD
+#undef GK_SUB
+#undef GK_MUL
+#undef GK_DIV
+#undef GK_SQRT
+#undef GK_AND
+#undef GK_ANDNOT
+#undef GK_OR
+#undef GK_XOR
+#undef GK_CMPLT
+#undef GK_CMPGT
+#undef GK_CMPEQ
+#undef GK_BLEND
+#undef GK_MOVEMASK
+#undef GK_TRUNC
+#undef GK_CLEANUP
+
+#if !defined(__AVX__)
+#  if defined(__clang__)
+#    pragma clang attribute pop
+#  elif defined(__GNUC__)
+#    pragma GCC pop_options
+#  endif
+#endif
+
+/************************************************************************/
+/*                          CPUSupportsAVX()                            */
+/*                                                                      */
+/*      AVX instructions and the operating system saving the YMM        */
+/*      registers.                                                      */
+/************************************************************************/
+static int CPUSupportsAVX()
+{
+    // every thread finds the same, so a race only repeats the test
+    static volatile int nSupported = -1;
+
+    if( nSupported >= 0 )
+        return nSupported;
+
+#if defined(_MSC_VER)
+    int anInfo[4];
+    __cpuid( anInfo, 1 );
+    nSupported = (anInfo[2] & (1 << 27)) != 0 && (anInfo[2] & (1 << 28)) != 0
+        && (_xgetbv( 0 ) & 6) == 6;
+#else
+    __builtin_cpu_init();
+    nSupported = __builtin_cpu_supports( "avx" ) != 0;
+#endif
+    return nSupported;
+}
+
+#endif /* GEOCENTRIC_AVX */
+
+/************************************************************************/
+/*                        GetGeocentricKernel()                         */
+/*                                                                      */
+/*      Widest kernel the CPU runs up to the level nSIMD.               */
+/************************************************************************/
+static const GeocentricKernel *GetGeocentricKernel( int nSIMD )
+{
+    static const GeocentricKernel sKernelNone = { "NO", 1, NULL, NULL };
+#if defined(GEOCENTRIC_SSE2)
+    static const GeocentricKernel sKernelSSE2 =
+        { "SSE2", 2, gkGeodeticToGeocentricSSE2, gkGeocentricToGeodeticSSE2 };
+#endif
+#if defined(GEOCENTRIC_AVX)
+    static const GeocentricKernel sKernelAVX =
+        { "AVX", 4, gkGeodeticToGeocentricAVX, gkGeocentricToGeodeticAVX };
+#endif
+    const GeocentricKernel *psKernel = &sKernelNone;
+
+#if defined(GEOCENTRIC_SSE2)
+    if( nSIMD >= GEOCENTRIC_SIMD_SSE2 )
+        psKernel = &sKernelSSE2;
+#endif
+#if defined(GEOCENTRIC_AVX)
+    if( nSIMD >= GEOCENTRIC_SIMD_AVX && CPUSupportsAVX() )
+        psKernel = &sKernelAVX;
+#endif
+
+    return psKernel;
+}
+
+/************************************************************************/
+/*                        geocentricBatchSIMD()                         */
+/*                                                                      */
+/*      AUTO (default) or AVX allows the widest kernel, SSE2 at most    */
+/*      that one, NO always calls PROJ.4.                               */
+/************************************************************************/
+int geocentricBatchSIMD( const char *pszSIMD )
+{
+    if( pszSIMD == NULL )
+        return GEOCENTRIC_SIMD_AVX;
+    if( !CSLTestBoolean(pszSIMD) )
+        return GEOCENTRIC_SIMD_NONE;
+    if( EQUAL(pszSIMD, "SSE2") )
+        return GEOCENTRIC_SIMD_SSE2;
+    return GEOCENTRIC_SIMD_AVX;
+}
+
+/************************************************************************/
+/*                       geocentricBatchKernel()                        */
+/************************************************************************/
+const char *geocentricBatchKernel( int nSIMD )
+{
+    return GetGeocentricKernel( nSIMD )->pszName;
+}
+
+/************************************************************************/
+/*                     SetGeocentricParameters()                        */
+/************************************************************************/
+static int SetGeocentricParameters( GeocentricInfo *gi, double a, double es )
+{
+    double b;
+
+    if( es == 0.0 )
+        b = a;
+    else
+        b = a * sqrt(1-es);
+
+    return pj_Set_Geocentric_Parameters( gi, a, b ) == 0;
+}
+
+/************************************************************************/
+/*                     geodeticToGeocentricBatch()                      */
+/*                                                                      */
+/*      Points are gathered into blocks for the kernel, latitudes       */
+/*      outside [-pi/2, pi/2] (which PROJ.4 clamps or rejects) and      */
+/*      huge longitudes are converted one by one by PROJ.4.             */
+/************************************************************************/
+int geodeticToGeocentricBatch( double a, double es, long point_count, int point_offset,
+                               double *x, double *y, double *z, int nSIMD )
+{
+    const GeocentricKernel *psKernel = GetGeocentricKernel( nSIMD );
+    GeocentricInfo gi;
+    double adfX[GEOCENTRIC_BATCH_BLOCK], adfY[GEOCENTRIC_BATCH_BLOCK], adfZ[GEOCENTRIC_BATCH_BLOCK];
+    long anIndex[GEOCENTRIC_BATCH_BLOCK];
+    int ret_errno = 0;
+    long i = 0;
+
+    if( psKernel->pfnToGeocentric == NULL )
+        return pj_geodetic_to_geocentric( a, es, point_count, point_offset, x, y, z );
+
+    if( !SetGeocentricParameters( &gi, a, es ) )
+        return PJD_ERR_GEOCENTRIC;
+
+    while( i < point_count )
+    {
+        int n = 0, k;
+
+        for( ; i < point_count && n < GEOCENTRIC_BATCH_BLOCK; i++ )
+        {
+            long io = i * point_offset;
+
+            if( x[io] == HUGE_VAL )
+                continue;
+
+            if( !(fabs(y[io]) <= GEOCENTRIC_PIO2) || !(fabs(x[io]) <= GEOCENTRIC_MAX_LON) )
+            {
+                if( pj_Convert_Geodetic_To_Geocentric( &gi, y[io], x[io], z[io],
+                                                       x+io, y+io, z+io ) != 0 )
+                {
+                    ret_errno = -14;
+                    x[io] = y[io] = HUGE_VAL;
+                }
+                continue;
+            }
+
+            anIndex[n] = io;
+            adfX[n] = x[io];
+            adfY[n] = y[io];
+            adfZ[n] = z[io];
+            n++;
+        }
+
+        if( n == 0 )
+            continue;
+
+        // pad to whole vectors, the block size is a multiple of all widths
+        int nPadded = ((n + psKernel->nWidth - 1) / psKernel->nWidth) * psKernel->nWidth;
+        for( k = n; k < nPadded; k++ )
+            adfX[k] = adfY[k] = adfZ[k] = 0.0;
+
+        psKernel->pfnToGeocentric( nPadded, &gi, adfX, adfY, adfZ );
+
+        for( k = 0; k < n; k++ )
+        {
+            x[anIndex[k]] = adfX[k];
+            y[anIndex[k]] = adfY[k];
+            z[anIndex[k]] = adfZ[k];
+        }
+    }
+
+    return ret_errno;
+}
+
+/************************************************************************/
+/*                     geocentricToGeodeticBatch()                      */
+/*                                                                      */
+/*      Non finite coordinates are converted one by one by PROJ.4.      */
+/************************************************************************/
+int geocentricToGeodeticBatch( double a, double es, long point_count, int point_offset,
+                               double *x, double *y, double *z, int nSIMD )
+{
+    const GeocentricKernel *psKernel = GetGeocentricKernel( nSIMD );
+    GeocentricInfo gi;
+    double adfX[GEOCENTRIC_BATCH_BLOCK], adfY[GEOCENTRIC_BATCH_BLOCK], adfZ[GEOCENTRIC_BATCH_BLOCK];
+    long anIndex[GEOCENTRIC_BATCH_BLOCK];
+    long i = 0;
+
+    if( psKernel->pfnToGeodetic == NULL )
+        return pj_geocentric_to_geodetic( a, es, point_count, point_offset, x, y, z );
+
+    if( !SetGeocentricParameters( &gi, a, es ) )
+        return PJD_ERR_GEOCENTRIC;
+
+    while( i < point_count )
+    {
+        int n = 0, k;
+
+        for( ; i < point_count && n < GEOCENTRIC_BATCH_BLOCK; i++ )
+        {
+            long io = i * point_offset;
+
+            if( x[io] == HUGE_VAL )
+                continue;
+
+            if( !(fabs(x[io]) < HUGE_VAL && fabs(y[io]) < HUGE_VAL && fabs(z[io]) < HUGE_VAL) )
+            {
+                pj_Convert_Geocentric_To_Geodetic( &gi, x[io], y[io], z[io],
+                                                   y+io, x+io, z+io );
+                continue;
+            }
+
+            anIndex[n] = io;
+            adfX[n] = x[io];
+            adfY[n] = y[io];
+            adfZ[n] = z[io];
+            n++;
+        }
+
+        if( n == 0 )
+            continue;
+
+        // padding lanes sit on the equator and converge at once
+        int nPadded = ((n + psKernel->nWidth - 1) / psKernel->nWidth) * psKernel->nWidth;
+        for( k = n; k < nPadded; k++ )
+        {
+            adfX[k] = gi.Geocent_a;
+            adfY[k] = adfZ[k] = 0.0;
+        }
+
+        psKernel->pfnToGeodetic( nPadded, &gi, adfX, adfY, adfZ );
+
+        for( k = 0; k < n; k++ )
+        {
+            x[anIndex[k]] = adfX[k];
+            y[anIndex[k]] = adfY[k];
+            z[anIndex[k]] = adfZ[k];
+        }
+    }
+
+    return 0;
+}
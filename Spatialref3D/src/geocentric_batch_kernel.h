@@ -0,0 +1,238 @@
+/******************************************************************************
+ *
+ * Project:  OGR SpatialRef3D
+ * Purpose:  vectorized geodetic <-> geocentric conversion kernels, included
+ *           by geocentric_batch.cpp once per instruction set
+ * Authors:  Peb Ruswono Aryan, Gottfried Mandlburger, Johannes Otepka
+ *
+ ******************************************************************************
+ * Copyright (c) 2012-2014,  I.P.F., TU Vienna.
+  *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ ****************************************************************************/
+
+// No include guard: the includer defines the vector type GK_V of GK_W doubles,
+// the GK_xxx operations on it and GK_NAME() to give the functions of each
+// instruction set their own names. The arithmetic follows geocent.c operation
+// by operation and never uses fused multiply-adds, so all kernels give the same
+// results, which only differ from PROJ.4 by the rounding of sin, cos and atan.
+
+//! sine and cosine of x, |x| < 2^29 (Cephes sin.c / cos.c)
+static inline void GK_NAME(gkSinCos)(GK_V x, GK_V *pvSin, GK_V *pvCos)
+{
+	const GK_V vSignMask = GK_SET1(-0.0);
+	const GK_V vSignX = GK_AND(x, vSignMask);
+	const GK_V vAbs = GK_ANDNOT(vSignMask, x);
+
+	// octant, rounded up to an even one
+	GK_V j = GK_TRUNC(GK_MUL(vAbs, GK_SET1(GEOCENTRIC_FOPI)));
+	GK_V jHalf = GK_TRUNC(GK_MUL(j, GK_SET1(0.5)));
+	j = GK_ADD(j, GK_SUB(j, GK_ADD(jHalf, jHalf)));
+
+	// extended precision modular arithmetic
+	GK_V z = GK_SUB(vAbs, GK_MUL(j, GK_SET1(GEOCENTRIC_DP1)));
+	z = GK_SUB(z, GK_MUL(j, GK_SET1(GEOCENTRIC_DP2)));
+	z = GK_SUB(z, GK_MUL(j, GK_SET1(GEOCENTRIC_DP3)));
+	const GK_V zz = GK_MUL(z, z);
+
+	GK_V ps = GK_SET1(adfGeocentricSinCoef[0]);
+	GK_V pc = GK_SET1(adfGeocentricCosCoef[0]);
+	for( int k = 1; k < 6; k++ )
+	{
+		ps = GK_ADD(GK_MUL(ps, zz), GK_SET1(adfGeocentricSinCoef[k]));
+		pc = GK_ADD(GK_MUL(pc, zz), GK_SET1(adfGeocentricCosCoef[k]));
+	}
+	ps = GK_ADD(z, GK_MUL(GK_MUL(z, zz), ps));
+	pc = GK_ADD(GK_SUB(GK_SET1(1.0), GK_MUL(GK_SET1(0.5), zz)), GK_MUL(GK_MUL(zz, zz), pc));
+
+	// octant modulo 8 selects the polynomial and the signs
+	const GK_V j8 = GK_SUB(j, GK_MUL(GK_TRUNC(GK_MUL(j, GK_SET1(0.125))), GK_SET1(8.0)));
+	const GK_V vIs2 = GK_CMPEQ(j8, GK_SET1(2.0));
+	const GK_V vIs4 = GK_CMPEQ(j8, GK_SET1(4.0));
+	const GK_V vIs6 = GK_CMPEQ(j8, GK_SET1(6.0));
+	const GK_V vSwap = GK_OR(vIs2, vIs6);
+	const GK_V vSinFlip = GK_AND(GK_OR(vIs4, vIs6), vSignMask);
+	const GK_V vCosFlip = GK_AND(GK_OR(vIs2, vIs4), vSignMask);
+
+	*pvSin = GK_XOR(GK_XOR(GK_BLEND(ps, pc, vSwap), vSinFlip), vSignX);
+	*pvCos = GK_XOR(GK_BLEND(pc, ps, vSwap), vCosFlip);
+}
+
+//! arc tangent of x (Cephes atan.c)
+static inline GK_V GK_NAME(gkAtan)(GK_V x)
+{
+	const GK_V vSignMask = GK_SET1(-0.0);
+	const GK_V vSign = GK_AND(x, vSignMask);
+	const GK_V vAbs = GK_ANDNOT(vSignMask, x);
+	const GK_V vOne = GK_SET1(1.0);
+
+	// range reduction: |x| > tan(3pi/8) -> -1/|x|, |x| > 0.66 -> (|x|-1)/(|x|+1)
+	const GK_V vBig = GK_CMPGT(vAbs, GK_SET1(GEOCENTRIC_T3P8));
+	const GK_V vMid = GK_ANDNOT(vBig, GK_CMPGT(vAbs, GK_SET1(0.66)));
+
+	GK_V vNum = GK_BLEND(vAbs, GK_SUB(vAbs, vOne), vMid);
+	vNum = GK_BLEND(vNum, GK_SET1(-1.0), vBig);
+	GK_V vDen = GK_BLEND(vOne, GK_ADD(vAbs, vOne), vMid);
+	vDen = GK_BLEND(vDen, vAbs, vBig);
+	const GK_V xr = GK_DIV(vNum, vDen);
+
+	GK_V y = GK_AND(vMid, GK_SET1(GEOCENTRIC_PIO4));
+	y = GK_BLEND(y, GK_SET1(GEOCENTRIC_PIO2), vBig);
+	GK_V vMore = GK_AND(vMid, GK_SET1(0.5 * GEOCENTRIC_MOREBITS));
+	vMore = GK_BLEND(vMore, GK_SET1(GEOCENTRIC_MOREBITS), vBig);
+
+	const GK_V z = GK_MUL(xr, xr);
+	GK_V p = GK_SET1(adfGeocentricAtanP[0]);
+	GK_V q = GK_ADD(z, GK_SET1(adfGeocentricAtanQ[0]));
+	for( int k = 1; k < 5; k++ )
+	{
+		p = GK_ADD(GK_MUL(p, z), GK_SET1(adfGeocentricAtanP[k]));
+		q = GK_ADD(GK_MUL(q, z), GK_SET1(adfGeocentricAtanQ[k]));
+	}
+	GK_V r = GK_DIV(GK_MUL(z, p), q);
+	r = GK_ADD(GK_MUL(xr, r), xr);
+	r = GK_ADD(r, vMore);
+
+	return GK_XOR(GK_ADD(y, r), vSign);
+}
+
+//! arc tangent of y/x in (-pi, pi] (Cephes atan2.c)
+static inline GK_V GK_NAME(gkAtan2)(GK_V y, GK_V x)
+{
+	const GK_V vSignMask = GK_SET1(-0.0);
+	const GK_V vSignY = GK_AND(y, vSignMask);
+	const GK_V vZero = GK_SET1(0.0);
+
+	GK_V w = GK_AND(GK_CMPLT(x, vZero), GK_OR(GK_SET1(GEOCENTRIC_PI), vSignY));
+	GK_V r = GK_ADD(w, GK_NAME(gkAtan)(GK_DIV(y, x)));
+
+	return GK_BLEND(r, GK_OR(GK_SET1(GEOCENTRIC_PIO2), vSignY), GK_CMPEQ(x, vZero));
+}
+
+//! pj_Convert_Geodetic_To_Geocentric() of nCount (a multiple of GK_W) points
+/*!
+	Latitudes have to be within [-pi/2, pi/2] and longitudes finite, the
+	caller leaves other points to PROJ.4.
+*/
+static void GK_NAME(gkGeodeticToGeocentric)(int nCount, const GeocentricInfo *gi,
+											double *x, double *y, double *z)
+{
+	const GK_V vA = GK_SET1(gi->Geocent_a);
+	const GK_V vE2 = GK_SET1(gi->Geocent_e2);
+	const GK_V vOne = GK_SET1(1.0);
+	const GK_V vOneMinusE2 = GK_SUB(vOne, vE2);
+	const GK_V vPi = GK_SET1(GEOCENTRIC_PI);
+	const GK_V vTwoPi = GK_SET1(2 * GEOCENTRIC_PI);
+
+	for( int i = 0; i < nCount; i += GK_W )
+	{
+		GK_V vLon = GK_LOADU(x + i);
+		GK_V vLat = GK_LOADU(y + i);
+		GK_V vH = GK_LOADU(z + i);
+		GK_V vSinLat, vCosLat, vSinLon, vCosLon;
+
+		vLon = GK_BLEND(vLon, GK_SUB(vLon, vTwoPi), GK_CMPGT(vLon, vPi));
+		GK_NAME(gkSinCos)(vLat, &vSinLat, &vCosLat);
+		GK_NAME(gkSinCos)(vLon, &vSinLon, &vCosLon);
+
+		GK_V vRn = GK_DIV(vA, GK_SQRT(GK_SUB(vOne, GK_MUL(vE2, GK_MUL(vSinLat, vSinLat)))));
+		GK_V vR = GK_MUL(GK_ADD(vRn, vH), vCosLat);
+
+		GK_STOREU(x + i, GK_MUL(vR, vCosLon));
+		GK_STOREU(y + i, GK_MUL(vR, vSinLon));
+		GK_STOREU(z + i, GK_MUL(GK_ADD(GK_MUL(vRn, vOneMinusE2), vH), vSinLat));
+	}
+	GK_CLEANUP();
+}
+
+//! pj_Convert_Geocentric_To_Geodetic() of nCount (a multiple of GK_W) points
+/*!
+	Coordinates have to be finite. Runs the iteration of geocent.c on all lanes
+	until the last one has converged, lanes which converged earlier keep
+	the values of their last iteration.
+*/
+static void GK_NAME(gkGeocentricToGeodetic)(int nCount, const GeocentricInfo *gi,
+											double *x, double *y, double *z)
+{
+	const GK_V vA = GK_SET1(gi->Geocent_a);
+	const GK_V vE2 = GK_SET1(gi->Geocent_e2);
+	const GK_V vOne = GK_SET1(1.0);
+	const GK_V vTwo = GK_SET1(2.0);
+	const GK_V vGenau = GK_SET1(GEOCENTRIC_GENAU);
+	const GK_V vGenau2 = GK_SET1(GEOCENTRIC_GENAU * GEOCENTRIC_GENAU);
+	const GK_V vSignMask = GK_SET1(-0.0);
+
+	for( int i = 0; i < nCount; i += GK_W )
+	{
+		const GK_V vX = GK_LOADU(x + i);
+		const GK_V vY = GK_LOADU(y + i);
+		const GK_V vZ = GK_LOADU(z + i);
+
+		const GK_V vP2 = GK_ADD(GK_MUL(vX, vX), GK_MUL(vY, vY));
+		const GK_V vP = GK_SQRT(vP2);
+		const GK_V vRR = GK_SQRT(GK_ADD(vP2, GK_MUL(vZ, vZ)));
+
+		// on the polar axis the longitude is 0
+		const GK_V vAtPole = GK_CMPLT(GK_DIV(vP, vA), vGenau);
+		const GK_V vLon = GK_ANDNOT(vAtPole, GK_NAME(gkAtan2)(vY, vX));
+
+		const GK_V vCT = GK_DIV(vZ, vRR);
+		const GK_V vST = GK_DIV(vP, vRR);
+		GK_V vRX = GK_DIV(vOne, GK_SQRT(GK_SUB(vOne,
+						GK_MUL(GK_MUL(GK_MUL(vE2, GK_SUB(vTwo, vE2)), vST), vST))));
+		GK_V vCPHI0 = GK_MUL(GK_MUL(vST, GK_SUB(vOne, vE2)), vRX);
+		GK_V vSPHI0 = GK_MUL(vCT, vRX);
+		GK_V vH = GK_SET1(0.0);
+		GK_V vActive = GK_CMPEQ(vOne, vOne);
+
+		for( int iter = 0; iter < GEOCENTRIC_MAXITER; iter++ )
+		{
+			const GK_V vSPHI02 = GK_MUL(GK_MUL(vE2, vSPHI0), vSPHI0);
+			const GK_V vRN = GK_DIV(vA, GK_SQRT(GK_SUB(vOne, vSPHI02)));
+			const GK_V vHi = GK_SUB(GK_ADD(GK_MUL(vP, vCPHI0), GK_MUL(vZ, vSPHI0)),
+									GK_MUL(vRN, GK_SUB(vOne, vSPHI02)));
+			const GK_V vRK = GK_DIV(GK_MUL(vE2, vRN), GK_ADD(vRN, vHi));
+			vRX = GK_DIV(vOne, GK_SQRT(GK_SUB(vOne,
+						GK_MUL(GK_MUL(GK_MUL(vRK, GK_SUB(vTwo, vRK)), vST), vST))));
+			const GK_V vCPHI = GK_MUL(GK_MUL(vST, GK_SUB(vOne, vRK)), vRX);
+			const GK_V vSPHI = GK_MUL(vCT, vRX);
+			const GK_V vSDPHI = GK_SUB(GK_MUL(vSPHI, vCPHI0), GK_MUL(vCPHI, vSPHI0));
+
+			vH = GK_BLEND(vH, vHi, vActive);
+			vCPHI0 = GK_BLEND(vCPHI0, vCPHI, vActive);
+			vSPHI0 = GK_BLEND(vSPHI0, vSPHI, vActive);
+
+			vActive = GK_AND(vActive, GK_CMPGT(GK_MUL(vSDPHI, vSDPHI), vGenau2));
+			if( GK_MOVEMASK(vActive) == 0 )
+				break;
+		}
+
+		GK_V vLat = GK_NAME(gkAtan)(GK_DIV(vSPHI0, GK_ANDNOT(vSignMask, vCPHI0)));
+
+		// the center of the ellipsoid
+		const GK_V vAtCenter = GK_CMPLT(GK_DIV(vRR, vA), vGenau);
+		vLat = GK_BLEND(vLat, GK_SET1(GEOCENTRIC_PIO2), vAtCenter);
+		vH = GK_BLEND(vH, GK_SET1(-gi->Geocent_b), vAtCenter);
+
+		GK_STOREU(x + i, vLon);
+		GK_STOREU(y + i, vLat);
+		GK_STOREU(z + i, vH);
+	}
+	GK_CLEANUP();
+}
@@ -0,0 +1,253 @@
+/******************************************************************************
+ *
+ * Project:  OGR SpatialRef3D
+ * Purpose: process wide memory budget for grid data (vertical raster tiles,
+ *          horizontal grid shift tables), dropping the least recently used
+ *          data once the budget is exceeded
+ * Authors:  Peb Ruswono Aryan, Gottfried Mandlburger, Johannes Otepka
+ *
+ ******************************************************************************
+ * Copyright (c) 2012-2014,  I.P.F., TU Vienna.
+  *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ ****************************************************************************/
+#include "grid_memory.h"
+#include "cpl_conv.h"
+#include "cpl_multiproc.h"
+
+//! number of entries detached under the manager lock at a time
+#define GRID_MEMORY_EVICT_BATCH 64
+
+static void *hMemoryMutex = NULL;		// guards the entry list, pins and nMemoryUsed
+static void *hEvictMutex = NULL;		// serializes eviction runs
+static GridMemoryEntry *poFirstEntry = NULL;	// most recently used entry
+static GridMemoryEntry *poLastEntry = NULL;		// least recently used entry
+static GIntBig nMemoryUsed = 0;
+static GIntBig nMemoryMax = -1;		// read from the configuration on first use
+
+static void InitMemoryMax()
+	/*
+	 * called with hMemoryMutex held
+	 */
+{
+	if( nMemoryMax >= 0 )
+		return;
+
+	nMemoryMax = GRID_MEMORY_MAX;
+	const char *pszMemoryMax = CPLGetConfigOption( "SPATIALREF3D_GRID_MEMORY_MAX", NULL );
+	if( pszMemoryMax != NULL )
+		nMemoryMax = (GIntBig)atoi(pszMemoryMax) * 1024 * 1024;
+}
+
+static void UnlinkEntry(GridMemoryEntry *psEntry)
+	/*
+	 * called with hMemoryMutex held
+	 */
+{
+	if( psEntry->poPrev != NULL )
+		psEntry->poPrev->poNext = psEntry->poNext;
+	else
+		poFirstEntry = psEntry->poNext;
+
+	if( psEntry->poNext != NULL )
+		psEntry->poNext->poPrev = psEntry->poPrev;
+	else
+		poLastEntry = psEntry->poPrev;
+
+	psEntry->poPrev = NULL;
+	psEntry->poNext = NULL;
+	psEntry->bListed = false;
+	nMemoryUsed -= psEntry->nBytes;
+}
+
+static void LinkFirst(GridMemoryEntry *psEntry)
+	/*
+	 * called with hMemoryMutex held, the entry is not linked
+	 */
+{
+	psEntry->poPrev = NULL;
+	psEntry->poNext = poFirstEntry;
+	if( poFirstEntry != NULL )
+		poFirstEntry->poPrev = psEntry;
+	else
+		poLastEntry = psEntry;
+	poFirstEntry = psEntry;
+}
+
+static void MoveFirst(GridMemoryEntry *psEntry)
+	/*
+	 * called with hMemoryMutex held, keeps the list in order of use
+	 */
+{
+	if( !psEntry->bListed || psEntry == poFirstEntry )
+		return;
+
+	psEntry->poPrev->poNext = psEntry->poNext;
+	if( psEntry->poNext != NULL )
+		psEntry->poNext->poPrev = psEntry->poPrev;
+	else
+		poLastEntry = psEntry->poPrev;
+
+	LinkFirst( psEntry );
+}
+
+/************************************************************************/
+/*                          GridMemoryManager                           */
+/************************************************************************/
+
+void
+	GridMemoryManager::InitEntry(GridMemoryEntry *psEntry, GridMemoryClient *poClient, void *pData)
+{
+	psEntry->poClient = poClient;
+	psEntry->pData = pData;
+	psEntry->nBytes = 0;
+	psEntry->nPinCount = 0;
+	psEntry->bListed = false;
+	psEntry->poPrev = NULL;
+	psEntry->poNext = NULL;
+}
+
+void
+	GridMemoryManager::Add(GridMemoryEntry *psEntry, GIntBig nBytes)
+{
+	CPLMutexHolderD( &hMemoryMutex );
+	InitMemoryMax();
+
+	if( psEntry->bListed )
+		UnlinkEntry( psEntry );
+
+	psEntry->nBytes = nBytes;
+	psEntry->bListed = true;
+	LinkFirst( psEntry );
+
+	nMemoryUsed += nBytes;
+}
+
+void
+	GridMemoryManager::Remove(GridMemoryEntry *psEntry)
+{
+	CPLMutexHolderD( &hMemoryMutex );
+
+	if( psEntry->bListed )
+		UnlinkEntry( psEntry );
+}
+
+void
+	GridMemoryManager::Touch(GridMemoryEntry *psEntry)
+{
+	CPLMutexHolderD( &hMemoryMutex );
+
+	MoveFirst( psEntry );
+}
+
+bool
+	GridMemoryManager::Pin(GridMemoryEntry *psEntry)
+{
+	CPLMutexHolderD( &hMemoryMutex );
+
+	psEntry->nPinCount++;
+	MoveFirst( psEntry );
+
+	return psEntry->bListed;
+}
+
+void
+	GridMemoryManager::Unpin(GridMemoryEntry *psEntry)
+{
+	CPLMutexHolderD( &hMemoryMutex );
+
+	psEntry->nPinCount--;
+}
+
+void
+	GridMemoryManager::Enforce()
+	/*
+	 * entries are chosen from the end of the list and detached under 
+	 * hMemoryMutex, their owners free them afterwards so that owner locks
+	 * are never taken while holding hMemoryMutex (owners call Add() and 
+	 * Remove() with their own lock held)
+	 */
+{
+	// cheap test first, most calls find the budget kept
+	if( nMemoryMax >= 0 && nMemoryUsed <= nMemoryMax )
+		return;
+
+	CPLMutexHolderD( &hEvictMutex );
+
+	GridMemoryEntry *apoVictims[GRID_MEMORY_EVICT_BATCH];
+	int nVictims;
+	do {
+		nVictims = 0;
+		{
+			CPLMutexHolderD( &hMemoryMutex );
+			InitMemoryMax();
+
+			GridMemoryEntry *psEntry = poLastEntry;
+			while( psEntry != NULL && nMemoryUsed > nMemoryMax 
+				   && nVictims < GRID_MEMORY_EVICT_BATCH ){
+				GridMemoryEntry *psPrev = psEntry->poPrev;
+
+				if( psEntry->nPinCount == 0 ){
+					UnlinkEntry( psEntry );
+					psEntry->poClient->DetachEntry( psEntry );
+					apoVictims[nVictims++] = psEntry;
+				}
+				psEntry = psPrev;
+			}
+		}
+
+		for( int i = 0; i < nVictims; ++i )
+			apoVictims[i]->poClient->EvictEntry( apoVictims[i] );
+
+	} while( nVictims == GRID_MEMORY_EVICT_BATCH );
+}
+
+void
+	GridMemoryManager::WaitForEvictions()
+{
+	CPLMutexHolderD( &hEvictMutex );
+}
+
+void
+	GridMemoryManager::SetMemoryMax(GIntBig nBytes)
+{
+	{
+		CPLMutexHolderD( &hMemoryMutex );
+		nMemoryMax = nBytes;
+	}
+
+	Enforce();
+}
+
+GIntBig
+	GridMemoryManager::GetMemoryMax()
+{
+	CPLMutexHolderD( &hMemoryMutex );
+	InitMemoryMax();
+
+	return nMemoryMax;
+}
+
+GIntBig
+	GridMemoryManager::GetMemoryUsed()
+{
+	CPLMutexHolderD( &hMemoryMutex );
+
+	return nMemoryUsed;
+}
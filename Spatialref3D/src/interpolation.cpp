@@ -30,6 +30,30 @@
 #include "assert.h"
 #include "interpolation.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  define INTERPOLATION_SSE2
+#  include <emmintrin.h>
+// the AVX kernels are compiled for their target only and run when the CPU has it
+#  if defined(__AVX__) || defined(_MSC_VER) || defined(__clang__) || \
+      (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)))
+#    define INTERPOLATION_AVX
+#    include <immintrin.h>
+#    if defined(_MSC_VER)
+#      include <intrin.h>
+#    endif
+#  endif
+#endif
+
+// the kernels never fuse multiply-adds, so the plain C code must not either
+// when the whole library is built for FMA
+#if defined(__FMA__)
+#  if defined(__clang__)
+#    pragma STDC FP_CONTRACT OFF
+#  elif defined(__GNUC__)
+#    pragma GCC optimize ("fp-contract=off")
+#  endif
+#endif
+
 #define EPSILON 1e-5
 
 double bilinearInterpolation(double p[4], double dx, double dy, double dNoDataValue)
@@ -101,6 +125,366 @@ double bilinearInterpolation(double p[4], double dx, double dy, double dNoDataVa
 	return dSum;
 }
 
+/*
+ * vector versions of bilinearInterpolation(), a nodata neighbor contributes
+ * +0.0 to the sums instead of being skipped, which leaves the sums unchanged,
+ * so every lane computes exactly what the scalar version does.
+ * Cells are double or float32, computations are always done in double.
+ *
+ * bilinear interpolation of float32 value pairs without nodata handling,
+ * the sums are formed in the same order as the scalar tail so vector and
+ * scalar lanes give identical results. With bGradient the derivatives
+ * along the cell fractions and the mixed derivative are computed as well,
+ * padGrad0/1 are planar arrays of 3*nCount values.
+ *
+ * The SSE2 kernels are part of the baseline of every x86-64 build, the AVX
+ * kernels (interpolation_kernel.h) are chosen at run time.
+ */
+
+#if defined(INTERPOLATION_SSE2)
+template<class T>
+static int bilinearBlocksSSE2(int nCount, const T *padData, const int *panOffset,
+						const int *panColStep, const int *panRowStep,
+						const double *padDX, const double *padDY,
+						double dNoDataValue, double *padOut)
+{
+	const __m128d vNoData = _mm_set1_pd(dNoDataValue);
+	const __m128d vEpsilon = _mm_set1_pd(EPSILON);
+	const __m128d vOne = _mm_set1_pd(1.0);
+	const __m128d vAbsMask = _mm_castsi128_pd(_mm_set_epi32(0x7FFFFFFF, -1, 0x7FFFFFFF, -1));
+	int i = 0;
+
+	for (; i + 2 <= nCount; i += 2)
+	{
+		const T *tl0 = padData + panOffset[i];
+		const T *tl1 = padData + panOffset[i+1];
+
+		__m128d p[4];
+		p[0] = _mm_set_pd(tl1[0], tl0[0]);
+		p[1] = _mm_set_pd(tl1[panColStep[i+1]], tl0[panColStep[i]]);
+		p[2] = _mm_set_pd(tl1[panRowStep[i+1]], tl0[panRowStep[i]]);
+		p[3] = _mm_set_pd(tl1[panRowStep[i+1]+panColStep[i+1]], tl0[panRowStep[i]+panColStep[i]]);
+
+		__m128d dx = _mm_loadu_pd(padDX + i);
+		__m128d dy = _mm_loadu_pd(padDY + i);
+		__m128d rx = _mm_sub_pd(vOne, dx);
+		__m128d ry = _mm_sub_pd(vOne, dy);
+
+		__m128d w[4];
+		w[0] = _mm_mul_pd(rx, ry);
+		w[1] = _mm_mul_pd(dx, ry);
+		w[2] = _mm_mul_pd(rx, dy);
+		w[3] = _mm_mul_pd(dx, dy);
+
+		__m128d dSum = _mm_setzero_pd();
+		__m128d dNorm = _mm_setzero_pd();
+		for (int k=0; k<4; ++k)
+		{
+			__m128d vValid = _mm_cmpgt_pd(_mm_and_pd(_mm_sub_pd(p[k], vNoData), vAbsMask), vEpsilon);
+			dSum = _mm_add_pd(dSum, _mm_and_pd(vValid, _mm_mul_pd(p[k], w[k])));
+			dNorm = _mm_add_pd(dNorm, _mm_and_pd(vValid, w[k]));
+		}
+
+		__m128d vPartial = _mm_cmplt_pd(dNorm, vOne);
+		__m128d vResult = _mm_or_pd(_mm_and_pd(vPartial, _mm_div_pd(dSum, dNorm)), _mm_andnot_pd(vPartial, dSum));
+		vResult = _mm_andnot_pd(_mm_cmplt_pd(dNorm, vEpsilon), vResult);
+		_mm_storeu_pd(padOut + i, vResult);
+	}
+
+	return i;
+}
+
+template<bool bGradient>
+static int bilinearPairBlocksSSE2(int nCount, const float *pafPairs, const int *panOffset, int nRowStep,
+						const double *padDX, const double *padDY,
+						double *padOut0, double *padOut1,
+						double *padGrad0, double *padGrad1)
+{
+	const __m128d vOne = _mm_set1_pd(1.0);
+	const int anStep[4] = { 0, 2, 2*nRowStep, 2*nRowStep+2 };
+	int i = 0;
+
+	for (; i + 2 <= nCount; i += 2)
+	{
+		const float *tl0 = pafPairs + 2*panOffset[i];
+		const float *tl1 = pafPairs + 2*panOffset[i+1];
+
+		__m128d p0[4], p1[4];
+		for (int k=0; k<4; ++k)
+		{
+			p0[k] = _mm_set_pd(tl1[anStep[k]], tl0[anStep[k]]);
+			p1[k] = _mm_set_pd(tl1[anStep[k]+1], tl0[anStep[k]+1]);
+		}
+
+		__m128d dx = _mm_loadu_pd(padDX + i);
+		__m128d dy = _mm_loadu_pd(padDY + i);
+		__m128d rx = _mm_sub_pd(vOne, dx);
+		__m128d ry = _mm_sub_pd(vOne, dy);
+
+		__m128d w[4];
+		w[0] = _mm_mul_pd(rx, ry);
+		w[1] = _mm_mul_pd(dx, ry);
+		w[2] = _mm_mul_pd(rx, dy);
+		w[3] = _mm_mul_pd(dx, dy);
+
+		__m128d dSum0 = _mm_mul_pd(w[0], p0[0]);
+		__m128d dSum1 = _mm_mul_pd(w[0], p1[0]);
+		for (int k=1; k<4; ++k)
+		{
+			dSum0 = _mm_add_pd(dSum0, _mm_mul_pd(w[k], p0[k]));
+			dSum1 = _mm_add_pd(dSum1, _mm_mul_pd(w[k], p1[k]));
+		}
+		_mm_storeu_pd(padOut0 + i, dSum0);
+		_mm_storeu_pd(padOut1 + i, dSum1);
+
+		if (bGradient)
+		{
+			__m128d *p[2] = { p0, p1 };
+			double *padGrad[2] = { padGrad0, padGrad1 };
+			for (int k=0; k<2; ++k)
+			{
+				__m128d dTop = _mm_sub_pd(p[k][1], p[k][0]);
+				__m128d dBottom = _mm_sub_pd(p[k][3], p[k][2]);
+				__m128d dLeft = _mm_sub_pd(p[k][2], p[k][0]);
+				__m128d dRight = _mm_sub_pd(p[k][3], p[k][1]);
+				_mm_storeu_pd(padGrad[k] + i, _mm_add_pd(_mm_mul_pd(ry, dTop), _mm_mul_pd(dy, dBottom)));
+				_mm_storeu_pd(padGrad[k] + nCount + i, _mm_add_pd(_mm_mul_pd(rx, dLeft), _mm_mul_pd(dx, dRight)));
+				_mm_storeu_pd(padGrad[k] + 2*nCount + i, _mm_sub_pd(dBottom, dTop));
+			}
+		}
+	}
+
+	return i;
+}
+#endif /* INTERPOLATION_SSE2 */
+
+#if defined(INTERPOLATION_AVX)
+
+#if !defined(__AVX__)
+#  if defined(__clang__)
+#    pragma clang attribute push (__attribute__((target("avx"))), apply_to = function)
+#  elif defined(__GNUC__)
+#    pragma GCC push_options
+#    pragma GCC target("avx")
+#  endif
+#endif
+
+#define IK_NAME(name)	name##AVX
+#define IK_GATHER		0
+#include "interpolation_kernel.h"
+#undef IK_NAME
+#undef IK_GATHER
+
+#if !defined(__AVX__)
+#  if defined(__clang__)
+#    pragma clang attribute pop
+#  elif defined(__GNUC__)
+#    pragma GCC pop_options
+#  endif
+#endif
+
+#if !defined(__AVX2__)
+#  if defined(__clang__)
+#    pragma clang attribute push (__attribute__((target("avx2"))), apply_to = function)
+#  elif defined(__GNUC__)
+#    pragma GCC push_options
+#    pragma GCC target("avx2")
+#  endif
+#endif
+
+#define IK_NAME(name)	name##AVX2
+#define IK_GATHER		1
+#include "interpolation_kernel.h"
+#undef IK_NAME
+#undef IK_GATHER
+
+#if !defined(__AVX2__)
+#  if defined(__clang__)
+#    pragma clang attribute pop
+#  elif defined(__GNUC__)
+#    pragma GCC pop_options
+#  endif
+#endif
+
+#endif /* INTERPOLATION_AVX */
+
+enum InterpolationISA
+{
+	ISA_NONE,
+	ISA_SSE2,
+	ISA_AVX,
+	ISA_AVX2
+};
+
+static InterpolationISA GetInterpolationISA()
+	/*
+	 * widest instruction set supported by the CPU and the operating system,
+	 * chosen once per process; a race between threads only repeats the choice
+	 */
+{
+	static volatile int nISA = -1;
+
+	if (nISA >= 0)
+		return (InterpolationISA)nISA;
+
+	InterpolationISA eISA = ISA_NONE;
+#if defined(INTERPOLATION_SSE2)
+	eISA = ISA_SSE2;
+#endif
+#if defined(INTERPOLATION_AVX)
+#if defined(_MSC_VER)
+	int anInfo[4];
+	__cpuid(anInfo, 1);
+	if ((anInfo[2] & (1 << 27)) != 0 && (anInfo[2] & (1 << 28)) != 0 && (_xgetbv(0) & 6) == 6)
+	{
+		eISA = ISA_AVX;
+		__cpuidex(anInfo, 7, 0);
+		if ((anInfo[1] & (1 << 5)) != 0)
+			eISA = ISA_AVX2;
+	}
+#else
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		eISA = ISA_AVX2;
+	else if (__builtin_cpu_supports("avx"))
+		eISA = ISA_AVX;
+#endif
+#endif
+
+	nISA = eISA;
+	return eISA;
+}
+
+template<class T>
+static void bilinearBatch(int nCount, const T *padData, const int *panOffset,
+						const int *panColStep, const int *panRowStep,
+						const double *padDX, const double *padDY,
+						double dNoDataValue, double *padOut)
+{
+	int i = 0;
+
+	switch (GetInterpolationISA())
+	{
+#if defined(INTERPOLATION_AVX)
+	case ISA_AVX2:
+		i = bilinearBlocksAVX2(nCount, padData, panOffset, panColStep, panRowStep, padDX, padDY, dNoDataValue, padOut);
+		break;
+	case ISA_AVX:
+		i = bilinearBlocksAVX(nCount, padData, panOffset, panColStep, panRowStep, padDX, padDY, dNoDataValue, padOut);
+		break;
+#endif
+#if defined(INTERPOLATION_SSE2)
+	case ISA_SSE2:
+		i = bilinearBlocksSSE2(nCount, padData, panOffset, panColStep, panRowStep, padDX, padDY, dNoDataValue, padOut);
+		break;
+#endif
+	default:
+		break;
+	}
+
+	// remaining points, or all of them without SIMD support
+	for (; i < nCount; ++i)
+	{
+		const T *tl = padData + panOffset[i];
+		double p[4];
+		p[0] = tl[0];
+		p[1] = tl[panColStep[i]];
+		p[2] = tl[panRowStep[i]];
+		p[3] = tl[panRowStep[i]+panColStep[i]];
+		padOut[i] = bilinearInterpolation(p, padDX[i], padDY[i], dNoDataValue);
+	}
+}
+
+void bilinearInterpolationBatch(int nCount, const double *padData, const int *panOffset,
+								const int *panColStep, const int *panRowStep,
+								const double *padDX, const double *padDY,
+								double dNoDataValue, double *padOut)
+{
+	bilinearBatch(nCount, padData, panOffset, panColStep, panRowStep, padDX, padDY, dNoDataValue, padOut);
+}
+
+void bilinearInterpolationBatch(int nCount, const float *pafData, const int *panOffset,
+								const int *panColStep, const int *panRowStep,
+								const double *padDX, const double *padDY,
+								double dNoDataValue, double *padOut)
+{
+	bilinearBatch(nCount, pafData, panOffset, panColStep, panRowStep, padDX, padDY, dNoDataValue, padOut);
+}
+
+template<bool bGradient>
+static void bilinearPairs(int nCount, const float *pafPairs, const int *panOffset, int nRowStep,
+						const double *padDX, const double *padDY,
+						double *padOut0, double *padOut1,
+						double *padGrad0, double *padGrad1)
+{
+	int i = 0;
+
+	switch (GetInterpolationISA())
+	{
+#if defined(INTERPOLATION_AVX)
+	case ISA_AVX2:
+		i = bilinearPairBlocksAVX2<bGradient>(nCount, pafPairs, panOffset, nRowStep, padDX, padDY, padOut0, padOut1, padGrad0, padGrad1);
+		break;
+	case ISA_AVX:
+		i = bilinearPairBlocksAVX<bGradient>(nCount, pafPairs, panOffset, nRowStep, padDX, padDY, padOut0, padOut1, padGrad0, padGrad1);
+		break;
+#endif
+#if defined(INTERPOLATION_SSE2)
+	case ISA_SSE2:
+		i = bilinearPairBlocksSSE2<bGradient>(nCount, pafPairs, panOffset, nRowStep, padDX, padDY, padOut0, padOut1, padGrad0, padGrad1);
+		break;
+#endif
+	default:
+		break;
+	}
+
+	// remaining points, or all of them without SIMD support
+	for (; i < nCount; ++i)
+	{
+		const float *tl = pafPairs + 2*panOffset[i];
+		const float *bl = tl + 2*nRowStep;
+		double rx = 1.0 - padDX[i];
+		double ry = 1.0 - padDY[i];
+		double w00 = rx * ry;
+		double w10 = padDX[i] * ry;
+		double w01 = rx * padDY[i];
+		double w11 = padDX[i] * padDY[i];
+
+		padOut0[i] = w00 * tl[0] + w10 * tl[2] + w01 * bl[0] + w11 * bl[2];
+		padOut1[i] = w00 * tl[1] + w10 * tl[3] + w01 * bl[1] + w11 * bl[3];
+
+		if (bGradient)
+		{
+			double *padGrad[2] = { padGrad0, padGrad1 };
+			for (int k=0; k<2; ++k)
+			{
+				double dTop = (double)tl[k+2] - tl[k];
+				double dBottom = (double)bl[k+2] - bl[k];
+				double dLeft = (double)bl[k] - tl[k];
+				double dRight = (double)bl[k+2] - tl[k+2];
+				padGrad[k][i] = ry * dTop + padDY[i] * dBottom;
+				padGrad[k][nCount + i] = rx * dLeft + padDX[i] * dRight;
+				padGrad[k][2*nCount + i] = dBottom - dTop;
+			}
+		}
+	}
+}
+
+void bilinearPairBatch(int nCount, const float *pafPairs, const int *panOffset, int nRowStep,
+						const double *padDX, const double *padDY,
+						double *padOut0, double *padOut1)
+{
+	bilinearPairs<false>(nCount, pafPairs, panOffset, nRowStep, padDX, padDY, padOut0, padOut1, NULL, NULL);
+}
+
+void bilinearPairGradientBatch(int nCount, const float *pafPairs, const int *panOffset, int nRowStep,
+								const double *padDX, const double *padDY,
+								double *padOut0, double *padOut1,
+								double *padGrad0, double *padGrad1)
+{
+	bilinearPairs<true>(nCount, pafPairs, panOffset, nRowStep, padDX, padDY, padOut0, padOut1, padGrad0, padGrad1);
+}
+
 /*
  * implementation from http://www.paulinternet.nl/?page=bicubic
  * TODO: handle NoDataValue or look in gdalwarp
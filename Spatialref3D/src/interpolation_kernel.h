@@ -0,0 +1,192 @@
+/******************************************************************************
+ *
+ * Project:  OGR SpatialRef3D
+ * Purpose:  AVX bilinear interpolation kernels, included by interpolation.cpp
+ *           once with and once without AVX2 gathers
+ * Authors:  Peb Ruswono Aryan, Gottfried Mandlburger, Johannes Otepka
+ *
+ ******************************************************************************
+ * Copyright (c) 2012-2014,  I.P.F., TU Vienna.
+  *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ ****************************************************************************/
+
+// No include guard: the includer defines IK_NAME() to give the functions of each
+// instruction set their own names and IK_GATHER to load the cells with AVX2
+// gathers (1) or lane by lane (0). The kernels process whole blocks of 4 points
+// and return how many points they did, the rest is left to the plain C code.
+// They never use fused multiply-adds, so every lane computes exactly what the
+// plain C code does.
+
+#if IK_GATHER
+// masked gathers of all lanes, the plain ones start from an undefined register
+static inline __m256d IK_NAME(GatherCells)(const double *padData, __m128i vIndex)
+{
+	return _mm256_mask_i32gather_pd(_mm256_setzero_pd(), padData, vIndex, 
+									_mm256_castsi256_pd(_mm256_set1_epi64x(-1)), 8);
+}
+
+static inline __m256d IK_NAME(GatherCells)(const float *pafData, __m128i vIndex)
+{
+	return _mm256_cvtps_pd(_mm_mask_i32gather_ps(_mm_setzero_ps(), pafData, vIndex, 
+												 _mm_castsi128_ps(_mm_set1_epi32(-1)), 4));
+}
+#endif
+
+template<class T>
+static int IK_NAME(bilinearBlocks)(int nCount, const T *padData, const int *panOffset,
+						const int *panColStep, const int *panRowStep,
+						const double *padDX, const double *padDY,
+						double dNoDataValue, double *padOut)
+{
+	const __m256d vNoData = _mm256_set1_pd(dNoDataValue);
+	const __m256d vEpsilon = _mm256_set1_pd(EPSILON);
+	const __m256d vOne = _mm256_set1_pd(1.0);
+	const __m256d vAbsMask = _mm256_castsi256_pd(_mm256_set1_epi64x(0x7FFFFFFFFFFFFFFFLL));
+	int i = 0;
+
+	for (; i + 4 <= nCount; i += 4)
+	{
+		__m256d p[4];
+#if IK_GATHER
+		__m128i vTL = _mm_loadu_si128((const __m128i*)(panOffset + i));
+		__m128i vTR = _mm_add_epi32(vTL, _mm_loadu_si128((const __m128i*)(panColStep + i)));
+		__m128i vRow = _mm_loadu_si128((const __m128i*)(panRowStep + i));
+		p[0] = IK_NAME(GatherCells)(padData, vTL);
+		p[1] = IK_NAME(GatherCells)(padData, vTR);
+		p[2] = IK_NAME(GatherCells)(padData, _mm_add_epi32(vTL, vRow));
+		p[3] = IK_NAME(GatherCells)(padData, _mm_add_epi32(vTR, vRow));
+#else
+		const T *tl[4];
+		for (int k=0; k<4; ++k)
+			tl[k] = padData + panOffset[i+k];
+		p[0] = _mm256_set_pd(tl[3][0], tl[2][0], tl[1][0], tl[0][0]);
+		p[1] = _mm256_set_pd(tl[3][panColStep[i+3]], tl[2][panColStep[i+2]], 
+							tl[1][panColStep[i+1]], tl[0][panColStep[i]]);
+		p[2] = _mm256_set_pd(tl[3][panRowStep[i+3]], tl[2][panRowStep[i+2]], 
+							tl[1][panRowStep[i+1]], tl[0][panRowStep[i]]);
+		p[3] = _mm256_set_pd(tl[3][panRowStep[i+3]+panColStep[i+3]], tl[2][panRowStep[i+2]+panColStep[i+2]], 
+							tl[1][panRowStep[i+1]+panColStep[i+1]], tl[0][panRowStep[i]+panColStep[i]]);
+#endif
+		__m256d dx = _mm256_loadu_pd(padDX + i);
+		__m256d dy = _mm256_loadu_pd(padDY + i);
+		__m256d rx = _mm256_sub_pd(vOne, dx);
+		__m256d ry = _mm256_sub_pd(vOne, dy);
+
+		__m256d w[4];
+		w[0] = _mm256_mul_pd(rx, ry);
+		w[1] = _mm256_mul_pd(dx, ry);
+		w[2] = _mm256_mul_pd(rx, dy);
+		w[3] = _mm256_mul_pd(dx, dy);
+
+		__m256d dSum = _mm256_setzero_pd();
+		__m256d dNorm = _mm256_setzero_pd();
+		for (int k=0; k<4; ++k)
+		{
+			__m256d vValid = _mm256_cmp_pd(_mm256_and_pd(_mm256_sub_pd(p[k], vNoData), vAbsMask), vEpsilon, _CMP_GT_OQ);
+			dSum = _mm256_add_pd(dSum, _mm256_and_pd(vValid, _mm256_mul_pd(p[k], w[k])));
+			dNorm = _mm256_add_pd(dNorm, _mm256_and_pd(vValid, w[k]));
+		}
+
+		__m256d vResult = _mm256_blendv_pd(dSum, _mm256_div_pd(dSum, dNorm), _mm256_cmp_pd(dNorm, vOne, _CMP_LT_OQ));
+		vResult = _mm256_andnot_pd(_mm256_cmp_pd(dNorm, vEpsilon, _CMP_LT_OQ), vResult);
+		_mm256_storeu_pd(padOut + i, vResult);
+	}
+
+	_mm256_zeroupper();
+	return i;
+}
+
+template<bool bGradient>
+static int IK_NAME(bilinearPairBlocks)(int nCount, const float *pafPairs, const int *panOffset, int nRowStep,
+						const double *padDX, const double *padDY,
+						double *padOut0, double *padOut1,
+						double *padGrad0, double *padGrad1)
+{
+	const __m256d vOne = _mm256_set1_pd(1.0);
+	int i = 0;
+
+	for (; i + 4 <= nCount; i += 4)
+	{
+		__m256d p0[4], p1[4];
+#if IK_GATHER
+		__m128i vTL = _mm_slli_epi32(_mm_loadu_si128((const __m128i*)(panOffset + i)), 1);
+		__m128i vOne32 = _mm_set1_epi32(1);
+		__m128i vIndex[4];
+		vIndex[0] = vTL;
+		vIndex[1] = _mm_add_epi32(vTL, _mm_set1_epi32(2));
+		vIndex[2] = _mm_add_epi32(vTL, _mm_set1_epi32(2*nRowStep));
+		vIndex[3] = _mm_add_epi32(vTL, _mm_set1_epi32(2*nRowStep+2));
+		for (int k=0; k<4; ++k)
+		{
+			p0[k] = IK_NAME(GatherCells)(pafPairs, vIndex[k]);
+			p1[k] = IK_NAME(GatherCells)(pafPairs, _mm_add_epi32(vIndex[k], vOne32));
+		}
+#else
+		const float *tl[4];
+		for (int k=0; k<4; ++k)
+			tl[k] = pafPairs + 2*panOffset[i+k];
+		const int anStep[4] = { 0, 2, 2*nRowStep, 2*nRowStep+2 };
+		for (int k=0; k<4; ++k)
+		{
+			p0[k] = _mm256_set_pd(tl[3][anStep[k]], tl[2][anStep[k]], tl[1][anStep[k]], tl[0][anStep[k]]);
+			p1[k] = _mm256_set_pd(tl[3][anStep[k]+1], tl[2][anStep[k]+1], tl[1][anStep[k]+1], tl[0][anStep[k]+1]);
+		}
+#endif
+		__m256d dx = _mm256_loadu_pd(padDX + i);
+		__m256d dy = _mm256_loadu_pd(padDY + i);
+		__m256d rx = _mm256_sub_pd(vOne, dx);
+		__m256d ry = _mm256_sub_pd(vOne, dy);
+
+		__m256d w[4];
+		w[0] = _mm256_mul_pd(rx, ry);
+		w[1] = _mm256_mul_pd(dx, ry);
+		w[2] = _mm256_mul_pd(rx, dy);
+		w[3] = _mm256_mul_pd(dx, dy);
+
+		__m256d dSum0 = _mm256_mul_pd(w[0], p0[0]);
+		__m256d dSum1 = _mm256_mul_pd(w[0], p1[0]);
+		for (int k=1; k<4; ++k)
+		{
+			dSum0 = _mm256_add_pd(dSum0, _mm256_mul_pd(w[k], p0[k]));
+			dSum1 = _mm256_add_pd(dSum1, _mm256_mul_pd(w[k], p1[k]));
+		}
+		_mm256_storeu_pd(padOut0 + i, dSum0);
+		_mm256_storeu_pd(padOut1 + i, dSum1);
+
+		if (bGradient)
+		{
+			__m256d *p[2] = { p0, p1 };
+			double *padGrad[2] = { padGrad0, padGrad1 };
+			for (int k=0; k<2; ++k)
+			{
+				__m256d dTop = _mm256_sub_pd(p[k][1], p[k][0]);
+				__m256d dBottom = _mm256_sub_pd(p[k][3], p[k][2]);
+				__m256d dLeft = _mm256_sub_pd(p[k][2], p[k][0]);
+				__m256d dRight = _mm256_sub_pd(p[k][3], p[k][1]);
+				_mm256_storeu_pd(padGrad[k] + i, _mm256_add_pd(_mm256_mul_pd(ry, dTop), _mm256_mul_pd(dy, dBottom)));
+				_mm256_storeu_pd(padGrad[k] + nCount + i, _mm256_add_pd(_mm256_mul_pd(rx, dLeft), _mm256_mul_pd(dx, dRight)));
+				_mm256_storeu_pd(padGrad[k] + 2*nCount + i, _mm256_sub_pd(dBottom, dTop));
+			}
+		}
+	}
+
+	_mm256_zeroupper();
+	return i;
+}
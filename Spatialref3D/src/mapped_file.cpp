@@ -0,0 +1,163 @@
+/******************************************************************************
+ *
+ * Project:  OGR SpatialRef3D
+ * Purpose:  read-only memory mapping of grid files on WIN32 and POSIX
+ * Authors:  Peb Ruswono Aryan, Gottfried Mandlburger, Johannes Otepka
+ *
+ ******************************************************************************
+ * Copyright (c) 2012-2014,  I.P.F., TU Vienna.
+  *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ ****************************************************************************/
+#include "mapped_file.h"
+
+#ifdef WIN32
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile() : pabyData(NULL),
+						nSize(0),
+						hFile(NULL),
+						hMapping(NULL)
+{
+}
+
+MappedFile::~MappedFile()
+{
+	Close();
+}
+
+bool
+	MappedFile::Open(const char *pszFilename, bool bOwnerOnly)
+{
+	Close();
+
+#ifdef WIN32
+	HANDLE hNativeFile = CreateFileA( pszFilename, GENERIC_READ, FILE_SHARE_READ, 
+									NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+	if( hNativeFile == INVALID_HANDLE_VALUE )
+		return false;
+
+	LARGE_INTEGER nFileSize;
+	if( !GetFileSizeEx( hNativeFile, &nFileSize ) || nFileSize.QuadPart == 0
+		|| (GUIntBig)nFileSize.QuadPart != (size_t)nFileSize.QuadPart )
+	{
+		CloseHandle( hNativeFile );
+		return false;
+	}
+
+	HANDLE hNativeMapping = CreateFileMappingA( hNativeFile, NULL, PAGE_READONLY, 0, 0, NULL );
+	if( hNativeMapping == NULL )
+	{
+		CloseHandle( hNativeFile );
+		return false;
+	}
+
+	void *pView = MapViewOfFile( hNativeMapping, FILE_MAP_READ, 0, 0, 0 );
+	if( pView == NULL )
+	{
+		CloseHandle( hNativeMapping );
+		CloseHandle( hNativeFile );
+		return false;
+	}
+
+	hFile = hNativeFile;
+	hMapping = hNativeMapping;
+	nSize = (size_t)nFileSize.QuadPart;
+	pabyData = (const GByte *) pView;
+#else
+	int fd = open( pszFilename, O_RDONLY );
+	if( fd < 0 )
+		return false;
+
+	struct stat sStat;
+	if( fstat( fd, &sStat ) != 0 || sStat.st_size == 0
+		|| (bOwnerOnly && sStat.st_uid != geteuid()) )
+	{
+		close( fd );
+		return false;
+	}
+
+	void *pView = mmap( NULL, (size_t)sStat.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+	// the mapping stays valid after the descriptor is closed
+	close( fd );
+
+	if( pView == MAP_FAILED )
+		return false;
+
+	nSize = (size_t)sStat.st_size;
+	pabyData = (const GByte *) pView;
+#endif
+
+	return true;
+}
+
+void
+	MappedFile::Close()
+{
+	if( pabyData == NULL )
+		return;
+
+#ifdef WIN32
+	UnmapViewOfFile( (LPCVOID) pabyData );
+	CloseHandle( (HANDLE) hMapping );
+	CloseHandle( (HANDLE) hFile );
+	hMapping = NULL;
+	hFile = NULL;
+#else
+	munmap( (void *) pabyData, nSize );
+#endif
+
+	pabyData = NULL;
+	nSize = 0;
+}
+
+FILE *
+	MappedFile::CreatePrivate(const char *pszFilename)
+{
+#ifdef WIN32
+	int fd = _open( pszFilename, _O_CREAT | _O_EXCL | _O_WRONLY | _O_BINARY, _S_IREAD | _S_IWRITE );
+	if( fd < 0 )
+		return NULL;
+
+	FILE *fp = _fdopen( fd, "wb" );
+	if( fp == NULL )
+		_close( fd );
+#else
+	// O_EXCL also fails on a dangling symbolic link
+	int fd = open( pszFilename, O_CREAT | O_EXCL | O_WRONLY, S_IRUSR | S_IWUSR );
+	if( fd < 0 )
+		return NULL;
+
+	FILE *fp = fdopen( fd, "wb" );
+	if( fp == NULL )
+		close( fd );
+#endif
+
+	return fp;
+}
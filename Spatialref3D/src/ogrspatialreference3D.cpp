@@ -29,6 +29,8 @@
 #include <iostream>
 
 #include "ogr_spatialref3D.h"
+#include "cpl_atomic_ops.h"
+#include "cpl_multiproc.h"
 
 #define RAD_TO_DEG	57.29577951308232
 #define DEG_TO_RAD	.0174532925199432958
@@ -57,10 +59,9 @@ using namespace std;
 
 OGRSpatialReference3D::OGRSpatialReference3D()
 {
-	GDALAllRegister();
-	
 	bHasGeoid = false;
 	bHasVCorr = false;
+	nVerticalGeneration = 0;
 
 	poGeoid = NULL;
 	poVCorr = NULL;
@@ -71,10 +72,21 @@ OGRSpatialReference3D::OGRSpatialReference3D()
 	is_debug = false;
 	dbg_geoid = NULL;
 	dbg_vcorr = NULL;
+
+	bFuseModels = CSLTestBoolean(CPLGetConfigOption( "SPATIALREF3D_FUSE_VERTICAL", "NO" )) != FALSE;
+	poFused = NULL;
+	nFusedBuilt = 1;
+	hFusedMutex = NULL;
 }
 
 OGRSpatialReference3D::~OGRSpatialReference3D()
 {
+	delete poFused;
+	delete poGeoid;
+	delete poVCorr;
+
+	if(hFusedMutex != NULL)
+		CPLDestroyMutex(hFusedMutex);
 }
 
 OGRErr      
@@ -127,6 +139,7 @@ OGRErr
 void OGRSpatialReference3D::SetVOffset( double  dfVOffset )
 {
 	dfVOffset_ = dfVOffset;
+	UpdateFusedModel();
 }
 
 double OGRSpatialReference3D::GetVOffset ()
@@ -151,16 +164,26 @@ OGRErr OGRSpatialReference3D::SetGeoidModel( const char * pszGeoidModel )
 		delete poGeoid;
 
 	poGeoid = new RasterResampler();
-	poGeoid->Open( pszGeoidModel );
 	//poGeoid = (GDALDataset *) GDALOpen( pszGeoidModel, GA_ReadOnly );
 	
-	if( poGeoid == NULL )
-    {
-        printf("gdal failed - unable to open '%s'.\n",
-                 pszGeoidModel );
+	// reported by RasterResampler::Open()
+	if( poGeoid->Open( pszGeoidModel ) != OGRERR_NONE )
+	{
+		delete poGeoid;
+		poGeoid = NULL;
+
+		// the previous model is gone as well
+		if( bHasGeoid )
+		{
+			bHasGeoid = false;
+			nVerticalGeneration++;
+			UpdateFusedModel();
+		}
 		return OGRERR_FAILURE;
 	}
 	bHasGeoid = true;
+	nVerticalGeneration++;
+	UpdateFusedModel();
 	return OGRERR_NONE;
 }
 
@@ -170,29 +193,181 @@ OGRErr OGRSpatialReference3D::SetVCorrModel( const char * pszVCorrModel )
 		delete poVCorr;
 
 	poVCorr = new RasterResampler();
-	poVCorr->Open( pszVCorrModel );
 
-	if( poVCorr == NULL )
-    {
-        std::cerr << "gdal failed - unable to open '" << pszVCorrModel << "'.\n";
+	// reported by RasterResampler::Open()
+	if( poVCorr->Open( pszVCorrModel ) != OGRERR_NONE )
+	{
+		delete poVCorr;
+		poVCorr = NULL;
+
+		// the previous model is gone as well
+		if( bHasVCorr )
+		{
+			bHasVCorr = false;
+			nVerticalGeneration++;
+			UpdateFusedModel();
+		}
 		return OGRERR_FAILURE;
 	}
 	bHasVCorr = true;
+	nVerticalGeneration++;
+	UpdateFusedModel();
 	return OGRERR_NONE;
 }
 
 OGRErr OGRSpatialReference3D::ApplyVerticalCorrection(int is_inverse, unsigned int point_count, double *x, double *y, double *z)
 {
-	double* dZCorr = (double*)CPLMalloc(sizeof(double)*point_count);
-	double* dZTemp = (double*)CPLMalloc(sizeof(double)*point_count);
+	VerticalScratch oScratch;
+
+	return ApplyVerticalCorrection(is_inverse, point_count, x, y, z, &oScratch);
+}
+
+OGRErr OGRSpatialReference3D::ApplyVerticalCorrection(int is_inverse, unsigned int point_count, double *x, double *y, double *z, 
+													 VerticalScratch *psScratch, int point_offset)
+{
+	// no heights at all rather than heights missing a model
+	if(ValidateVerticalModels() != OGRERR_NONE)
+		return OGRERR_FAILURE;
+
+	psScratch->Reserve(point_count);
+	double* dZCorr = psScratch->padfCorr;
+
+	// debug mode needs the values of the separate models
+	OGRErr eErr;
+	if(!is_debug && GetFusedModel() != NULL)
+		eErr = ComputeFusedCorrection(point_count, x, y, point_offset, psScratch);
+	else
+		eErr = ComputeSeparateCorrection(point_count, x, y, point_offset, dZCorr, psScratch->padfTemp);
+
+	if(eErr != OGRERR_NONE)
+		return eErr;
+
+	for(unsigned int i=0; i<point_count; ++i)
+	{
+		if(is_inverse)
+			z[i*point_offset] -= dZCorr[i];
+		else
+			z[i*point_offset] += dZCorr[i];
+	}
+
+	return OGRERR_NONE;
+}
+
+OGRErr OGRSpatialReference3D::ApplyVerticalDifference(OGRSpatialReference3D *poTarget, unsigned int point_count, double *x, double *y, double *z, 
+													 VerticalScratch *psScratch, int point_offset)
+{
+	if(ValidateVerticalModels() != OGRERR_NONE || poTarget->ValidateVerticalModels() != OGRERR_NONE)
+		return OGRERR_FAILURE;
+
+	// debug mode needs the values of every model, combined rasters are a single lookup already
+	if(is_debug || poTarget->is_debug || GetFusedModel() != NULL || poTarget->GetFusedModel() != NULL){
+		if(HasVerticalModel() && ApplyVerticalCorrection(0, point_count, x, y, z, psScratch, point_offset) != OGRERR_NONE)
+			return OGRERR_FAILURE;
+		if(poTarget->HasVerticalModel())
+			return poTarget->ApplyVerticalCorrection(1, point_count, x, y, z, psScratch, point_offset);
+		return OGRERR_NONE;
+	}
+
+	// the models of a side and its shift only apply if it has a model
+	RasterResampler* apoModels[4];
+	double adfSigns[4];
+	int nModels = 0;
+	double dfOffset = 0.0;
+
+	if(HasVerticalModel()){
+		dfOffset += dfVOffset_;
+		if(HasGeoidModel()){ apoModels[nModels] = poGeoid; adfSigns[nModels++] = 1.0; }
+		if(HasVCorrModel()){ apoModels[nModels] = poVCorr; adfSigns[nModels++] = 1.0; }
+	}
+
+	if(poTarget->HasVerticalModel()){
+		dfOffset -= poTarget->dfVOffset_;
+		RasterResampler* apoTarget[2] = { poTarget->HasGeoidModel() ? poTarget->poGeoid : NULL,
+										  poTarget->HasVCorrModel() ? poTarget->poVCorr : NULL };
+		for(int j=0; j<2; ++j){
+			if(apoTarget[j] == NULL)
+				continue;
+
+			// a raster on both sides cancels out
+			int k = 0;
+			while(k < nModels && !(adfSigns[k] > 0 && EQUAL(apoModels[k]->GetFilename(), apoTarget[j]->GetFilename())))
+				++k;
+
+			if(k < nModels){
+				apoModels[k] = apoModels[nModels-1];
+				adfSigns[k] = adfSigns[nModels-1];
+				--nModels;
+			}
+			else{
+				apoModels[nModels] = apoTarget[j];
+				adfSigns[nModels++] = -1.0;
+			}
+		}
+	}
+
+	if(nModels == 0 && dfOffset == 0.0)
+		return OGRERR_NONE;
+
+	psScratch->Reserve(point_count);
+	double* dZCorr = psScratch->padfCorr;
+	double* dZTemp = psScratch->padfTemp;
+
+	for(unsigned int i=0; i<point_count; ++i)
+		dZCorr[i] = dfOffset;
+
+	for(int k=0; k<nModels; ++k){
+		if(apoModels[k]->GetValueAt(point_count, x, y, dZTemp, point_offset) != OGRERR_NONE)
+			return OGRERR_FAILURE;
+		for(unsigned int i=0; i<point_count; ++i)
+			dZCorr[i] += adfSigns[k] * dZTemp[i];
+	}
+
+	for(unsigned int i=0; i<point_count; ++i)
+		z[i*point_offset] += dZCorr[i];
+
+	return OGRERR_NONE;
+}
+
+OGRErr OGRSpatialReference3D::ComputeFusedCorrection(unsigned int point_count, double *x, double *y, int point_offset, 
+												   VerticalScratch *psScratch)
+{
+	int* panOutside = psScratch->panOutside;
+	int nOutside = poFused->GetValueInside(point_count, x, y, psScratch->padfCorr, panOutside, point_offset);
+	if(nOutside < 0)
+		return OGRERR_FAILURE;
+
+	// points off the composite lattice are looked up in the separate models
+	if(nOutside > 0){
+		double* dXOut = psScratch->padfOutX;
+		double* dYOut = psScratch->padfOutY;
+		double* dZOut = psScratch->padfOutCorr;
+
+		for(int i=0; i<nOutside; ++i){
+			dXOut[i] = x[panOutside[i]*point_offset];
+			dYOut[i] = y[panOutside[i]*point_offset];
+		}
+
+		if(ComputeSeparateCorrection(nOutside, dXOut, dYOut, 1, dZOut, psScratch->padfTemp) != OGRERR_NONE)
+			return OGRERR_FAILURE;
+
+		for(int i=0; i<nOutside; ++i)
+			psScratch->padfCorr[panOutside[i]] = dZOut[i];
+	}
+
+	return OGRERR_NONE;
+}
 
+OGRErr OGRSpatialReference3D::ComputeSeparateCorrection(unsigned int point_count, double *x, double *y, int point_offset, 
+													  double *dZCorr, double *dZTemp)
+{
 	for(unsigned int i=0; i<point_count; ++i){ 
 		dZCorr[i] = dfVOffset_;
 		dZTemp[i] = 0.0;
 	}
 
 	if(HasGeoidModel()){
-		poGeoid->GetValueAt(point_count, x, y, dZTemp);
+		if(poGeoid->GetValueAt(point_count, x, y, dZTemp, point_offset) != OGRERR_NONE)
+			return OGRERR_FAILURE;
 		for(unsigned int i=0; i<point_count; ++i){
 			dZCorr[i] += dZTemp[i];
 
@@ -202,7 +377,8 @@ OGRErr OGRSpatialReference3D::ApplyVerticalCorrection(int is_inverse, unsigned i
 	}
 
 	if(HasVCorrModel()){
-		poVCorr->GetValueAt(point_count, x, y, dZTemp);
+		if(poVCorr->GetValueAt(point_count, x, y, dZTemp, point_offset) != OGRERR_NONE)
+			return OGRERR_FAILURE;
 		for(unsigned int i=0; i<point_count; ++i){
 			dZCorr[i] += dZTemp[i];
 			
@@ -211,17 +387,6 @@ OGRErr OGRSpatialReference3D::ApplyVerticalCorrection(int is_inverse, unsigned i
 		}
 	}
 
-	for(unsigned int i=0; i<point_count; ++i)
-	{
-		if(is_inverse)
-			z[i] -= dZCorr[i];
-		else
-			z[i] += dZCorr[i];
-	}
-
-	CPLFree(dZCorr);
-	CPLFree(dZTemp);
-
 	return OGRERR_NONE;
 }
 
@@ -372,17 +537,140 @@ bool OGRSpatialReference3D::HasVerticalModel()
 	return HasGeoidModel() || HasVCorrModel();
 }
 
+int OGRSpatialReference3D::GetVerticalGeneration()
+{
+	return nVerticalGeneration;
+}
+
+OGRErr OGRSpatialReference3D::ValidateVerticalModels()
+{
+	if(HasGeoidModel() && !poGeoid->IsValid())
+		return OGRERR_FAILURE;
+
+	if(HasVCorrModel() && !poVCorr->IsValid())
+		return OGRERR_FAILURE;
+
+	return OGRERR_NONE;
+}
+
 void OGRSpatialReference3D::SetDebug(bool debug_mode)
 {
 	is_debug = debug_mode;
 }
 
+bool OGRSpatialReference3D::IsDebug()
+{
+	return is_debug;
+}
+
 void OGRSpatialReference3D::SetDebugData(double* geoid_undulation, double* vert_correction)
 {
 	dbg_geoid = geoid_undulation;
 	dbg_vcorr = vert_correction;
 }
 
+void OGRSpatialReference3D::SetFusedModel(bool fused_mode)
+{
+	bFuseModels = fused_mode;
+	UpdateFusedModel();
+}
+
+bool OGRSpatialReference3D::HasFusedModel()
+{
+	return GetFusedModel() != NULL;
+}
+
+void OGRSpatialReference3D::GetGridStats(RasterGridStats *psGeoid, RasterGridStats *psVCorr, RasterGridStats *psFused)
+{
+	RasterResampler *apoModels[3] = { poGeoid, poVCorr, poFused };
+	RasterGridStats *apsStats[3] = { psGeoid, psVCorr, psFused };
+
+	for(int i=0; i<3; ++i){
+		if(apsStats[i] == NULL)
+			continue;
+
+		if(apoModels[i] != NULL)
+			apoModels[i]->GetStats(apsStats[i]);
+		else
+			memset(apsStats[i], 0, sizeof(RasterGridStats));
+	}
+}
+
+void OGRSpatialReference3D::ResetGridStats()
+{
+	if(poGeoid != NULL)
+		poGeoid->ResetStats();
+	if(poVCorr != NULL)
+		poVCorr->ResetStats();
+	if(poFused != NULL)
+		poFused->ResetStats();
+}
+
+void OGRSpatialReference3D::UpdateFusedModel()
+{
+	CPLMutexHolderD( &hFusedMutex );
+
+	delete poFused;
+	poFused = NULL;
+	nFusedBuilt = 0;
+}
+
+RasterResampler* OGRSpatialReference3D::GetFusedModel()
+{
+	// built on the first correction, so the models are not read before they are needed
+	// adding 0 is a full barrier, so poFused is complete once the flag is seen set
+	if(CPLAtomicAdd(&nFusedBuilt, 0) == 0){
+		CPLMutexHolderD( &hFusedMutex );
+
+		if(nFusedBuilt == 0){
+			if(bFuseModels && HasGeoidModel() && HasVCorrModel())
+				poFused = RasterResampler::CreateComposite(poGeoid, poVCorr, dfVOffset_);
+			CPLAtomicInc(&nFusedBuilt);
+		}
+	}
+
+	return poFused;
+}
+
+
+/************************************************************************/
+/*                           VerticalScratch                            */
+/************************************************************************/
+
+VerticalScratch::VerticalScratch()
+{
+	nSize = 0;
+	padfCorr = NULL;
+	padfTemp = NULL;
+	padfOutX = NULL;
+	padfOutY = NULL;
+	padfOutCorr = NULL;
+	panOutside = NULL;
+}
+
+VerticalScratch::~VerticalScratch()
+{
+	CPLFree(padfCorr);
+	CPLFree(padfTemp);
+	CPLFree(padfOutX);
+	CPLFree(padfOutY);
+	CPLFree(padfOutCorr);
+	CPLFree(panOutside);
+}
+
+void VerticalScratch::Reserve(int nCount)
+{
+	if(nCount <= nSize)
+		return;
+
+	padfCorr = (double*)CPLRealloc(padfCorr, sizeof(double)*nCount);
+	padfTemp = (double*)CPLRealloc(padfTemp, sizeof(double)*nCount);
+	padfOutX = (double*)CPLRealloc(padfOutX, sizeof(double)*nCount);
+	padfOutY = (double*)CPLRealloc(padfOutY, sizeof(double)*nCount);
+	padfOutCorr = (double*)CPLRealloc(padfOutCorr, sizeof(double)*nCount);
+	panOutside = (int*)CPLRealloc(panOutside, sizeof(int)*nCount);
+	nSize = nCount;
+}
 
 CPL_DLL OGRCoordinateTransformation3D::OGRCoordinateTransformation3D()
 {
@@ -28,282 +28,382 @@
  ****************************************************************************/
 #include "res_manager.h"
 #include "cpl_port.h"
-#include "interpolation.h"
-#include <iostream>
-
-#define RAD_TO_DEG	57.29577951308232
-#define MAXINT 9999999
-#define MAXEXTENT 1024		// maximum window size
-
-#define INSIDE(x,y,l,t,w,h) (x>=l && x<=l+w && y>=t && y<=t+h)
-
-RasterResampler::RasterResampler() : bIsSmall(false), 
-									nRasterWidth(0), 
-									nRasterHeight(0),
-									nWndXOffset(0),
-									nWndYOffset(0),
-									nWndWidth(0),
-									nWndHeight(0)
+#include "cpl_atomic_ops.h"
+#include "cpl_multiproc.h"
+#include <algorithm>
+
+RasterResampler::RasterResampler()
 {
-	padWindow = NULL;
-	poData = NULL;
+	poGrid = NULL;
+	nOpenTried = 1;
+	hOpenMutex = NULL;
+	nPendingCacheMax = -1;
+	hScratchMutex = NULL;
+	poFreeScratch = NULL;
 }
 
 RasterResampler::~RasterResampler()
 {
-	Cleanup();
+	VerticalGrid::Release(poGrid);
+
+	while (poFreeScratch != NULL){
+		RasterScratch *psScratch = poFreeScratch;
+		poFreeScratch = psScratch->poNext;
+
+		CPLFree(psScratch->panIndex);
+		CPLFree(psScratch->pasSortKeys);
+		CPLFree(psScratch->pasKeys);
+		CPLFree(psScratch->padLine);
+		CPLFree(psScratch->padPixel);
+		delete psScratch;
+	}
+
+	if (hScratchMutex != NULL)
+		CPLDestroyMutex(hScratchMutex);
 
-	if(poData != NULL)
-		GDALClose(poData);
+	if (hOpenMutex != NULL)
+		CPLDestroyMutex(hOpenMutex);
 }
 
 double
 	RasterResampler::GetValueAt(double x, double y)
 {
+	if (GetGrid() == NULL)
+		return 0.0;
+
 	double dPixel = x;
 	double dLine = y;
-	MapToRaster(&dPixel, &dLine);
+	poGrid->MapToRaster(&dPixel, &dLine);
 
-	// check if buffer not initialized or point not inside current window
-	// naive caching strategy
-	if (padWindow == NULL 
-				|| !INSIDE((int)dPixel, (int)dLine, nWndXOffset, nWndYOffset, nWndWidth, nWndHeight)){
+	bool bInside = dPixel >= 0.0 && dPixel < poGrid->GetWidth() && dLine >= 0.0 && dLine < poGrid->GetHeight();
+	poGrid->AddLookups(1, bInside ? 0 : 1);
 
-		int nWndLeft = MAX(0, MIN(nRasterWidth-2, (int)dPixel-MAXEXTENT/2));
-		int nWndTop = MAX(0, MIN(nRasterHeight-2, (int)dLine-MAXEXTENT/2));
+	return poGrid->GetValue(dPixel, dLine);
+}
 
-		//std::cout << "sample window (" << nWndLeft << " " << nWndTop << ")";
-		//std::cout << " of (" << nRasterWidth << ", " << nRasterHeight << ")" << std::endl;
+OGRErr
+	RasterResampler::GetValueAt(int point_count, double *x, double *y, double *z, int point_offset)
+{
+	if (LookupBatch(point_count, x, y, z, NULL, point_offset) < 0 || poGrid == NULL)
+		return OGRERR_FAILURE;
+	return OGRERR_NONE;
+}
 
-		Request(nWndLeft, nWndTop, MAXEXTENT, MAXEXTENT);
-	}
-	return GetValueResampled(dPixel, dLine);
+int
+	RasterResampler::GetValueInside(int point_count, double *x, double *y, double *z, int *panOutside, int point_offset)
+{
+	return LookupBatch(point_count, x, y, z, panOutside, point_offset);
 }
 
-void
-	RasterResampler::GetValueAt(int point_count, double *x, double *y, double *z)
+RasterResampler *
+	RasterResampler::CreateComposite(RasterResampler *poFirst, RasterResampler *poSecond, double dfOffset)
 {
-	// dummy naive approach (tested)
-	if (point_count==1)
-	{
-		z[0] = GetValueAt(x[0], y[0]); 
-		return;
-	}
-	//for(int i=0; i<point_count; ++i) z[i] = GetValueAt(x[i], y[i]); return;
-	//
-	// indexed (TESTED ON SMALL window ONLY)
-	double* padX = (double*)CPLMalloc(sizeof(double)*point_count);
-	double* padY = (double*)CPLMalloc(sizeof(double)*point_count);
-
-	double dXMin = MAXINT;
-	double dYMin = MAXINT;
-	double dXMax = -MAXINT;
-	double dYMax = -MAXINT;
-
-	// convert all point's coordinate
-	// from map coordinate to 
-	// raster coordinate
-	for(int i=0; i<point_count; ++i){
-		double px = x[i];
-		double py = y[i];
+	if (poFirst->GetGrid() == NULL || poSecond->GetGrid() == NULL)
+		return NULL;
+
+	VerticalGrid *poComposite = VerticalGrid::CreateComposite(poFirst->poGrid, poSecond->poGrid, 
+															dfOffset, RESAMPLER_COMPOSITE_MAX_CELLS);
+	if (poComposite == NULL)
+		return NULL;
 
-		MapToRaster(&px, &py);
+	RasterResampler *poResampler = new RasterResampler();
+	poResampler->poGrid = poComposite;
+	poResampler->nOpenTried = 1;
+	poResampler->sFilename = poComposite->GetFilename();
 
-		padX[i] = px;
-		padY[i] = py;
+	return poResampler;
+}
 
-		dXMin = MIN(dXMin, px);
-		dYMin = MIN(dYMin, py);
-		dXMax = MAX(dXMax, px);
-		dYMax = MAX(dYMax, py);
+int
+	RasterResampler::LookupBatch(int point_count, double *x, double *y, double *z, int *panOutside, int point_offset)
+/*
+ * points are visited tile by tile (in Morton order of the tiles) so that
+ * every tile is fetched once per batch, results are written back in input order.
+ * With panOutside points outside the cell center hull or next to a nodata cell
+ * are skipped and listed there. Returns -1 if a tile could not be read.
+ */
+{
+	if (GetGrid() == NULL){
+		for(int i=0; i<point_count; ++i){
+			if (panOutside != NULL)
+				panOutside[i] = i;
+			else
+				z[i] = 0.0;
+		}
+		return (panOutside != NULL) ? point_count : 0;
 	}
 
-	double dWidth = ceil(dXMax)-floor(dXMin);
-	double dHeight = ceil(dYMax)-floor(dYMin);
+	if (point_count <= 0)
+		return 0;
 
-	if (bIsSmall || (dWidth < MAXEXTENT && dHeight < MAXEXTENT)){
-		// do it in single patch
-		// use naive approach embedded in single point interface
-		int drwLeft = MAX(0, MIN(nRasterWidth-2, (int)dXMin));
-		int drwTop = MAX(0, MIN(nRasterHeight-2,(int)dYMin));
-		
-		// TODO: add checking to window boundary against raster boundary
-		Request(drwLeft, drwTop, (int)dWidth+1, (int)dHeight+1);
+	RasterScratch *psScratch = AcquireScratch(point_count);
+	double *padPixel = psScratch->padPixel;
+	double *padLine = psScratch->padLine;
+	RasterPointKey *pasKeys = psScratch->pasKeys;
+	int *panIndex = psScratch->panIndex;
 
-		for(int i=0; i<point_count; ++i){
-			z[i] = GetValueResampled(padX[i], padY[i]);
+	// without panOutside the last row and column are extended up to the 
+	// raster edge, with panOutside only the cell center hull is inside
+	double dMaxPixel = poGrid->GetWidth() - ((panOutside != NULL) ? 1 : 0);
+	double dMaxLine = poGrid->GetHeight() - ((panOutside != NULL) ? 1 : 0);
+	int nOutside = 0;
+	int nMissed = 0;
+	bool bFailed = false;
+
+	bool bSorted = true;
+	for(int i=0; i<point_count; ++i){
+		padPixel[i] = x[i*point_offset];
+		padLine[i] = y[i*point_offset];
+		poGrid->MapToRaster(&padPixel[i], &padLine[i]);
+
+		// points outside the raster go last, into a bucket of their own
+		bool bInside = (panOutside != NULL) 
+			? (padPixel[i] >= 0.0 && padPixel[i] <= dMaxPixel && padLine[i] >= 0.0 && padLine[i] <= dMaxLine
+				&& !poGrid->TouchesNoData(padPixel[i], padLine[i]))
+			: (padPixel[i] >= 0.0 && padPixel[i] < dMaxPixel && padLine[i] >= 0.0 && padLine[i] < dMaxLine);
+
+		if (bInside)
+			pasKeys[i].nKey = MortonCode((int)padPixel[i] / RESAMPLER_TILE_SIZE, 
+										(int)padLine[i] / RESAMPLER_TILE_SIZE);
+		else{
+			pasKeys[i].nKey = ~(GUIntBig)0;
+			nMissed++;
+			if (panOutside != NULL)
+				panOutside[nOutside++] = i;
 		}
+		pasKeys[i].nIndex = i;
+
+		if (i > 0 && pasKeys[i].nKey < pasKeys[i-1].nKey)
+			bSorted = false;
 	}
-	else{
-		// both raster and window size not small enough to be all in memory
-		// do it by window patch
-		bool* panIdx = (bool*)CPLMalloc(sizeof(bool)*point_count);
-		int unprocessed_count = point_count;	// # of point unprocessed
-
-		for(int i=0; i<point_count; ++i)
-				panIdx[i] = false;
-		
-		while(unprocessed_count < point_count){
-			//initialize next cache
-			for(int i=0; i<point_count; ++i){
-				if(!panIdx[i]){
-					if (padWindow == NULL){
-				
-						int nWndLeft = MAX(0, MIN(nRasterWidth-2, (int)padX[i]-MAXEXTENT/2));
-						int nWndTop = MAX(0, MIN(nRasterWidth-2, (int)padY[i]-MAXEXTENT/2));
-
-						//std::cout << nWndLeft << " " << nWndTop << std::endl;
-
-						Request(nWndLeft, nWndTop, MAXEXTENT, MAXEXTENT);
-					}
-
-					break;
-				}
-			}
 
-			// process all applicable points
-			for(int i=0; i<point_count; ++i){
-				// skip processed points or points outside current cache window
-				if(panIdx[i]
-					|| !INSIDE((int)floor(padX[i]), (int)floor(padY[i]), nWndXOffset, nWndYOffset, nWndWidth-1, nWndHeight-1)) //add floor and -1
-						continue;
+	// stable order keeps the points of one tile in input order
+	if (!bSorted)
+		pasKeys = SortKeys(pasKeys, psScratch->pasSortKeys, point_count);
+
+	for(int i=0; i<point_count; ++i)
+		panIndex[i] = pasKeys[i].nIndex;
+
+	// hand the points of one tile to the grid at once
+	int i = 0;
+	int nInside = point_count - nOutside;
+	while (i < nInside){
+		int nFirst = i;
+		do {
+			++i;
+		} while (i < point_count && pasKeys[i].nKey == pasKeys[nFirst].nKey);
+
+		int nCount = i - nFirst;
+		int *panRun = panIndex + nFirst;
+		if (!poGrid->GetValues(nCount, panRun, padPixel, padLine, z))
+			bFailed = true;
+	}
 
-				z[i] = GetValueResampled(padX[i], padY[i]);
+	ReleaseScratch(psScratch);
+	poGrid->AddLookups(point_count, nMissed);
+
+	return bFailed ? -1 : nOutside;
+}
 
-				panIdx[i] = true;	// mark processed
-				unprocessed_count += 1;
+GUIntBig
+	RasterResampler::MortonCode(int nTileX, int nTileY)
+/*
+ * interleave the bits of the tile column and row, neighboring tiles get close codes
+ */
+{
+	GUIntBig nCode = 0;
+	for(int nBit=0; nBit<31; ++nBit){
+		nCode |= (GUIntBig)((nTileX >> nBit) & 1) << (2*nBit);
+		nCode |= (GUIntBig)((nTileY >> nBit) & 1) << (2*nBit+1);
+	}
+	return nCode;
+}
+
+RasterPointKey *
+	RasterResampler::SortKeys(RasterPointKey *pasKeys, RasterPointKey *pasTemp, int nCount)
+/*
+ * bottom-up merge sort, runs of 32 keys are insertion sorted in place first.
+ * Equal keys never pass each other, so the points of a tile stay in input order.
+ */
+{
+	const int nRun = 32;
+
+	for(int nStart=0; nStart<nCount; nStart+=nRun){
+		int nEnd = std::min(nStart + nRun, nCount);
+		for(int i=nStart+1; i<nEnd; ++i){
+			RasterPointKey sKey = pasKeys[i];
+			int j = i;
+			while (j > nStart && sKey.nKey < pasKeys[j-1].nKey){
+				pasKeys[j] = pasKeys[j-1];
+				--j;
 			}
-		}// endwhile
-		
-		CPLFree(panIdx);
+			pasKeys[j] = sKey;
+		}
 	}
 
-	CPLFree(padX);
-	CPLFree(padY);
+	RasterPointKey *pasSrc = pasKeys;
+	RasterPointKey *pasDst = pasTemp;
+	for(int nWidth=nRun; nWidth<nCount; nWidth*=2){
+		for(int nLeft=0; nLeft<nCount; nLeft+=2*nWidth){
+			int nMid = std::min(nLeft + nWidth, nCount);
+			int nRight = std::min(nLeft + 2*nWidth, nCount);
+			int i = nLeft, j = nMid, k = nLeft;
+
+			while (i < nMid && j < nRight)
+				pasDst[k++] = (pasSrc[j].nKey < pasSrc[i].nKey) ? pasSrc[j++] : pasSrc[i++];
+			while (i < nMid)
+				pasDst[k++] = pasSrc[i++];
+			while (j < nRight)
+				pasDst[k++] = pasSrc[j++];
+		}
+		std::swap(pasSrc, pasDst);
+	}
+
+	return pasSrc;
 }
 
 OGRErr
 	RasterResampler::Open(const char *pszFilename)
+	/*
+	 * opening is deferred to GetGrid(), so spatial references whose
+	 * height models are never used do not pay for reading them
+	 */
 {
 	sFilename = pszFilename;
-	poData = (GDALDataset *) GDALOpen( pszFilename, GA_ReadOnly );
-	
-	if( poData == NULL )
-    {
-        printf("gdal failed - unable to open '%s'.\n",
-                 pszFilename );
+
+	VerticalGrid::Release(poGrid);
+	poGrid = NULL;
+
+	VSIStatBufL sStat;
+	if (VSIStatL(pszFilename, &sStat) != 0){
+		CPLError(CE_Failure, CPLE_OpenFailed, 
+				 "Unable to open height model '%s'.", pszFilename);
+		nOpenTried = 1;
 		return OGRERR_FAILURE;
 	}
 
-	Prepare();
+	nOpenTried = 0;
 	return OGRERR_NONE;
 }
 
+VerticalGrid *
+	RasterResampler::GetGrid()
+{
+	// adding 0 is a full barrier, so poGrid is complete once the flag is seen set
+	if (CPLAtomicAdd(&nOpenTried, 0) == 0){
+		CPLMutexHolderD( &hOpenMutex );
+
+		// another thread may have opened it while we waited
+		if (nOpenTried == 0){
+			poGrid = VerticalGrid::Acquire(sFilename);
+			if (poGrid == NULL)
+				CPLError(CE_Failure, CPLE_OpenFailed, 
+						 "Unable to read height model '%s', no height correction can be applied with it.", 
+						 sFilename.c_str());
+			else if (nPendingCacheMax >= 0)
+				poGrid->SetCacheMax(nPendingCacheMax);
+			CPLAtomicInc(&nOpenTried);
+		}
+	}
+
+	return poGrid;
+}
+
+bool
+	RasterResampler::IsValid()
+{
+	return GetGrid() != NULL;
+}
+
 const char*
 	RasterResampler::GetFilename()
 {
 	return sFilename;
 }
 
-double
-	RasterResampler::GetValueResampled(double x, double y)
-/*
- * x and y is assumed to be in raster coordinate (not buffer window coordinate)
- */
+void
+	RasterResampler::SetCacheMax(GIntBig nBytes)
 {
-	int px = (int)floor(x);
-	int py = (int)floor(y);
+	CPLMutexHolderD( &hOpenMutex );
 
-	// Boundary checking
-	if (px < 0 || py < 0 || px >= nRasterWidth || py >= nRasterHeight){
-		std::cerr << "point (" << px << "," << py << ") outside raster." << "(" << nRasterWidth << ", " << nRasterHeight<< ")" << std::endl;
-		return 0.0;
-		//throw std::exception( "point outside raster." );
-	}
-	else {
-		double dx = x - px;
-		double dy = y - py;
-
-		// TODO: accomodate neigbor acquisition as required by other interpolation function (e.g. bicubic)
-		// acquire neighbors
-		int offset = (py-nWndYOffset)*nWndWidth+(px-nWndXOffset);
-		double p[4];
-		p[0] = padWindow[offset];
-		p[1] = padWindow[offset+1];
-
-		offset += nWndWidth;
-		p[2] = padWindow[offset];
-		p[3] = padWindow[offset+1];
-
-		return bilinearInterpolation(p, dx, dy, dNoDataValue);
+	// applied when the grid gets opened
+	if (nOpenTried == 0)
+		nPendingCacheMax = nBytes;
+	else if (poGrid != NULL)
+		poGrid->SetCacheMax(nBytes);
+}
+
+GIntBig
+	RasterResampler::GetCacheMax()
+{
+	{
+		CPLMutexHolderD( &hOpenMutex );
+
+		if (nOpenTried == 0 && nPendingCacheMax >= 0)
+			return nPendingCacheMax;
 	}
 
-	return 0.0;
+	return (GetGrid() != NULL) ? poGrid->GetCacheMax() : 0;
 }
 
 void
-	RasterResampler::Cleanup()
+	RasterResampler::GetStats(RasterGridStats *psStats)
 {
-	if(padWindow != NULL)
-		CPLFree(padWindow);
-	padWindow = NULL;
+	if (poGrid != NULL)
+		poGrid->GetStats(psStats);
+	else
+		memset(psStats, 0, sizeof(RasterGridStats));
 }
 
 void
-	RasterResampler::Prepare()
-	/*
-	 * get metadata information from raster file
-	 */
+	RasterResampler::ResetStats()
 {
-	nRasterWidth = poData->GetRasterXSize();
-    nRasterHeight = poData->GetRasterYSize();
-	bIsSmall = (nRasterWidth < MAXEXTENT) && (nRasterHeight < MAXEXTENT);
-
-	dNoDataValue = poData->GetRasterBand(1)->GetNoDataValue();
-	double geotrans[6];
-    poData->GetGeoTransform(geotrans);
-
-	if( GDALInvGeoTransform( geotrans, dInvGeotrans ) == 0 )
-      throw std::exception( "inversion of geo transformation failed." );
+	if (poGrid != NULL)
+		poGrid->ResetStats();
 }
 
-void
-	RasterResampler::Request(int left, int top, int width, int height)
+RasterScratch *
+	RasterResampler::AcquireScratch(int nCount)
 	/*
-	 * Access pixel data from raster file to temporary buffer (padWindow)
+	 * take a scratch buffer set from the free list (or make a new one) and
+	 * grow it to hold nCount points, each concurrent batch uses its own set
 	 */
 {
-	//std::cout << "window request " << left << " " << top << " " << left+width << " " << top+height << std::endl;
-
-	nWndXOffset = left;
-	nWndYOffset = top;
-	nWndWidth = MIN(nRasterWidth-left, width);
-	nWndHeight = MIN(nRasterHeight-top, height);
+	RasterScratch *psScratch = NULL;
+	{
+		CPLMutexHolderD( &hScratchMutex );
+		if (poFreeScratch != NULL){
+			psScratch = poFreeScratch;
+			poFreeScratch = psScratch->poNext;
+		}
+	}
 
-	//std::cout << "window given " << left << " " << top << " " << left+nWndWidth << " " << top+nWndHeight << std::endl;
-	
-	Cleanup();
+	if (psScratch == NULL){
+		psScratch = new RasterScratch;
+		psScratch->nSize = 0;
+		psScratch->padPixel = NULL;
+		psScratch->padLine = NULL;
+		psScratch->pasKeys = NULL;
+		psScratch->pasSortKeys = NULL;
+		psScratch->panIndex = NULL;
+	}
 
-	int nWndArea = width*height;
-	padWindow = (double *) CPLMalloc(sizeof(double)*nWndArea);
+	if (nCount > psScratch->nSize){
+		psScratch->padPixel = (double*) CPLRealloc(psScratch->padPixel, sizeof(double)*nCount);
+		psScratch->padLine = (double*) CPLRealloc(psScratch->padLine, sizeof(double)*nCount);
+		psScratch->pasKeys = (RasterPointKey*) CPLRealloc(psScratch->pasKeys, sizeof(RasterPointKey)*nCount);
+		psScratch->pasSortKeys = (RasterPointKey*) CPLRealloc(psScratch->pasSortKeys, sizeof(RasterPointKey)*nCount);
+		psScratch->panIndex = (int*) CPLRealloc(psScratch->panIndex, sizeof(int)*nCount);
+		psScratch->nSize = nCount;
+	}
 
-	poData->RasterIO( GF_Read, 
-						nWndXOffset, nWndYOffset, nWndWidth, nWndHeight, 
-                        padWindow, nWndWidth, nWndHeight, GDT_Float64, 
-                        1, NULL, 0, 0, 0 );
+	return psScratch;
 }
 
-void 
-	RasterResampler::MapToRaster(double *x, double *y)
-	/* 
-	 * converts map coordinate (radian) to raster coordinate (pixels)
-	 */
+void
+	RasterResampler::ReleaseScratch(RasterScratch *psScratch)
 {
-	*(x) = -0.5+dInvGeotrans[0]+ 
-          + *(x) * dInvGeotrans[1] * RAD_TO_DEG
-          + *(y) * dInvGeotrans[2] * RAD_TO_DEG;
-
-    *(y) = -0.5+dInvGeotrans[3]
-          + *(x) * dInvGeotrans[4] * RAD_TO_DEG
-          + *(y) * dInvGeotrans[5] * RAD_TO_DEG;
-}
\ No newline at end of file
+	CPLMutexHolderD( &hScratchMutex );
+	psScratch->poNext = poFreeScratch;
+	poFreeScratch = psScratch;
+}
@@ -0,0 +1,169 @@
+/******************************************************************************
+ *
+ * Project:  OGR SpatialRef3D
+ * Purpose: persistent pool of worker threads running the chunks of a
+ *          coordinate transformation batch
+ * Authors:  Peb Ruswono Aryan, Gottfried Mandlburger, Johannes Otepka
+ *
+ ******************************************************************************
+ * Copyright (c) 2012-2014,  I.P.F., TU Vienna.
+  *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ ****************************************************************************/
+#include "transform_pool.h"
+#include "cpl_conv.h"
+#include "cpl_string.h"
+#include "cpl_multiproc.h"
+
+struct TransformBatch
+{
+	TransformTaskFunc pfnTask;
+	void **papArgs;
+	int nTasks;
+	int nNext;		// next task to hand out
+	int nDone;		// tasks finished
+
+	TransformBatch *poNext;	// next batch in the queue
+};
+
+static void *hPoolMutex = NULL;		// guards the queue and the thread count
+static void *hPoolCond = NULL;		// signalled on new tasks and finished batches
+static TransformBatch *poFirstBatch = NULL;
+static TransformBatch *poLastBatch = NULL;
+static int nPoolThreads = 0;
+
+static TransformBatch *NextBatch()
+	/*
+	 * called with hPoolMutex held, returns the oldest batch with tasks left
+	 */
+{
+	for( TransformBatch *poBatch = poFirstBatch; poBatch != NULL; poBatch = poBatch->poNext )
+	{
+		if( poBatch->nNext < poBatch->nTasks )
+			return poBatch;
+	}
+	return NULL;
+}
+
+static void RunTask(TransformBatch *poBatch)
+	/*
+	 * called with hPoolMutex held, takes the next task of poBatch and 
+	 * runs it without the lock
+	 */
+{
+	int iTask = poBatch->nNext++;
+
+	CPLReleaseMutex( hPoolMutex );
+	poBatch->pfnTask( poBatch->papArgs[iTask] );
+	CPLAcquireMutex( hPoolMutex, 1000.0 );
+
+	if( ++poBatch->nDone == poBatch->nTasks )
+		CPLCondBroadcast( hPoolCond );
+}
+
+static void WorkerMain(void *)
+{
+	CPLAcquireMutex( hPoolMutex, 1000.0 );
+	for( ;; )
+	{
+		TransformBatch *poBatch = NextBatch();
+		if( poBatch == NULL )
+		{
+			CPLCondWait( hPoolCond, hPoolMutex );
+			continue;
+		}
+		RunTask( poBatch );
+	}
+}
+
+void TransformWorkerPool::Run(int nTasks, TransformTaskFunc pfnTask, void **papArgs)
+{
+	if( nTasks <= 0 )
+		return;
+
+	if( nTasks == 1 )
+	{
+		pfnTask( papArgs[0] );
+		return;
+	}
+
+	{
+		CPLMutexHolderD( &hPoolMutex );
+		if( hPoolCond == NULL )
+			hPoolCond = CPLCreateCond();
+	}
+
+	TransformBatch oBatch;
+	oBatch.pfnTask = pfnTask;
+	oBatch.papArgs = papArgs;
+	oBatch.nTasks = nTasks;
+	oBatch.nNext = 0;
+	oBatch.nDone = 0;
+	oBatch.poNext = NULL;
+
+	CPLAcquireMutex( hPoolMutex, 1000.0 );
+
+	if( poLastBatch != NULL )
+		poLastBatch->poNext = &oBatch;
+	else
+		poFirstBatch = &oBatch;
+	poLastBatch = &oBatch;
+
+	// the pool grows to the largest batch, batches running at once share it
+	while( nPoolThreads < nTasks - 1 )
+	{
+		if( CPLCreateThread( WorkerMain, NULL ) < 0 )
+			break;
+		nPoolThreads++;
+	}
+	CPLCondBroadcast( hPoolCond );
+
+	while( oBatch.nNext < oBatch.nTasks )
+		RunTask( &oBatch );
+
+	while( oBatch.nDone < oBatch.nTasks )
+		CPLCondWait( hPoolCond, hPoolMutex );
+
+	// unlink the batch
+	TransformBatch *poPrev = NULL;
+	for( TransformBatch *poBatch = poFirstBatch; poBatch != &oBatch; poBatch = poBatch->poNext )
+		poPrev = poBatch;
+	if( poPrev != NULL )
+		poPrev->poNext = oBatch.poNext;
+	else
+		poFirstBatch = oBatch.poNext;
+	if( poLastBatch == &oBatch )
+		poLastBatch = poPrev;
+
+	CPLReleaseMutex( hPoolMutex );
+}
+
+int TransformWorkerPool::ParseThreadCount(const char *pszValue)
+{
+	if( pszValue == NULL )
+		return 1;
+
+	int nThreads;
+	if( EQUAL(pszValue, "ALL_CPUS") )
+		nThreads = CPLGetNumCPUs();
+	else
+		nThreads = atoi(pszValue);
+
+	return (nThreads < 1) ? 1 : nThreads;
+}
@@ -0,0 +1,1210 @@
+/******************************************************************************
+ *
+ * Project:  OpenGIS Simple Features Reference Implementation
+ * Purpose:  Classes for manipulating spatial reference systems with 
+ *           vetical datum support in a platform non-specific manner.
+ * Authors:  Peb Ruswono Aryan, Gottfried Mandlburger, Johannes Otepka
+ *
+ ******************************************************************************
+ * Copyright (c) 2012-2014,  I.P.F., TU Vienna.
+  *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ ****************************************************************************/
+#include "vertical_grid.h"
+#include "cpl_port.h"
+#include "cpl_multiproc.h"
+#include "cpl_atomic_ops.h"
+#include "interpolation.h"
+#include "gdal_frmts.h"
+#include <iostream>
+#include <map>
+#include <stdlib.h>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <sys/time.h>
+#endif
+
+#define RAD_TO_DEG	57.29577951308232
+
+static double GetWallClock()
+	/*
+	 * seconds since an arbitrary origin, for timing raster reads
+	 */
+{
+#ifdef WIN32
+	LARGE_INTEGER nCounter, nFrequency;
+	QueryPerformanceCounter( &nCounter );
+	QueryPerformanceFrequency( &nFrequency );
+	return (double)nCounter.QuadPart / (double)nFrequency.QuadPart;
+#else
+	struct timeval sTime;
+	gettimeofday( &sTime, NULL );
+	return sTime.tv_sec + sTime.tv_usec * 1e-6;
+#endif
+}
+
+/************************************************************************/
+/*                           grid registry                              */
+/************************************************************************/
+
+typedef std::map<CPLString, VerticalGrid*> VerticalGridMap;
+
+static void *hRegistryMutex = NULL;
+static VerticalGridMap oGridRegistry;
+static bool bDriversRegistered = false;
+
+static CPLString GetCanonicalPath(const char *pszFilename)
+	/*
+	 * absolute path with links resolved, so different spellings
+	 * of one file share the same registry entry
+	 */
+{
+#ifdef WIN32
+	char szPath[_MAX_PATH];
+	if( _fullpath( szPath, pszFilename, _MAX_PATH ) != NULL )
+		return CPLString(szPath).tolower();
+#else
+	char *pszPath = realpath( pszFilename, NULL );
+	if( pszPath != NULL ){
+		CPLString osPath = pszPath;
+		free( pszPath );
+		return osPath;
+	}
+#endif
+	return pszFilename;
+}
+
+void
+	VerticalGrid::RegisterDrivers()
+	/*
+	 * called with hRegistryMutex held before the first raster is opened
+	 * through GDAL, mapped rasters do not need any driver
+	 */
+{
+	if( bDriversRegistered )
+		return;
+	bDriversRegistered = true;
+
+	if( EQUAL(CPLGetConfigOption( "SPATIALREF3D_GDAL_DRIVERS", "ALL" ), "GRID") ){
+		GDALRegister_EHdr();
+		GDALRegister_GTiff();
+		GDALRegister_GTX();
+	}
+	else
+		GDALAllRegister();
+}
+
+VerticalGrid *
+	VerticalGrid::Acquire(const char *pszFilename)
+{
+	CPLString osKey = GetCanonicalPath( pszFilename );
+
+	CPLMutexHolderD( &hRegistryMutex );
+
+	VerticalGridMap::iterator oIter = oGridRegistry.find( osKey );
+	if( oIter != oGridRegistry.end() ){
+		oIter->second->nRefCount++;
+		return oIter->second;
+	}
+
+	VerticalGrid *poGrid = new VerticalGrid();
+	if( poGrid->Open( pszFilename ) != OGRERR_NONE ){
+		delete poGrid;
+		return NULL;
+	}
+
+	poGrid->sKey = osKey;
+	poGrid->nRefCount = 1;
+	oGridRegistry[osKey] = poGrid;
+
+	return poGrid;
+}
+
+VerticalGrid *
+	VerticalGrid::CreateComposite(VerticalGrid *poFirst, VerticalGrid *poSecond, 
+								double dfOffset, GIntBig nMaxCells)
+	/*
+	 * sample poFirst + poSecond + dfOffset on the cell centers of the finer
+	 * grid which lie inside the area covered by the cell centers of the
+	 * coarser one, the result is held in memory and not registered
+	 */
+{
+	// only north-up grids can share a lattice
+	if (poFirst->dGeotrans[2] != 0.0 || poFirst->dGeotrans[4] != 0.0
+			|| poSecond->dGeotrans[2] != 0.0 || poSecond->dGeotrans[4] != 0.0)
+		return NULL;
+
+	VerticalGrid *poFine = poFirst;
+	VerticalGrid *poCoarse = poSecond;
+	if (fabs(poSecond->dGeotrans[1]*poSecond->dGeotrans[5]) < fabs(poFirst->dGeotrans[1]*poFirst->dGeotrans[5])){
+		poFine = poSecond;
+		poCoarse = poFirst;
+	}
+
+	// columns and rows of the fine grid inside the coarse one
+	int nCol0 = -1, nCol1 = -1;
+	for (int i=0; i<poFine->nRasterWidth; ++i){
+		double dX = (poFine->dGeotrans[0] + (i+0.5)*poFine->dGeotrans[1]) / RAD_TO_DEG;
+		double dY = (poCoarse->dGeotrans[3] + 0.5*poCoarse->dGeotrans[5]) / RAD_TO_DEG;
+		poCoarse->MapToRaster(&dX, &dY);
+		if (dX >= 0.0 && dX <= poCoarse->nRasterWidth-1){
+			if (nCol0 < 0)
+				nCol0 = i;
+			nCol1 = i;
+		}
+	}
+
+	int nRow0 = -1, nRow1 = -1;
+	for (int j=0; j<poFine->nRasterHeight; ++j){
+		double dX = (poCoarse->dGeotrans[0] + 0.5*poCoarse->dGeotrans[1]) / RAD_TO_DEG;
+		double dY = (poFine->dGeotrans[3] + (j+0.5)*poFine->dGeotrans[5]) / RAD_TO_DEG;
+		poCoarse->MapToRaster(&dX, &dY);
+		if (dY >= 0.0 && dY <= poCoarse->nRasterHeight-1){
+			if (nRow0 < 0)
+				nRow0 = j;
+			nRow1 = j;
+		}
+	}
+
+	if (nCol0 < 0 || nRow0 < 0)
+		return NULL;
+
+	int nWidth = nCol1 - nCol0 + 1;
+	int nHeight = nRow1 - nRow0 + 1;
+	if ((GIntBig)nWidth*nHeight > nMaxCells)
+		return NULL;
+
+	VerticalGrid *poGrid = new VerticalGrid();
+	poGrid->sFilename.Printf("%s+%s", poFirst->GetFilename(), poSecond->GetFilename());
+	poGrid->nRefCount = 1;
+	poGrid->nRasterWidth = nWidth;
+	poGrid->nRasterHeight = nHeight;
+
+	memcpy(poGrid->dGeotrans, poFine->dGeotrans, sizeof(poGrid->dGeotrans));
+	poGrid->dGeotrans[0] += nCol0*poFine->dGeotrans[1];
+	poGrid->dGeotrans[3] += nRow0*poFine->dGeotrans[5];
+	GDALInvGeoTransform( poGrid->dGeotrans, poGrid->dInvGeotrans );
+
+	// nodata nodes of the fine grid stay nodata, without the coarse grid and
+	// the offset, points next to them are left to the separate grids (see TouchesNoData())
+	poGrid->dNoDataValue = poFine->dNoDataValue;
+	poGrid->dCellNoData = poFine->dCellNoData;
+	poGrid->bNoDataCells = false;
+
+	poGrid->pafResident = (float *) VSIMalloc3(sizeof(float), nWidth, nHeight);
+	if (poGrid->pafResident == NULL){
+		delete poGrid;
+		return NULL;
+	}
+
+	int nFineFailures = poFine->nReadFailures;
+	int nCoarseFailures = poCoarse->nReadFailures;
+
+	for (int j=0; j<nHeight; ++j){
+		for (int i=0; i<nWidth; ++i){
+			double dValue = poFine->GetCell(nCol0+i, nRow0+j);
+			if (fabs(dValue - poFine->dCellNoData) > 1e-5){
+				double dX = (poGrid->dGeotrans[0] + (i+0.5)*poGrid->dGeotrans[1]) / RAD_TO_DEG;
+				double dY = (poGrid->dGeotrans[3] + (j+0.5)*poGrid->dGeotrans[5]) / RAD_TO_DEG;
+				poCoarse->MapToRaster(&dX, &dY);
+				dValue += poCoarse->GetValue(dX, dY) + dfOffset;
+			}
+			else
+				poGrid->bNoDataCells = true;
+			poGrid->pafResident[(GIntBig)j*nWidth + i] = (float)dValue;
+		}
+	}
+
+	// cells of tiles which could not be read are not summed up
+	if (poFine->nReadFailures != nFineFailures || poCoarse->nReadFailures != nCoarseFailures){
+		delete poGrid;
+		return NULL;
+	}
+
+	poGrid->pabyFirstLine = (const GByte *) poGrid->pafResident;
+	poGrid->nLineOffset = (int)sizeof(float)*nWidth;
+
+	return poGrid;
+}
+
+void
+	VerticalGrid::Release(VerticalGrid *poGrid)
+{
+	if( poGrid == NULL )
+		return;
+
+	CPLMutexHolderD( &hRegistryMutex );
+
+	if( --poGrid->nRefCount > 0 )
+		return;
+
+	oGridRegistry.erase( poGrid->sKey );
+	delete poGrid;
+}
+
+/************************************************************************/
+/*                            VerticalGrid                              */
+/************************************************************************/
+
+VerticalGrid::VerticalGrid() : nRefCount(0),
+								nRasterWidth(0), 
+									nRasterHeight(0),
+									nTilesPerRow(0),
+									nTilesPerColumn(0)
+{
+	poData = NULL;
+	papoTiles = NULL;
+	poMapped = NULL;
+	pafResident = NULL;
+	pabyFirstLine = NULL;
+	nLineOffset = 0;
+	bSwapCells = false;
+	hIOMutex = NULL;
+	nReadFailures = 0;
+	dCellNoData = 0.0;
+	bNoDataCells = true;
+	dInt16MaxError = CPLAtof(CPLGetConfigOption( "SPATIALREF3D_GRID_INT16_ERROR", "0" ));
+
+	for(int i=0; i<RESAMPLER_CACHE_SHARDS; ++i){
+		asShards[i].hMutex = NULL;
+		asShards[i].poMRU = NULL;
+		asShards[i].poLRU = NULL;
+		asShards[i].nCacheUsed = 0;
+		memset(&asShards[i].sStats, 0, sizeof(RasterGridStats));
+	}
+
+	hStatsMutex = NULL;
+	memset(&sLookupStats, 0, sizeof(RasterGridStats));
+
+	nCacheMax = RESAMPLER_CACHE_MAX;
+	const char *pszCacheMax = CPLGetConfigOption( "SPATIALREF3D_GRID_CACHE_MAX", NULL );
+	if( pszCacheMax != NULL )
+		nCacheMax = (GIntBig)atoi(pszCacheMax) * 1024 * 1024;
+}
+
+VerticalGrid::~VerticalGrid()
+{
+	Cleanup();
+	GridMemoryManager::WaitForEvictions();
+	CPLFree(papoTiles);
+
+	if(poData != NULL)
+		GDALClose(poData);
+
+	delete poMapped;
+	CPLFree(pafResident);
+
+	for(int i=0; i<RESAMPLER_CACHE_SHARDS; ++i)
+		if(asShards[i].hMutex != NULL)
+			CPLDestroyMutex(asShards[i].hMutex);
+
+	if(hIOMutex != NULL)
+		CPLDestroyMutex(hIOMutex);
+
+	if(hStatsMutex != NULL)
+		CPLDestroyMutex(hStatsMutex);
+}
+
+
+OGRErr
+	VerticalGrid::Open(const char *pszFilename)
+{
+	sFilename = pszFilename;
+
+	if( CSLTestBoolean(CPLGetConfigOption( "SPATIALREF3D_GRID_MMAP", "YES" ))
+		&& OpenMapped( pszFilename ) )
+		return OGRERR_NONE;
+
+	RegisterDrivers();
+	poData = (GDALDataset *) GDALOpen( pszFilename, GA_ReadOnly );
+	
+	// reported by the caller, see RasterResampler::GetGrid()
+	if( poData == NULL )
+		return OGRERR_FAILURE;
+
+	Prepare();
+	return OGRERR_NONE;
+}
+
+const char*
+	VerticalGrid::GetFilename()
+{
+	return sFilename;
+}
+
+void
+	VerticalGrid::SetCacheMax(GIntBig nBytes)
+{
+	nCacheMax = nBytes;
+
+	for(int i=0; i<RESAMPLER_CACHE_SHARDS; ++i){
+		CPLMutexHolderD( &asShards[i].hMutex );
+		EvictTiles(&asShards[i], 0);
+	}
+}
+
+GIntBig
+	VerticalGrid::GetCacheMax()
+{
+	return nCacheMax;
+}
+
+void
+	VerticalGrid::AddLookups(int nCount, int nOutside)
+{
+	CPLMutexHolderD( &hStatsMutex );
+	sLookupStats.nLookups += nCount;
+	sLookupStats.nOutside += nOutside;
+}
+
+void
+	VerticalGrid::GetStats(RasterGridStats *psStats)
+	/*
+	 * lookup counters plus the tile counters summed over all shards
+	 */
+{
+	{
+		CPLMutexHolderD( &hStatsMutex );
+		*psStats = sLookupStats;
+	}
+
+	for(int i=0; i<RESAMPLER_CACHE_SHARDS; ++i){
+		CPLMutexHolderD( &asShards[i].hMutex );
+		const RasterGridStats &sShard = asShards[i].sStats;
+
+		psStats->nCacheHits += sShard.nCacheHits;
+		psStats->nCacheMisses += sShard.nCacheMisses;
+		psStats->nTilesLoaded += sShard.nTilesLoaded;
+		psStats->nTilesEvicted += sShard.nTilesEvicted;
+		psStats->nBytesRead += sShard.nBytesRead;
+		psStats->dIOSeconds += sShard.dIOSeconds;
+	}
+}
+
+void
+	VerticalGrid::ResetStats()
+{
+	{
+		CPLMutexHolderD( &hStatsMutex );
+		memset(&sLookupStats, 0, sizeof(RasterGridStats));
+	}
+
+	for(int i=0; i<RESAMPLER_CACHE_SHARDS; ++i){
+		CPLMutexHolderD( &asShards[i].hMutex );
+		memset(&asShards[i].sStats, 0, sizeof(RasterGridStats));
+	}
+}
+
+double
+	VerticalGrid::GetValue(double x, double y)
+/*
+ * x and y is assumed to be in raster coordinate
+ */
+{
+	if (pabyFirstLine != NULL)
+		return GetValueMapped(x, y);
+
+	RasterTile *poTile = GetTile((int)floor(x), (int)floor(y));
+	double dValue = GetValueResampled(poTile, x, y);
+	ReleaseTile(poTile);
+
+	return dValue;
+}
+
+bool
+	VerticalGrid::GetValues(int nCount, const int *panIndex, 
+							const double *padPixel, const double *padLine, double *padZ)
+/*
+ * points panIndex[0..nCount-1] are assumed to fall into the same tile
+ * (or all outside the raster)
+ */
+{
+	if (nCount <= 0)
+		return true;
+
+	if (pabyFirstLine != NULL){
+		for(int i=0; i<nCount; ++i)
+			padZ[panIndex[i]] = GetValueMapped(padPixel[panIndex[i]], padLine[panIndex[i]]);
+		return true;
+	}
+
+	int px = (int)floor(padPixel[panIndex[0]]);
+	int py = (int)floor(padLine[panIndex[0]]);
+	RasterTile *poTile = GetTile(px, py);
+
+	// inside the raster, so the tile could not be read
+	if (poTile == NULL && px >= 0 && py >= 0 && px < nRasterWidth && py < nRasterHeight){
+		for(int i=0; i<nCount; ++i)
+			padZ[panIndex[i]] = 0.0;
+		return false;
+	}
+
+	// interpolate in chunks of RESAMPLER_BATCH_SIZE points
+	for(int i=0; i<nCount; i+=RESAMPLER_BATCH_SIZE)
+		GetValuesResampled(poTile, MIN(nCount-i, RESAMPLER_BATCH_SIZE), panIndex+i, padPixel, padLine, padZ);
+
+	ReleaseTile(poTile);
+	return true;
+}
+
+bool
+	VerticalGrid::TouchesNoData(double x, double y)
+/*
+ * same neighbors as GetValueMapped(), the edge is repeated on the last column/row
+ */
+{
+	if (!bNoDataCells)
+		return false;
+
+	int px = (int)floor(x);
+	int py = (int)floor(y);
+	int nColNext = (px+1 < nRasterWidth) ? 1 : 0;
+	int nRowNext = (py+1 < nRasterHeight) ? 1 : 0;
+
+	for(int j=0; j<=nRowNext; ++j){
+		for(int i=0; i<=nColNext; ++i){
+			if (fabs(GetCell(px+i, py+j) - dCellNoData) <= 1e-5)
+				return true;
+		}
+	}
+
+	return false;
+}
+
+double
+	VerticalGrid::GetCell(int px, int py)
+	/*
+	 * raw value of one cell inside the raster
+	 */
+{
+	if (pabyFirstLine != NULL)
+		return GetMappedCell(px, py);
+
+	// a tile which cannot be read is counted in nReadFailures
+	RasterTile *poTile = GetTile(px, py);
+	if (poTile == NULL)
+		return dCellNoData;
+
+	double dValue = GetTileCell(poTile, (py - poTile->nYOffset)*poTile->nWidth + px - poTile->nXOffset);
+	ReleaseTile(poTile);
+
+	return dValue;
+}
+
+double
+	VerticalGrid::GetValueResampled(RasterTile *poTile, double x, double y)
+/*
+ * x and y is assumed to be in raster coordinate (not tile coordinate)
+ */
+{
+	int px = (int)floor(x);
+	int py = (int)floor(y);
+
+	// Boundary checking, points outside are counted by the caller (see AddLookups())
+	if (poTile == NULL){
+		return 0.0;
+		//throw std::exception( "point outside raster." );
+	}
+	else {
+		double dx = x - px;
+		double dy = y - py;
+
+		// TODO: accomodate neigbor acquisition as required by other interpolation function (e.g. bicubic)
+		// acquire neighbors, the halo holds the right and bottom neighbor
+		// except on the last column/row of the raster where the edge is repeated
+		int nCol = px - poTile->nXOffset;
+		int nRow = py - poTile->nYOffset;
+		int nColNext = MIN(nCol+1, poTile->nWidth-1) - nCol;
+		int nRowNext = MIN(nRow+1, poTile->nHeight-1) - nRow;
+
+		int offset = nRow*poTile->nWidth+nCol;
+		double p[4];
+		p[0] = GetTileCell(poTile, offset);
+		p[1] = GetTileCell(poTile, offset+nColNext);
+
+		offset += nRowNext*poTile->nWidth;
+		p[2] = GetTileCell(poTile, offset);
+		p[3] = GetTileCell(poTile, offset+nColNext);
+
+		return bilinearInterpolation(p, dx, dy, dCellNoData);
+	}
+
+	return 0.0;
+}
+
+void
+	VerticalGrid::GetValuesResampled(RasterTile *poTile, int nCount, const int *panIndex, 
+										const double *padPixel, const double *padLine, double *padZ)
+/*
+ * interpolate the points panIndex[0..nCount-1] of a batch which all fall into poTile,
+ * the neighborhood offsets are the same as in GetValueResampled()
+ */
+{
+	if (poTile == NULL){
+		for(int i=0; i<nCount; ++i)
+			padZ[panIndex[i]] = GetValueResampled(NULL, padPixel[panIndex[i]], padLine[panIndex[i]]);
+		return;
+	}
+
+	int anOffset[RESAMPLER_BATCH_SIZE];
+	int anColStep[RESAMPLER_BATCH_SIZE];
+	int anRowStep[RESAMPLER_BATCH_SIZE];
+	double adDX[RESAMPLER_BATCH_SIZE];
+	double adDY[RESAMPLER_BATCH_SIZE];
+	double adValue[RESAMPLER_BATCH_SIZE];
+
+	for(int i=0; i<nCount; ++i){
+		double x = padPixel[panIndex[i]];
+		double y = padLine[panIndex[i]];
+		int px = (int)floor(x);
+		int py = (int)floor(y);
+
+		int nCol = px - poTile->nXOffset;
+		int nRow = py - poTile->nYOffset;
+
+		adDX[i] = x - px;
+		adDY[i] = y - py;
+		anOffset[i] = nRow*poTile->nWidth+nCol;
+		anColStep[i] = MIN(nCol+1, poTile->nWidth-1) - nCol;
+		anRowStep[i] = (MIN(nRow+1, poTile->nHeight-1) - nRow)*poTile->nWidth;
+	}
+
+	if (poTile->pafData != NULL)
+		bilinearInterpolationBatch(nCount, poTile->pafData, anOffset, anColStep, anRowStep, 
+								adDX, adDY, dCellNoData, adValue);
+	else{
+		// decode the 2x2 neighborhoods of a scaled tile and interpolate those
+		double adCells[4*RESAMPLER_BATCH_SIZE];
+		for(int i=0; i<nCount; ++i){
+			adCells[4*i] = GetTileCell(poTile, anOffset[i]);
+			adCells[4*i+1] = GetTileCell(poTile, anOffset[i]+anColStep[i]);
+			adCells[4*i+2] = GetTileCell(poTile, anOffset[i]+anRowStep[i]);
+			adCells[4*i+3] = GetTileCell(poTile, anOffset[i]+anRowStep[i]+anColStep[i]);
+
+			anOffset[i] = 4*i;
+			anColStep[i] = 1;
+			anRowStep[i] = 2;
+		}
+		bilinearInterpolationBatch(nCount, adCells, anOffset, anColStep, anRowStep, 
+								adDX, adDY, dCellNoData, adValue);
+	}
+
+	for(int i=0; i<nCount; ++i)
+		padZ[panIndex[i]] = adValue[i];
+}
+
+double
+	VerticalGrid::GetValueMapped(double x, double y)
+/*
+ * x and y is assumed to be in raster coordinate
+ */
+{
+	int px = (int)floor(x);
+	int py = (int)floor(y);
+
+	// Boundary checking, points outside are counted by the caller (see AddLookups())
+	if (px < 0 || py < 0 || px >= nRasterWidth || py >= nRasterHeight){
+		return 0.0;
+	}
+
+	double dx = x - px;
+	double dy = y - py;
+
+	// acquire neighbors, the edge is repeated on the last column/row
+	int nColNext = (px+1 < nRasterWidth) ? 1 : 0;
+	int nRowNext = (py+1 < nRasterHeight) ? 1 : 0;
+
+	double p[4];
+	p[0] = GetMappedCell(px, py);
+	p[1] = GetMappedCell(px+nColNext, py);
+	p[2] = GetMappedCell(px, py+nRowNext);
+	p[3] = GetMappedCell(px+nColNext, py+nRowNext);
+
+	return bilinearInterpolation(p, dx, dy, dCellNoData);
+}
+
+double
+	VerticalGrid::GetTileCell(RasterTile *poTile, int nOffset)
+{
+	if (poTile->pafData != NULL)
+		return poTile->pafData[nOffset];
+
+	GInt16 nValue = poTile->panData[nOffset];
+	if (nValue == RESAMPLER_INT16_NODATA)
+		return dCellNoData;
+
+	return poTile->dOffset + poTile->dScale*nValue;
+}
+
+double
+	VerticalGrid::GetMappedCell(int px, int py)
+{
+	float fValue;
+	memcpy( &fValue, pabyFirstLine + (GIntBig)py*nLineOffset + (GIntBig)px*sizeof(float), sizeof(float) );
+
+	if( bSwapCells )
+		CPL_SWAP32PTR( &fValue );
+
+	return fValue;
+}
+
+bool
+	VerticalGrid::OpenMapped(const char *pszFilename)
+	/*
+	 * map raw float32 rasters (EHdr .flt/.bil, NOAA .gtx) read-only,
+	 * cells are interpolated directly from the mapped file
+	 */
+{
+	const char *pszExtension = CPLGetExtension( pszFilename );
+	bool bIsGTX = EQUAL(pszExtension, "gtx");
+
+	if( !bIsGTX && !EQUAL(pszExtension, "flt") && !EQUAL(pszExtension, "bil") )
+		return false;
+
+	double adfGeoTransform[6];
+	GIntBig nDataOffset = 0;
+	bool bMSB = true;		// GTX is always big-endian
+
+	if( !bIsGTX && !ReadEHdrHeader( pszFilename, adfGeoTransform, &nDataOffset, &bMSB ) )
+		return false;
+
+	poMapped = new MappedFile();
+
+	if( !poMapped->Open( pszFilename )
+		|| (bIsGTX && !ReadGTXHeader( adfGeoTransform, &nDataOffset ))
+		|| (GIntBig)poMapped->GetSize() < nDataOffset + (GIntBig)sizeof(float)*nRasterWidth*nRasterHeight
+		|| GDALInvGeoTransform( adfGeoTransform, dInvGeotrans ) == 0 )
+	{
+		delete poMapped;
+		poMapped = NULL;
+		nRasterWidth = 0;
+		nRasterHeight = 0;
+		return false;
+	}
+
+	memcpy( dGeotrans, adfGeoTransform, sizeof(dGeotrans) );
+
+	int nLineBytes = (int)sizeof(float)*nRasterWidth;
+	if( bIsGTX ){
+		// GTX stores the southernmost line first
+		pabyFirstLine = poMapped->GetData() + nDataOffset + (GIntBig)(nRasterHeight-1)*nLineBytes;
+		nLineOffset = -nLineBytes;
+	}
+	else{
+		pabyFirstLine = poMapped->GetData() + nDataOffset;
+		nLineOffset = nLineBytes;
+	}
+
+#ifdef CPL_LSB
+	bSwapCells = bMSB;
+#else
+	bSwapCells = !bMSB;
+#endif
+
+	dCellNoData = (float)dNoDataValue;
+
+	return true;
+}
+
+bool
+	VerticalGrid::ReadEHdrHeader(const char *pszFilename, double *padfGeoTransform, 
+									GIntBig *pnDataOffset, bool *pbMSB)
+	/*
+	 * parse the .hdr file of an EHdr raster, only single band float32 
+	 * rasters with packed lines are accepted
+	 */
+{
+	CPLString osHeader = CPLResetExtension( pszFilename, "hdr" );
+	VSILFILE *fp = VSIFOpenL( osHeader, "r" );
+	if( fp == NULL ){
+		osHeader = CPLResetExtension( pszFilename, "HDR" );
+		fp = VSIFOpenL( osHeader, "r" );
+	}
+	if( fp == NULL )
+		return false;
+
+	int nCols = 0, nRows = 0, nBands = 1, nBits = 32;
+	int nBandRowBytes = -1, nTotalRowBytes = -1;
+	bool bFloat = EQUAL(CPLGetExtension( pszFilename ), "flt");
+	bool bHasUL = false, bHasLLCorner = false, bHasLLCenter = false;
+	double dfULX = 0.0, dfULY = 0.0, dfLLX = 0.0, dfLLY = 0.0;
+	double dfXDim = 0.0, dfYDim = 0.0, dfCellSize = 0.0;
+
+	*pbMSB = true;		// EHdr default byte order is Motorola
+	*pnDataOffset = 0;
+	dNoDataValue = -1e10;
+
+	const char *pszLine;
+	while( (pszLine = CPLReadLineL( fp )) != NULL )
+	{
+		char **papszTokens = CSLTokenizeString( pszLine );
+		if( CSLCount( papszTokens ) >= 2 )
+		{
+			const char *pszKey = papszTokens[0];
+			const char *pszValue = papszTokens[1];
+
+			if( EQUAL(pszKey, "NCOLS") )
+				nCols = atoi(pszValue);
+			else if( EQUAL(pszKey, "NROWS") )
+				nRows = atoi(pszValue);
+			else if( EQUAL(pszKey, "NBANDS") )
+				nBands = atoi(pszValue);
+			else if( EQUAL(pszKey, "NBITS") )
+				nBits = atoi(pszValue);
+			else if( EQUAL(pszKey, "PIXELTYPE") )
+				bFloat = EQUAL(pszValue, "FLOAT");
+			else if( EQUAL(pszKey, "BYTEORDER") )
+				*pbMSB = EQUAL(pszValue, "M") || EQUAL(pszValue, "MSBFIRST");
+			else if( EQUAL(pszKey, "SKIPBYTES") )
+				*pnDataOffset = atoi(pszValue);
+			else if( EQUAL(pszKey, "BANDROWBYTES") )
+				nBandRowBytes = atoi(pszValue);
+			else if( EQUAL(pszKey, "TOTALROWBYTES") )
+				nTotalRowBytes = atoi(pszValue);
+			else if( EQUAL(pszKey, "ULXMAP") ){
+				dfULX = CPLAtof(pszValue);
+				bHasUL = true;
+			}
+			else if( EQUAL(pszKey, "ULYMAP") )
+				dfULY = CPLAtof(pszValue);
+			else if( EQUAL(pszKey, "XLLCORNER") ){
+				dfLLX = CPLAtof(pszValue);
+				bHasLLCorner = true;
+			}
+			else if( EQUAL(pszKey, "YLLCORNER") )
+				dfLLY = CPLAtof(pszValue);
+			else if( EQUAL(pszKey, "XLLCENTER") ){
+				dfLLX = CPLAtof(pszValue);
+				bHasLLCenter = true;
+			}
+			else if( EQUAL(pszKey, "YLLCENTER") )
+				dfLLY = CPLAtof(pszValue);
+			else if( EQUAL(pszKey, "XDIM") )
+				dfXDim = CPLAtof(pszValue);
+			else if( EQUAL(pszKey, "YDIM") )
+				dfYDim = CPLAtof(pszValue);
+			else if( EQUAL(pszKey, "CELLSIZE") )
+				dfCellSize = CPLAtof(pszValue);
+			else if( EQUAL(pszKey, "NODATA") || EQUAL(pszKey, "NODATA_VALUE") )
+				dNoDataValue = CPLAtof(pszValue);
+		}
+		CSLDestroy( papszTokens );
+	}
+	VSIFCloseL( fp );
+
+	if( dfXDim == 0.0 )
+		dfXDim = dfCellSize;
+	if( dfYDim == 0.0 )
+		dfYDim = dfCellSize;
+
+	// anything but a packed single band float32 raster is left to GDAL
+	if( nCols <= 0 || nRows <= 0 || nBands != 1 || nBits != 32 || !bFloat
+		|| (nBandRowBytes != -1 && nBandRowBytes != nCols*(int)sizeof(float))
+		|| (nTotalRowBytes != -1 && nTotalRowBytes != nCols*(int)sizeof(float))
+		|| dfXDim == 0.0 || dfYDim == 0.0 )
+		return false;
+
+	padfGeoTransform[1] = dfXDim;
+	padfGeoTransform[2] = 0.0;
+	padfGeoTransform[4] = 0.0;
+	padfGeoTransform[5] = -dfYDim;
+
+	if( bHasUL ){
+		// ULXMAP/ULYMAP refer to the center of the upper left cell
+		padfGeoTransform[0] = dfULX - dfXDim*0.5;
+		padfGeoTransform[3] = dfULY + dfYDim*0.5;
+	}
+	else if( bHasLLCorner ){
+		padfGeoTransform[0] = dfLLX;
+		padfGeoTransform[3] = dfLLY + nRows*dfYDim;
+	}
+	else if( bHasLLCenter ){
+		padfGeoTransform[0] = dfLLX - dfXDim*0.5;
+		padfGeoTransform[3] = dfLLY - dfYDim*0.5 + nRows*dfYDim;
+	}
+	else
+		return false;
+
+	nRasterWidth = nCols;
+	nRasterHeight = nRows;
+
+	return true;
+}
+
+bool
+	VerticalGrid::ReadGTXHeader(double *padfGeoTransform, GIntBig *pnDataOffset)
+	/*
+	 * parse the 40 byte big-endian header of a NOAA .gtx raster
+	 */
+{
+	if( poMapped->GetSize() < 40 )
+		return false;
+
+	const GByte *pabyHeader = poMapped->GetData();
+	double dfYOrigin, dfXOrigin, dfYStep, dfXStep;
+	GInt32 nRows, nCols;
+
+	memcpy( &dfYOrigin, pabyHeader + 0, 8 );
+	memcpy( &dfXOrigin, pabyHeader + 8, 8 );
+	memcpy( &dfYStep, pabyHeader + 16, 8 );
+	memcpy( &dfXStep, pabyHeader + 24, 8 );
+	memcpy( &nRows, pabyHeader + 32, 4 );
+	memcpy( &nCols, pabyHeader + 36, 4 );
+
+	CPL_MSBPTR64( &dfYOrigin );
+	CPL_MSBPTR64( &dfXOrigin );
+	CPL_MSBPTR64( &dfYStep );
+	CPL_MSBPTR64( &dfXStep );
+	CPL_MSBPTR32( &nRows );
+	CPL_MSBPTR32( &nCols );
+
+	if( nRows <= 0 || nCols <= 0 || dfXStep == 0.0 || dfYStep == 0.0 )
+		return false;
+
+	// some GTX files come in 0-360
+	if( dfXOrigin >= 180.0 )
+		dfXOrigin -= 360.0;
+
+	padfGeoTransform[0] = dfXOrigin - dfXStep*0.5;
+	padfGeoTransform[1] = dfXStep;
+	padfGeoTransform[2] = 0.0;
+	padfGeoTransform[3] = dfYOrigin + (nRows-0.5)*dfYStep;
+	padfGeoTransform[4] = 0.0;
+	padfGeoTransform[5] = -dfYStep;
+
+	nRasterWidth = nCols;
+	nRasterHeight = nRows;
+	*pnDataOffset = 40;
+
+	// GTX marks cells without data with -88.8888
+	dNoDataValue = -88.8888;
+
+	return true;
+}
+
+void
+	VerticalGrid::Cleanup()
+{
+	for(int i=0; i<RESAMPLER_CACHE_SHARDS; ++i){
+		CPLMutexHolderD( &asShards[i].hMutex );
+
+		// asking for more than the whole budget drops every tile
+		EvictTiles(&asShards[i], nCacheMax + 1);
+	}
+}
+
+void
+	VerticalGrid::Prepare()
+	/*
+	 * get metadata information from raster file
+	 */
+{
+	nRasterWidth = poData->GetRasterXSize();
+    nRasterHeight = poData->GetRasterYSize();
+
+	nTilesPerRow = (nRasterWidth + RESAMPLER_TILE_SIZE - 1) / RESAMPLER_TILE_SIZE;
+	nTilesPerColumn = (nRasterHeight + RESAMPLER_TILE_SIZE - 1) / RESAMPLER_TILE_SIZE;
+	papoTiles = (RasterTile **) CPLCalloc(sizeof(RasterTile*), nTilesPerRow*nTilesPerColumn);
+
+	dNoDataValue = poData->GetRasterBand(1)->GetNoDataValue();
+	dCellNoData = (float)dNoDataValue;
+
+    poData->GetGeoTransform(dGeotrans);
+
+	if( GDALInvGeoTransform( dGeotrans, dInvGeotrans ) == 0 )
+      throw std::exception( "inversion of geo transformation failed." );
+}
+
+RasterTile *
+	VerticalGrid::GetTile(int px, int py)
+	/*
+	 * find the tile holding cell (px, py), loading it if needed, mark it
+	 * as most recently used and pin it until ReleaseTile() is called,
+	 * returns NULL if the cell is outside the raster
+	 */
+{
+	if (px < 0 || py < 0 || px >= nRasterWidth || py >= nRasterHeight)
+		return NULL;
+
+	int nTileX = px / RESAMPLER_TILE_SIZE;
+	int nTileY = py / RESAMPLER_TILE_SIZE;
+	int nTileIndex = nTileY*nTilesPerRow + nTileX;
+
+	RasterCacheShard *psShard = &asShards[nTileIndex % RESAMPLER_CACHE_SHARDS];
+	RasterTile *poTile;
+	bool bLoaded = false;
+	{
+		CPLMutexHolderD( &psShard->hMutex );
+
+		poTile = papoTiles[nTileIndex];
+		if (poTile == NULL){
+			psShard->sStats.nCacheMisses++;
+			poTile = LoadTile(psShard, nTileX, nTileY);
+			if (poTile == NULL)
+				return NULL;
+			bLoaded = true;
+		}
+		else {
+			psShard->sStats.nCacheHits++;
+			GridMemoryManager::Touch(&poTile->sMemory);
+		}
+
+		if (poTile != psShard->poMRU){
+			// move to the head of the LRU list
+			poTile->poPrev->poNext = poTile->poNext;
+			if (poTile->poNext != NULL)
+				poTile->poNext->poPrev = poTile->poPrev;
+			else
+				psShard->poLRU = poTile->poPrev;
+
+			poTile->poPrev = NULL;
+			poTile->poNext = psShard->poMRU;
+			psShard->poMRU->poPrev = poTile;
+			psShard->poMRU = poTile;
+		}
+
+		CPLAtomicInc(&poTile->nRefCount);
+	}
+
+	// the process wide budget evicts with the shard mutex released,
+	// our pin keeps the tile alive
+	if (bLoaded)
+		GridMemoryManager::Enforce();
+
+	return poTile;
+}
+
+void
+	VerticalGrid::ReleaseTile(RasterTile *poTile)
+	/*
+	 * unpin a tile returned by GetTile(), the tile is freed here
+	 * if it was evicted while in use
+	 */
+{
+	if (poTile != NULL && CPLAtomicDec(&poTile->nRefCount) == 0){
+		CPLFree(poTile->pafData);
+		CPLFree(poTile->panData);
+		delete poTile;
+	}
+}
+
+RasterTile *
+	VerticalGrid::LoadTile(RasterCacheShard *psShard, int nTileX, int nTileY)
+	/*
+	 * Access pixel data of one tile (plus halo) from raster file to memory,
+	 * called with the shard mutex held
+	 */
+{
+	RasterTile *poTile = new RasterTile;
+
+	poTile->nTileX = nTileX;
+	poTile->nTileY = nTileY;
+	poTile->nXOffset = nTileX*RESAMPLER_TILE_SIZE;
+	poTile->nYOffset = nTileY*RESAMPLER_TILE_SIZE;
+	poTile->nWidth = MIN(nRasterWidth-poTile->nXOffset, RESAMPLER_TILE_SIZE+1);
+	poTile->nHeight = MIN(nRasterHeight-poTile->nYOffset, RESAMPLER_TILE_SIZE+1);
+	poTile->nRefCount = 1;		// reference held by the cache
+	GridMemoryManager::InitEntry(&poTile->sMemory, this, poTile);
+
+	int nCells = poTile->nWidth*poTile->nHeight;
+	poTile->pafData = (float *) CPLMalloc(sizeof(float)*nCells);
+	poTile->panData = NULL;
+	poTile->dOffset = 0.0;
+	poTile->dScale = 1.0;
+
+	CPLErr eErr;
+	{
+		// GDAL datasets are not safe for concurrent reads
+		CPLMutexHolderD( &hIOMutex );
+		double dStart = GetWallClock();
+		eErr = poData->RasterIO( GF_Read, 
+							poTile->nXOffset, poTile->nYOffset, poTile->nWidth, poTile->nHeight, 
+							poTile->pafData, poTile->nWidth, poTile->nHeight, GDT_Float32, 
+							1, NULL, 0, 0, 0 );
+		psShard->sStats.dIOSeconds += GetWallClock() - dStart;
+	}
+
+	// not cached, the next lookup of the tile tries again
+	if (eErr != CE_None){
+		CPLError(CE_Failure, CPLE_FileIO, 
+				 "Unable to read cells %d,%d of height model '%s'.", 
+				 poTile->nXOffset, poTile->nYOffset, sFilename.c_str());
+		CPLAtomicInc(&nReadFailures);
+		CPLFree(poTile->pafData);
+		delete poTile;
+		return NULL;
+	}
+
+	psShard->sStats.nTilesLoaded++;
+	psShard->sStats.nBytesRead += sizeof(float)*nCells;
+
+	if (dInt16MaxError > 0.0)
+		ScaleTile(poTile);
+
+	poTile->nBytes = (poTile->panData != NULL) ? sizeof(GInt16)*nCells : sizeof(float)*nCells;
+	EvictTiles(psShard, poTile->nBytes);
+
+	// insert at the head of the LRU list
+	poTile->poPrev = NULL;
+	poTile->poNext = psShard->poMRU;
+	if (psShard->poMRU != NULL)
+		psShard->poMRU->poPrev = poTile;
+	else
+		psShard->poLRU = poTile;
+	psShard->poMRU = poTile;
+
+	papoTiles[nTileY*nTilesPerRow + nTileX] = poTile;
+	psShard->nCacheUsed += poTile->nBytes;
+	GridMemoryManager::Add(&poTile->sMemory, poTile->nBytes);
+
+	return poTile;
+}
+
+void
+	VerticalGrid::ScaleTile(RasterTile *poTile)
+	/*
+	 * replace the float32 cells of a freshly loaded tile by int16 steps of 
+	 * 2*dInt16MaxError around the middle of the tile value range, so no cell
+	 * moves by more than dInt16MaxError, tiles whose range needs more steps
+	 * than int16 holds stay float32
+	 */
+{
+	int nCells = poTile->nWidth*poTile->nHeight;
+	double dMin = 0.0, dMax = 0.0;
+	bool bHasData = false;
+
+	for(int i=0; i<nCells; ++i){
+		double dValue = poTile->pafData[i];
+		if (fabs(dValue - dCellNoData) <= 1e-5 || CPLIsNan(dValue))
+			continue;
+
+		if (!bHasData || dValue < dMin)
+			dMin = dValue;
+		if (!bHasData || dValue > dMax)
+			dMax = dValue;
+		bHasData = true;
+	}
+
+	double dScale = 2.0*dInt16MaxError;
+	if ((dMax - dMin) / dScale > 2.0*32767)
+		return;
+
+	poTile->dScale = dScale;
+	poTile->dOffset = (dMin + dMax) * 0.5;
+	poTile->panData = (GInt16 *) CPLMalloc(sizeof(GInt16)*nCells);
+
+	for(int i=0; i<nCells; ++i){
+		double dValue = poTile->pafData[i];
+		if (fabs(dValue - dCellNoData) <= 1e-5 || CPLIsNan(dValue))
+			poTile->panData[i] = RESAMPLER_INT16_NODATA;
+		else
+			poTile->panData[i] = (GInt16) MAX(-32767, MIN(32767, 
+									floor((dValue - poTile->dOffset) / dScale + 0.5)));
+	}
+
+	CPLFree(poTile->pafData);
+	poTile->pafData = NULL;
+}
+
+void
+	VerticalGrid::EvictTiles(RasterCacheShard *psShard, GIntBig nBytesNeeded)
+	/*
+	 * drop least recently used tiles of a shard until nBytesNeeded more bytes
+	 * fit into its share of the budget, called with the shard mutex held
+	 */
+{
+	GIntBig nShardMax = nCacheMax / RESAMPLER_CACHE_SHARDS;
+
+	while(psShard->poLRU != NULL && psShard->nCacheUsed + nBytesNeeded > nShardMax){
+		RasterTile *poTile = psShard->poLRU;
+
+		GridMemoryManager::Remove(&poTile->sMemory);
+		UnlinkTile(psShard, poTile);
+	}
+}
+
+void
+	VerticalGrid::UnlinkTile(RasterCacheShard *psShard, RasterTile *poTile)
+{
+	if (poTile->poPrev != NULL)
+		poTile->poPrev->poNext = poTile->poNext;
+	else
+		psShard->poMRU = poTile->poNext;
+
+	if (poTile->poNext != NULL)
+		poTile->poNext->poPrev = poTile->poPrev;
+	else
+		psShard->poLRU = poTile->poPrev;
+
+	papoTiles[poTile->nTileY*nTilesPerRow + poTile->nTileX] = NULL;
+	psShard->nCacheUsed -= poTile->nBytes;
+	psShard->sStats.nTilesEvicted++;
+
+	// tiles still pinned by a reader are freed by its ReleaseTile()
+	ReleaseTile(poTile);
+}
+
+void
+	VerticalGrid::DetachEntry(GridMemoryEntry *psEntry)
+	/*
+	 * called by GridMemoryManager with its lock held, listed tiles are
+	 * still cached, so the tile is alive and can be pinned
+	 */
+{
+	RasterTile *poTile = (RasterTile *) psEntry->pData;
+	CPLAtomicInc(&poTile->nRefCount);
+}
+
+void
+	VerticalGrid::EvictEntry(GridMemoryEntry *psEntry)
+	/*
+	 * called by GridMemoryManager without its lock held, the tile may
+	 * have been dropped by the shard meanwhile
+	 */
+{
+	RasterTile *poTile = (RasterTile *) psEntry->pData;
+	int nTileIndex = poTile->nTileY*nTilesPerRow + poTile->nTileX;
+	RasterCacheShard *psShard = &asShards[nTileIndex % RESAMPLER_CACHE_SHARDS];
+
+	{
+		CPLMutexHolderD( &psShard->hMutex );
+		if (papoTiles[nTileIndex] == poTile)
+			UnlinkTile(psShard, poTile);
+	}
+
+	// drop the pin of DetachEntry()
+	ReleaseTile(poTile);
+}
+
+void 
+	VerticalGrid::MapToRaster(double *x, double *y)
+	/* 
+	 * converts map coordinate (radian) to raster coordinate (pixels)
+	 */
+{
+	*(x) = -0.5+dInvGeotrans[0]+ 
+          + *(x) * dInvGeotrans[1] * RAD_TO_DEG
+          + *(y) * dInvGeotrans[2] * RAD_TO_DEG;
+
+    *(y) = -0.5+dInvGeotrans[3]
+          + *(x) * dInvGeotrans[4] * RAD_TO_DEG
+          + *(y) * dInvGeotrans[5] * RAD_TO_DEG;
+}
\ No newline at end of file
@@ -244,19 +244,15 @@ int main(int argc, char *argv[])
 		data_offset = 0;
 		while(data_offset<num_data){
 			
-			sample_count = MIN(num_samples, num_data-data_offset+1);
-			for (int sample=0; sample<sample_count; ++sample)
-			{
-				x_out[sample] = x_in[data_offset+sample];
-				y_out[sample] = y_in[data_offset+sample];
-				z_out[sample] = z_in[data_offset+sample];
-			}
-			data_offset += sample_count; 
+			sample_count = MIN(num_samples, num_data-data_offset);
 
-			if( poCT == NULL || !poCT->Transform( sample_count, x_out, y_out ,z_out) )
+			// reads the chunk straight from the input arrays, no copy pass
+			if( poCT == NULL || !poCT->TransformTo( sample_count, 
+					x_in+data_offset, y_in+data_offset, z_in+data_offset, x_out, y_out, z_out) )
 			{
 				cout << "Transformation failed.\n";
 			}
+			data_offset += sample_count; 
 		}//process next chunk until all data used
 
 		GET_TIMER(end_time);
@@ -29,8 +29,11 @@
 #include <fstream>
 #include <string>
 #include <sstream>
+#include <vector>
+#include <algorithm>
 
 #include "cpl_conv.h"
+#include "gdal.h"
 #include "ogr_spatialref3D.h"
 #include "OptionParser.h"
 #include "proj_api.h"
@@ -58,6 +61,12 @@
  *		-s | --source-coord=FILE		: set FILE as source coordinate system
  *										  description
  *	
+ *		-a | --check-alloc				: check that repeated transformations of
+ *										  the input points allocate no memory
+ *	
+ *		-c | --check					: check the behaviour of the transformation
+ *										  on the input points against reference paths
+ *	
  *  
  *
  *
@@ -91,6 +100,680 @@ char *loadWktFile(const char* sWktFilename){
 	return buffer;
 }
 
+/************************************************************************/
+/*                         allocation counting                          */
+/*                                                                      */
+/*      Every heap allocation made through malloc (CPLMalloc, new, ...) */
+/*      increments nAllocCount. With MSVC this needs the debug CRT and  */
+/*      only sees the modules linked to it.                             */
+/************************************************************************/
+
+static volatile long nAllocCount = 0;
+
+#if defined(_MSC_VER) && defined(_DEBUG)
+#include <crtdbg.h>
+#define HAVE_ALLOC_COUNT
+
+static int countAllocHook(int nAllocType, void *, size_t, int, long, const unsigned char *, int)
+{
+	if (nAllocType == _HOOK_ALLOC || nAllocType == _HOOK_REALLOC)
+		nAllocCount++;
+	return TRUE;
+}
+
+static void startAllocCount()
+{
+	_CrtSetAllocHook(countAllocHook);
+}
+
+#elif defined(__GLIBC__)
+#define HAVE_ALLOC_COUNT
+
+extern "C" void *__libc_malloc(size_t nSize);
+extern "C" void *__libc_calloc(size_t nCount, size_t nSize);
+extern "C" void *__libc_realloc(void *pData, size_t nSize);
+
+extern "C" void *malloc(size_t nSize) __THROW
+{
+	nAllocCount++;
+	return __libc_malloc(nSize);
+}
+
+extern "C" void *calloc(size_t nCount, size_t nSize) __THROW
+{
+	nAllocCount++;
+	return __libc_calloc(nCount, nSize);
+}
+
+extern "C" void *realloc(void *pData, size_t nSize) __THROW
+{
+	nAllocCount++;
+	return __libc_realloc(pData, nSize);
+}
+
+static void startAllocCount()
+{
+}
+#endif
+
+//! function to count the heap allocations of repeated transformations
+/*!
+	Runs Transform() and TransformEx() once on nMax points taken from the input
+	points in scrambled order, so the scratch buffers grow to their final size
+	and the height model tiles are loaded, then counts the allocations of a
+	second call of the same and of smaller sizes, which have to be zero.
+	\param poCT transformation to check
+	\param adfX, adfY, adfZ input points
+	\return number of allocations seen, or -1 if they cannot be counted here
+*/
+long checkAllocations(OGRCoordinateTransformation3D *poCT, 
+					  const vector<double> &adfX, const vector<double> &adfY, const vector<double> &adfZ)
+{
+#if defined(HAVE_ALLOC_COUNT)
+	const int nMax = 1000;
+	const int anSizes[4] = { nMax, 1, 17, nMax };
+	int nPoints = (int) adfX.size();
+
+	if (nPoints == 0)
+		return 0;
+
+	vector<double> adfSrcX(nMax), adfSrcY(nMax), adfSrcZ(nMax);
+	vector<double> adfWorkX(nMax), adfWorkY(nMax), adfWorkZ(nMax);
+	vector<int> anSuccess(nMax);
+
+	for(int i=0; i<nMax; ++i){
+		int iPoint = (int) (((GIntBig) i * 7919) % nPoints);
+		adfSrcX[i] = adfX[iPoint];
+		adfSrcY[i] = adfY[iPoint];
+		adfSrcZ[i] = adfZ[iPoint];
+	}
+
+	startAllocCount();
+
+	long nTotal = 0;
+	for(int k=0; k<4; ++k){
+		int nCount = anSizes[k];
+
+		for(int nPass=0; nPass<2; ++nPass){
+			long nBefore = nAllocCount;
+
+			std::copy(adfSrcX.begin(), adfSrcX.begin() + nCount, adfWorkX.begin());
+			std::copy(adfSrcY.begin(), adfSrcY.begin() + nCount, adfWorkY.begin());
+			std::copy(adfSrcZ.begin(), adfSrcZ.begin() + nCount, adfWorkZ.begin());
+			poCT->Transform(nCount, &adfWorkX[0], &adfWorkY[0], &adfWorkZ[0]);
+
+			std::copy(adfSrcX.begin(), adfSrcX.begin() + nCount, adfWorkX.begin());
+			std::copy(adfSrcY.begin(), adfSrcY.begin() + nCount, adfWorkY.begin());
+			std::copy(adfSrcZ.begin(), adfSrcZ.begin() + nCount, adfWorkZ.begin());
+			poCT->TransformEx(nCount, &adfWorkX[0], &adfWorkY[0], &adfWorkZ[0], &anSuccess[0]);
+
+			long nAllocs = nAllocCount - nBefore;
+			// the first call of the largest size may allocate
+			if (k == 0)
+				break;
+
+			printf("%d points, pass %d: %ld allocations\n", nCount, nPass + 1, nAllocs);
+			nTotal += nAllocs;
+		}
+	}
+
+	return nTotal;
+#else
+	return -1;
+#endif
+}
+
+/************************************************************************/
+/*                           behaviour checks                           */
+/*                                                                      */
+/*      Every check prints its result and returns the number of points  */
+/*      (or cases) failing it.                                          */
+/************************************************************************/
+
+//! function to print the result of one check
+static int reportCheck(const char *pszName, int nFailed, double dfMaxDiff)
+{
+	if (nFailed == 0)
+		printf("check %s passed (max. difference %g)\n", pszName, dfMaxDiff);
+	else
+		printf("check %s failed: %d point(s), max. difference %g\n", pszName, nFailed, dfMaxDiff);
+	return nFailed;
+}
+
+//! function to repeat the input points, shifted a little, to nCount points
+static void expandPoints(const vector<double> &adfX, const vector<double> &adfY, const vector<double> &adfZ,
+						 int nCount, vector<double> &adfOutX, vector<double> &adfOutY, vector<double> &adfOutZ)
+{
+	int nPoints = (int) adfX.size();
+
+	adfOutX.resize(nCount);
+	adfOutY.resize(nCount);
+	adfOutZ.resize(nCount);
+	for(int i=0; i<nCount; ++i){
+		int iPoint = (int) (((GIntBig) i * 7919) % nPoints);
+		adfOutX[i] = adfX[iPoint] + 1e-5 * (i % 101);
+		adfOutY[i] = adfY[iPoint] + 1e-5 * (i % 103);
+		adfOutZ[i] = adfZ[iPoint];
+	}
+}
+
+//! function to count the points of two results differing by more than dfTolerance
+/*!
+	Points failing in one result only count as different, points failing in
+	both are skipped.
+	\param pdfMaxDiff receives the largest difference of a coordinate
+*/
+static int countDifferences(const vector<double> &adfX1, const vector<double> &adfY1, const vector<double> &adfZ1,
+							const vector<int> &anSuccess1,
+							const vector<double> &adfX2, const vector<double> &adfY2, const vector<double> &adfZ2,
+							const vector<int> &anSuccess2, double dfTolerance, double *pdfMaxDiff)
+{
+	int nFailed = 0;
+
+	*pdfMaxDiff = 0.0;
+	for(size_t i=0; i<adfX1.size(); ++i){
+		if (anSuccess1[i] != anSuccess2[i]){
+			nFailed++;
+			continue;
+		}
+		if (!anSuccess1[i])
+			continue;
+
+		double dfDiff = std::max(fabs(adfX1[i] - adfX2[i]), 
+								 std::max(fabs(adfY1[i] - adfY2[i]), fabs(adfZ1[i] - adfZ2[i])));
+		*pdfMaxDiff = std::max(*pdfMaxDiff, dfDiff);
+		if (!(dfDiff <= dfTolerance))
+			nFailed++;
+	}
+
+	return nFailed;
+}
+
+//! function to create a transformation between the systems of poCT with a configuration option set
+/*!
+	The option is restored afterwards, it only affects the new transformation.
+*/
+static OGRCoordinateTransformation3D *createReferenceCT(OGRCoordinateTransformation3D *poCT, 
+														const char *pszKey, const char *pszValue)
+{
+	const char *pszOld = CPLGetConfigOption(pszKey, NULL);
+	bool bWasSet = pszOld != NULL;
+	string sOld = bWasSet ? pszOld : "";
+
+	CPLSetConfigOption(pszKey, pszValue);
+	OGRCoordinateTransformation3D *poRefCT = OGRCreateCoordinateTransformation3D(
+		(OGRSpatialReference3D *) poCT->GetSourceCS(), (OGRSpatialReference3D *) poCT->GetTargetCS());
+	CPLSetConfigOption(pszKey, bWasSet ? sOld.c_str() : NULL);
+
+	return poRefCT;
+}
+
+//! function to write a north-up float32 GeoTIFF of nWidth x nHeight cells
+static void createGrid(const char *pszFilename, int nWidth, int nHeight, 
+					   double dfLeft, double dfTop, double dfCell, const vector<float> &afCells)
+{
+	GDALDatasetH hDS = GDALCreate(GDALGetDriverByName("GTiff"), pszFilename, 
+								  nWidth, nHeight, 1, GDT_Float32, NULL);
+	double adfGeoTransform[6] = { dfLeft, dfCell, 0.0, dfTop, 0.0, -dfCell };
+	GDALSetGeoTransform(hDS, adfGeoTransform);
+	GDALSetRasterNoDataValue(GDALGetRasterBand(hDS, 1), -9999.0);
+	GDALRasterIO(GDALGetRasterBand(hDS, 1), GF_Write, 0, 0, nWidth, nHeight, 
+				 (void*)&afCells[0], nWidth, nHeight, GDT_Float32, 0, 0);
+	GDALClose(hDS);
+}
+
+//! function to write an NTv2 file with one smooth subgrid around 16.25 E, 48 N
+static bool createShiftGrid(const char *pszFilename)
+{
+	const double dfSouth = 47.5, dfNorth = 48.5, dfWest = 15.5, dfEast = 17.0, dfInc = 1.0/60.0;
+	const int nRows = 61, nCols = 91;
+
+	VSILFILE *fp = VSIFOpenL(pszFilename, "wb");
+	if (fp == NULL)
+		return false;
+
+	// records of an 8 character label and an int, double or string value
+	struct { const char *pszLabel; char chType; double dfValue; const char *pszValue; } asRecords[] = {
+		{ "NUM_OREC", 'i', 11 }, { "NUM_SREC", 'i', 11 }, { "NUM_FILE", 'i', 1 },
+		{ "GS_TYPE", 's', 0, "SECONDS" }, { "VERSION", 's', 0, "NTv2.0" },
+		{ "SYSTEM_F", 's', 0, "TEST" }, { "SYSTEM_T", 's', 0, "WGS84" },
+		{ "MAJOR_F", 'd', 6377397.155 }, { "MINOR_F", 'd', 6356078.963 },
+		{ "MAJOR_T", 'd', 6378137.0 }, { "MINOR_T", 'd', 6356752.314 },
+		{ "SUB_NAME", 's', 0, "TEST" }, { "PARENT", 's', 0, "NONE" },
+		{ "CREATED", 's', 0, "20140101" }, { "UPDATED", 's', 0, "20140101" },
+		{ "S_LAT", 'd', dfSouth*3600 }, { "N_LAT", 'd', dfNorth*3600 },
+		{ "E_LONG", 'd', -dfEast*3600 }, { "W_LONG", 'd', -dfWest*3600 },
+		{ "LAT_INC", 'd', dfInc*3600 }, { "LONG_INC", 'd', dfInc*3600 },
+		{ "GS_COUNT", 'i', nRows*nCols }
+	};
+
+	for(size_t k=0; k<sizeof(asRecords)/sizeof(asRecords[0]); ++k){
+		char achRecord[16];
+		memset(achRecord, 0, 16);
+		memset(achRecord, ' ', 8);
+		memcpy(achRecord, asRecords[k].pszLabel, strlen(asRecords[k].pszLabel));
+		if (asRecords[k].chType == 'i'){
+			GInt32 nValue = (GInt32) asRecords[k].dfValue;
+			memcpy(achRecord + 8, &nValue, 4);
+		}
+		else if (asRecords[k].chType == 'd')
+			memcpy(achRecord + 8, &asRecords[k].dfValue, 8);
+		else{
+			memset(achRecord + 8, ' ', 8);
+			memcpy(achRecord + 8, asRecords[k].pszValue, strlen(asRecords[k].pszValue));
+		}
+		VSIFWriteL(achRecord, 16, 1, fp);
+	}
+
+	// rows from south to north, every row from east to west, shifts in seconds (longitude positive west)
+	for(int j=0; j<nRows; ++j){
+		double dfLat = dfSouth + j*dfInc;
+		for(int i=0; i<nCols; ++i){
+			double dfLon = dfEast - i*dfInc;
+			float afCell[4];
+			afCell[0] = (float)(1.5 + 0.3*sin(dfLon*7.0) + 0.2*cos(dfLat*13.0));
+			afCell[1] = (float)(-3.0 + 0.4*cos(dfLon*5.0)*sin(dfLat*9.0));
+			afCell[2] = afCell[3] = 0.0f;
+			VSIFWriteL(afCell, sizeof(afCell), 1, fp);
+		}
+	}
+
+	char achEnd[16];
+	memset(achEnd, 0, 16);
+	memcpy(achEnd, "END     ", 8);
+	VSIFWriteL(achEnd, 16, 1, fp);
+
+	return VSIFCloseL(fp) == 0;
+}
+
+//! function to check that the combined raster gives the results of the separate models
+/*!
+	Builds a geoid whose left columns are nodata and a linear height correction
+	on a coarser lattice, so both ways of interpolating agree up to the float32
+	rounding of the combined raster, and compares them on points crossing the
+	nodata edge.
+	\return number of points differing by more than 1e-4 m
+*/
+int checkFusedNoData()
+{
+	const char *pszGeoid = "/vsimem/check_geoid.tif";
+	const char *pszVCorr = "/vsimem/check_vcorr.tif";
+
+	vector<float> afGeoid(20*20), afVCorr(6*6);
+	for(int j=0; j<20; ++j)
+		for(int i=0; i<20; ++i)
+			afGeoid[j*20+i] = (i < 5) ? -9999.0f : (float)(40.0 + 0.1*i + 0.05*j);
+	for(int j=0; j<6; ++j)
+		for(int i=0; i<6; ++i)
+			afVCorr[j*6+i] = (float)(1.0 + 0.2*i - 0.1*j);
+
+	createGrid(pszGeoid, 20, 20, 16.0, 48.0, 0.01, afGeoid);
+	createGrid(pszVCorr, 6, 6, 15.95, 48.05, 0.05, afVCorr);
+
+	OGRSpatialReference3D oSeparate, oFused;
+	OGRSpatialReference3D *apoSRS[2] = { &oSeparate, &oFused };
+	for(int k=0; k<2; ++k){
+		apoSRS[k]->SetWellKnownGeogCS("WGS84");
+		apoSRS[k]->SetFusedModel(k == 1);
+		apoSRS[k]->SetGeoidModel(pszGeoid);
+		apoSRS[k]->SetVCorrModel(pszVCorr);
+		apoSRS[k]->SetVOffset(0.5);
+	}
+
+	// across the nodata edge at 16.05 degrees, in radians
+	const int nPoints = 200;
+	vector<double> adfX(nPoints), adfY(nPoints), adfZ[2];
+	for(int i=0; i<nPoints; ++i){
+		adfX[i] = (16.02 + 0.1*i/nPoints) * DEG_TO_RAD;
+		adfY[i] = (47.9 + 0.01*(i%7)) * DEG_TO_RAD;
+	}
+
+	int nFailed = 0;
+	double dfMaxDiff = 0.0;
+	VerticalScratch oScratch;
+	for(int k=0; k<2; ++k){
+		adfZ[k].assign(nPoints, 0.0);
+		apoSRS[k]->ApplyVerticalCorrection(0, nPoints, &adfX[0], &adfY[0], &adfZ[k][0], &oScratch);
+	}
+
+	if (!oFused.HasFusedModel()){
+		printf("check fused nodata: no combined raster was built\n");
+		nFailed++;
+	}
+
+	for(int i=0; i<nPoints; ++i){
+		double dfDiff = fabs(adfZ[0][i] - adfZ[1][i]);
+		dfMaxDiff = std::max(dfMaxDiff, dfDiff);
+		if (dfDiff > 1e-4)
+			nFailed++;
+	}
+
+	VSIUnlink(pszGeoid);
+	VSIUnlink(pszVCorr);
+
+	return reportCheck("fused nodata", nFailed, dfMaxDiff);
+}
+
+//! function to check that interleaved records are transformed like separate arrays
+/*!
+	Transforms records of four doubles in place with TransformStrided() and
+	compares them with TransformEx() on separate arrays, which has to give
+	identical results and leave the fourth member of the records alone.
+	\return number of differing points
+*/
+int checkStrided(OGRCoordinateTransformation3D *poCT, 
+				 const vector<double> &adfX, const vector<double> &adfY, const vector<double> &adfZ)
+{
+	struct PointRecord { double x, y, z, w; };
+
+	const int nCount = 1000;
+	vector<double> adfRefX, adfRefY, adfRefZ, adfRecX(nCount), adfRecY(nCount), adfRecZ(nCount);
+	vector<int> anRefSuccess(nCount), anRecSuccess(nCount);
+	vector<PointRecord> asRecords(nCount);
+
+	expandPoints(adfX, adfY, adfZ, nCount, adfRefX, adfRefY, adfRefZ);
+	for(int i=0; i<nCount; ++i){
+		asRecords[i].x = adfRefX[i];
+		asRecords[i].y = adfRefY[i];
+		asRecords[i].z = adfRefZ[i];
+		asRecords[i].w = i;
+	}
+
+	poCT->TransformEx(nCount, &adfRefX[0], &adfRefY[0], &adfRefZ[0], &anRefSuccess[0]);
+	poCT->TransformStrided(nCount, &asRecords[0].x, &asRecords[0].y, &asRecords[0].z, 
+						   sizeof(PointRecord), &anRecSuccess[0]);
+
+	int nFailed = 0;
+	for(int i=0; i<nCount; ++i){
+		adfRecX[i] = asRecords[i].x;
+		adfRecY[i] = asRecords[i].y;
+		adfRecZ[i] = asRecords[i].z;
+		if (asRecords[i].w != i)
+			nFailed++;
+	}
+
+	double dfMaxDiff;
+	nFailed += countDifferences(adfRecX, adfRecY, adfRecZ, anRecSuccess, 
+								adfRefX, adfRefY, adfRefZ, anRefSuccess, 0.0, &dfMaxDiff);
+
+	return reportCheck("strided records", nFailed, dfMaxDiff);
+}
+
+//! function to check that TransformTo() gives the results of TransformEx()
+/*!
+	The input arrays have to stay untouched, and the results have to be
+	identical, also when the output arrays are the input arrays.
+	\return number of differing points
+*/
+int checkTransformTo(OGRCoordinateTransformation3D *poCT, 
+					 const vector<double> &adfX, const vector<double> &adfY, const vector<double> &adfZ)
+{
+	const int nCount = 1000;
+	vector<double> adfInX, adfInY, adfInZ;
+	vector<double> adfOutX(nCount), adfOutY(nCount), adfOutZ(nCount);
+	vector<int> anRefSuccess(nCount), anSuccess(nCount);
+
+	expandPoints(adfX, adfY, adfZ, nCount, adfInX, adfInY, adfInZ);
+	const vector<double> adfSrcX = adfInX, adfSrcY = adfInY, adfSrcZ = adfInZ;
+	vector<double> adfRefX = adfInX, adfRefY = adfInY, adfRefZ = adfInZ;
+
+	poCT->TransformEx(nCount, &adfRefX[0], &adfRefY[0], &adfRefZ[0], &anRefSuccess[0]);
+	poCT->TransformTo(nCount, &adfInX[0], &adfInY[0], &adfInZ[0], 
+					  &adfOutX[0], &adfOutY[0], &adfOutZ[0], &anSuccess[0]);
+
+	int nFailed = 0;
+	double dfMaxDiff, dfMaxInPlace;
+	vector<int> anAll(nCount, TRUE);
+	nFailed += countDifferences(adfInX, adfInY, adfInZ, anAll, adfSrcX, adfSrcY, adfSrcZ, anAll, 0.0, &dfMaxDiff);
+	nFailed += countDifferences(adfOutX, adfOutY, adfOutZ, anSuccess, 
+								adfRefX, adfRefY, adfRefZ, anRefSuccess, 0.0, &dfMaxDiff);
+
+	// output arrays which are the input arrays
+	poCT->TransformTo(nCount, &adfInX[0], &adfInY[0], &adfInZ[0], 
+					  &adfInX[0], &adfInY[0], &adfInZ[0], &anSuccess[0]);
+	nFailed += countDifferences(adfInX, adfInY, adfInZ, anSuccess, 
+								adfRefX, adfRefY, adfRefZ, anRefSuccess, 0.0, &dfMaxInPlace);
+
+	return reportCheck("TransformTo", nFailed, std::max(dfMaxDiff, dfMaxInPlace));
+}
+
+//! function to check that batches split over several threads give the results of one thread
+/*!
+	The reference is a transformation created with SPATIALREF3D_TRANSFORM_THREADS=1,
+	the results have to be identical.
+	\return number of differing points
+*/
+int checkThreads(OGRCoordinateTransformation3D *poCT, 
+				 const vector<double> &adfX, const vector<double> &adfY, const vector<double> &adfZ)
+{
+	// enough points for every thread to get a chunk
+	const int nCount = 40000;
+	vector<double> adfRefX, adfRefY, adfRefZ;
+	vector<int> anRefSuccess(nCount), anSuccess(nCount);
+
+	expandPoints(adfX, adfY, adfZ, nCount, adfRefX, adfRefY, adfRefZ);
+	vector<double> adfMTX = adfRefX, adfMTY = adfRefY, adfMTZ = adfRefZ;
+
+	OGRCoordinateTransformation3D *poRefCT = createReferenceCT(poCT, "SPATIALREF3D_TRANSFORM_THREADS", "1");
+	if (poRefCT == NULL)
+		return reportCheck("threads", 1, 0.0);
+	poRefCT->TransformEx(nCount, &adfRefX[0], &adfRefY[0], &adfRefZ[0], &anRefSuccess[0]);
+	delete poRefCT;
+
+	int nThreads = poCT->GetThreadCount();
+	poCT->SetThreadCount(4);
+	poCT->TransformEx(nCount, &adfMTX[0], &adfMTY[0], &adfMTZ[0], &anSuccess[0]);
+	poCT->SetThreadCount(nThreads);
+
+	double dfMaxDiff;
+	int nFailed = countDifferences(adfMTX, adfMTY, adfMTZ, anSuccess, 
+								   adfRefX, adfRefY, adfRefZ, anRefSuccess, 0.0, &dfMaxDiff);
+
+	return reportCheck("threads", nFailed, dfMaxDiff);
+}
+
+//! function to check that the inverse grid shift undoes the forward one
+/*!
+	Shifts points with a grid (see createShiftGrid()) to WGS84 and back, the
+	way back solves for the source position by Newton iteration. Every point 
+	has to converge inside the grid and arrive within 1e-9 degrees of where 
+	it started.
+	\return number of points failing
+*/
+int checkInverseGridShift()
+{
+	CPLString osGrid = CPLGenerateTempFilename("ct3d_check");
+	osGrid += ".gsb";
+	if (!createShiftGrid(osGrid)){
+		printf("check inverse grid shift: cannot write %s\n", osGrid.c_str());
+		return 1;
+	}
+
+	OGRSpatialReference3D oGridSRS, oWGS84;
+	oGridSRS.importFromProj4(CPLSPrintf("+proj=longlat +ellps=bessel +nadgrids=%s +wktext +no_defs", osGrid.c_str()));
+	oWGS84.SetWellKnownGeogCS("WGS84");
+
+	OGRCoordinateTransformation3D *poForward = OGRCreateCoordinateTransformation3D(&oGridSRS, &oWGS84);
+	OGRCoordinateTransformation3D *poInverse = OGRCreateCoordinateTransformation3D(&oWGS84, &oGridSRS);
+
+	const int nCount = 500;
+	vector<double> adfX(nCount), adfY(nCount), adfZ(nCount, 100.0);
+	vector<int> anSuccess(nCount, FALSE), anInverseSuccess(nCount, FALSE);
+	for(int i=0; i<nCount; ++i){
+		adfX[i] = 15.6 + 1.3 * ((i * 37) % nCount) / nCount;
+		adfY[i] = 47.6 + 0.8 * ((i * 53) % nCount) / nCount;
+	}
+	const vector<double> adfSrcX = adfX, adfSrcY = adfY, adfSrcZ = adfZ;
+
+	GridShiftStats sStats;
+	memset(&sStats, 0, sizeof(sStats));
+	if (poForward != NULL && poInverse != NULL){
+		poForward->TransformEx(nCount, &adfX[0], &adfY[0], &adfZ[0], &anSuccess[0]);
+		poInverse->ResetGridShiftStats();
+		poInverse->TransformEx(nCount, &adfX[0], &adfY[0], &adfZ[0], &anInverseSuccess[0]);
+		poInverse->GetGridShiftStats(&sStats);
+	}
+
+	int nFailed = 0;
+	double dfMaxDiff = 0.0;
+	for(int i=0; i<nCount; ++i){
+		double dfDiff = std::max(fabs(adfX[i] - adfSrcX[i]), fabs(adfY[i] - adfSrcY[i]));
+		dfMaxDiff = std::max(dfMaxDiff, dfDiff);
+		if (!anSuccess[i] || !anInverseSuccess[i] || !(dfDiff <= 1e-9))
+			nFailed++;
+	}
+
+	if (sStats.nInversePoints != (GUIntBig) nCount || sStats.nNotConverged != 0 || sStats.nEdgeFallbacks != 0){
+		printf("check inverse grid shift: %d points shifted inversely, %d not converged, %d at the edge\n",
+			   (int) sStats.nInversePoints, (int) sStats.nNotConverged, (int) sStats.nEdgeFallbacks);
+		nFailed++;
+	}
+
+	delete poForward;
+	delete poInverse;
+	VSIUnlink(osGrid);
+
+	return reportCheck("inverse grid shift", nFailed, dfMaxDiff);
+}
+
+//! function to check that a composed datum shift gives the results of the separate shifts
+/*!
+	Transforms points between two systems with 7 parameter datum shifts (MGI
+	and DHDN). The reference is a transformation created with 
+	SPATIALREF3D_COMPOSE_HELMERT=NO, which applies both shifts one after the 
+	other. The results may only differ by rounding, at most 1e-9 degrees and 
+	1e-6 m in height.
+	\return number of differing points
+*/
+int checkComposedHelmert()
+{
+	OGRSpatialReference3D oMGI, oDHDN;
+	oMGI.importFromProj4("+proj=longlat +ellps=bessel +towgs84=577.326,90.129,463.919,5.137,1.474,5.297,2.4232 +no_defs");
+	oDHDN.importFromProj4("+proj=longlat +ellps=bessel +towgs84=598.1,73.7,418.2,0.202,0.045,-2.455,6.7 +no_defs");
+
+	const int nCount = 1000;
+	vector<double> adfX(nCount), adfY(nCount), adfZ(nCount);
+	vector<int> anRefSuccess(nCount), anSuccess(nCount);
+	for(int i=0; i<nCount; ++i){
+		adfX[i] = 9.5 + 8.0 * ((i * 37) % nCount) / nCount;
+		adfY[i] = 46.5 + 2.5 * ((i * 53) % nCount) / nCount;
+		adfZ[i] = 200.0 + (i % 31) * 100.0;
+	}
+	vector<double> adfRefX = adfX, adfRefY = adfY, adfRefZ = adfZ;
+
+	OGRCoordinateTransformation3D *poCT = OGRCreateCoordinateTransformation3D(&oMGI, &oDHDN);
+	OGRCoordinateTransformation3D *poRefCT = poCT ? createReferenceCT(poCT, "SPATIALREF3D_COMPOSE_HELMERT", "NO") : NULL;
+	if (poRefCT == NULL){
+		delete poCT;
+		return reportCheck("composed datum shift", 1, 0.0);
+	}
+
+	poCT->TransformEx(nCount, &adfX[0], &adfY[0], &adfZ[0], &anSuccess[0]);
+	poRefCT->TransformEx(nCount, &adfRefX[0], &adfRefY[0], &adfRefZ[0], &anRefSuccess[0]);
+	delete poCT;
+	delete poRefCT;
+
+	// heights are compared separately with their own tolerance
+	vector<double> adfNone(nCount, 0.0);
+	double dfMaxDiff, dfMaxDiffZ;
+	int nFailed = countDifferences(adfX, adfY, adfNone, anSuccess, 
+								   adfRefX, adfRefY, adfNone, anRefSuccess, 1e-9, &dfMaxDiff);
+	nFailed += countDifferences(adfNone, adfNone, adfZ, anSuccess, 
+								adfNone, adfNone, adfRefZ, anRefSuccess, 1e-6, &dfMaxDiffZ);
+
+	return reportCheck("composed datum shift", nFailed, std::max(dfMaxDiff, dfMaxDiffZ));
+}
+
+//! function to check the vectorized geodetic <-> geocentric conversions against PROJ.4
+/*!
+	Converts points between Bessel geodetic and geocentric coordinates both 
+	ways. The reference is a transformation created with 
+	SPATIALREF3D_GEOCENTRIC_SIMD=NO, which uses PROJ.4 for every point. The 
+	geocentric coordinates and the heights may differ by 1e-8 m at most, the
+	geodetic coordinates by 1e-13 degrees (about 1e-8 m).
+	\return number of differing points
+*/
+int checkGeocentricSIMD()
+{
+	OGRSpatialReference3D oGeodetic, oGeocentric;
+	oGeodetic.importFromProj4("+proj=longlat +ellps=bessel +no_defs");
+	oGeocentric.importFromProj4("+proj=geocent +ellps=bessel +units=m +no_defs");
+
+	const int nCount = 1000;
+	vector<double> adfX(nCount), adfY(nCount), adfZ(nCount);
+	for(int i=0; i<nCount; ++i){
+		adfX[i] = -180.0 + 360.0 * ((i * 37) % nCount) / nCount;
+		adfY[i] = -89.9 + 179.8 * ((i * 53) % nCount) / nCount;
+		adfZ[i] = -100.0 + (i % 31) * 300.0;
+	}
+
+	int nFailed = 0;
+	double dfMaxDiff = 0.0;
+	OGRCoordinateTransformation3D *apoCT[2] = {
+		OGRCreateCoordinateTransformation3D(&oGeodetic, &oGeocentric),
+		OGRCreateCoordinateTransformation3D(&oGeocentric, &oGeodetic) };
+
+	for(int k=0; k<2; ++k){
+		OGRCoordinateTransformation3D *poRefCT = apoCT[k] ? createReferenceCT(apoCT[k], "SPATIALREF3D_GEOCENTRIC_SIMD", "NO") : NULL;
+		if (poRefCT == NULL){
+			nFailed++;
+			delete apoCT[k];
+			continue;
+		}
+
+		vector<double> adfRefX = adfX, adfRefY = adfY, adfRefZ = adfZ;
+		vector<int> anRefSuccess(nCount), anSuccess(nCount);
+		poRefCT->TransformEx(nCount, &adfRefX[0], &adfRefY[0], &adfRefZ[0], &anRefSuccess[0]);
+		apoCT[k]->TransformEx(nCount, &adfX[0], &adfY[0], &adfZ[0], &anSuccess[0]);
+		delete poRefCT;
+		delete apoCT[k];
+
+		// geodetic results are compared separately from their heights
+		vector<double> adfNone(nCount, 0.0);
+		double dfDiff, dfDiffZ;
+		if (k == 0)
+			nFailed += countDifferences(adfX, adfY, adfZ, anSuccess, 
+										adfRefX, adfRefY, adfRefZ, anRefSuccess, 1e-8, &dfDiff);
+		else{
+			nFailed += countDifferences(adfX, adfY, adfNone, anSuccess, 
+										adfRefX, adfRefY, adfNone, anRefSuccess, 1e-13, &dfDiff);
+			nFailed += countDifferences(adfNone, adfNone, adfZ, anSuccess, 
+										adfNone, adfNone, adfRefZ, anRefSuccess, 1e-8, &dfDiffZ);
+			dfDiff = std::max(dfDiff, dfDiffZ);
+		}
+		dfMaxDiff = std::max(dfMaxDiff, dfDiff);
+
+		// the way back starts from the geocentric coordinates of PROJ.4
+		adfX = adfRefX;
+		adfY = adfRefY;
+		adfZ = adfRefZ;
+	}
+
+	return reportCheck("geocentric kernel", nFailed, dfMaxDiff);
+}
+
+//! function to run every check
+/*!
+	\param poCT transformation of the input points
+	\param adfX, adfY, adfZ input points
+	\return number of failed points of all checks
+*/
+int runChecks(OGRCoordinateTransformation3D *poCT, 
+			  const vector<double> &adfX, const vector<double> &adfY, const vector<double> &adfZ)
+{
+	int nFailed = 0;
+
+	nFailed += checkFusedNoData();
+	nFailed += checkStrided(poCT, adfX, adfY, adfZ);
+	nFailed += checkTransformTo(poCT, adfX, adfY, adfZ);
+	nFailed += checkThreads(poCT, adfX, adfY, adfZ);
+	nFailed += checkInverseGridShift();
+	nFailed += checkComposedHelmert();
+	nFailed += checkGeocentricSIMD();
+
+	return nFailed;
+}
+
 //! program's entry point
 int main(int argc, char* argv[])
 {
@@ -106,6 +789,9 @@ int main(int argc, char* argv[])
 
 	parser.add_option("-i", "--input-coord").dest("input_file").help("set input coordinate data FILE").metavar("FILE");
 
+	parser.add_option("-c", "--check").dest("check").action("store_true").help("check the transformation against reference paths");
+	parser.add_option("-a", "--check-alloc").dest("check_alloc").action("store_true").help("check that repeated transformations allocate no memory");
+
 	optparse::Values options = parser.parse_args(argc, argv);
 	vector<string> args = parser.args();
 
@@ -170,6 +856,7 @@ int main(int argc, char* argv[])
 	}
 
 	
+	vector<double> adfInputX, adfInputY, adfInputZ;
 	string line="";
 	while(!inFile.eof()){
 		getline(inFile, line);
@@ -181,6 +868,11 @@ int main(int argc, char* argv[])
 
 		ss >> sourcex >> sourcey >> sourcez;
 
+		if (!ss.fail()){
+			adfInputX.push_back(sourcex);
+			adfInputY.push_back(sourcey);
+			adfInputZ.push_back(sourcez);
+		}
 
 		double targetx = sourcex;
 		double targety = sourcey;
@@ -194,6 +886,30 @@ int main(int argc, char* argv[])
 			printf( "(%f, %f, %f) -> (%f, %f, %f)\n", sourcex, sourcey, sourcez, targetx, targety, targetz );
 	}
 
+	if (options.get("check") && poCT != NULL){
+		GDALAllRegister();
+		if (runChecks(poCT, adfInputX, adfInputY, adfInputZ) > 0){
+			cerr << "checks failed" << endl;
+			return 1;
+		}
+		cout << "checks passed" << endl;
+		if (!options.get("check_alloc"))
+			return 0;
+	}
+
+	if (options.get("check_alloc") && poCT != NULL){
+		long nAllocs = checkAllocations(poCT, adfInputX, adfInputY, adfInputZ);
+		if (nAllocs < 0)
+			cout << "allocation check not supported on this platform" << endl;
+		else if (nAllocs > 0){
+			cerr << "allocation check failed: " << nAllocs << " allocations in repeated transformations" << endl;
+			return 1;
+		}
+		else
+			cout << "allocation check passed" << endl;
+		return 0;
+	}
+
 	cout << "Press ENTER to exit.";
 	cin.get();
 